@@ -0,0 +1,1020 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "bench.h"
+#include "render.h"
+#include "contents.h"
+#include "escape.h"
+#include "inline.h"
+
+#define DEFAULT_ITERATIONS 200
+#define DEFAULT_SECONDS 2.0
+#define DEFAULT_SERVER "./mmhd"
+#define DEFAULT_HOST "127.0.0.1"
+#define DEFAULT_PORT 18888
+#define DEFAULT_CONCURRENCY 8
+#define DEFAULT_REQUESTS 20000
+
+#define BENCH_ESCAPE_RANDOM 512
+#define BENCH_ESCAPE_UNIT 65536
+
+#define BENCH_INLINE_FUZZ 2000
+#define BENCH_INLINE_SIZE 4096
+
+#define BENCH_EXTENSIONS (HOEDOWN_EXT_TABLES | HOEDOWN_EXT_FENCED_CODE \
+                          | HOEDOWN_EXT_FOOTNOTES | HOEDOWN_EXT_AUTOLINK \
+                          | HOEDOWN_EXT_STRIKETHROUGH)
+
+/* every extension with an active char */
+#define BENCH_INLINE_EXTENSIONS (BENCH_EXTENSIONS \
+                                 | HOEDOWN_EXT_NO_INTRA_EMPHASIS \
+                                 | HOEDOWN_EXT_UNDERLINE \
+                                 | HOEDOWN_EXT_SUPERSCRIPT \
+                                 | HOEDOWN_EXT_HIGHLIGHT \
+                                 | HOEDOWN_EXT_QUOTE \
+                                 | HOEDOWN_EXT_SPECIAL_ATTRIBUTE)
+
+typedef struct bench_file {
+    char *name;
+    uint8_t *data;
+    size_t size;
+} bench_file_t;
+
+static size_t iterations = DEFAULT_ITERATIONS;
+static double seconds = DEFAULT_SECONDS;
+
+double
+bench_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+}
+
+int
+bench_samples_add(bench_samples_t *samples, double msec)
+{
+    if (samples->count == samples->alloc) {
+        size_t alloc = samples->alloc ? samples->alloc * 2 : 1024;
+        double *data = realloc(samples->data, alloc * sizeof(double));
+        if (!data) {
+            return -1;
+        }
+        samples->data = data;
+        samples->alloc = alloc;
+    }
+
+    samples->data[samples->count++] = msec;
+
+    return 0;
+}
+
+void
+bench_samples_free(bench_samples_t *samples)
+{
+    free(samples->data);
+    memset(samples, 0, sizeof(bench_samples_t));
+}
+
+static int
+bench_compare(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static double
+bench_percentile(bench_samples_t *samples, double p)
+{
+    size_t i;
+
+    if (samples->count == 0) {
+        return 0;
+    }
+
+    i = (size_t)(p * (samples->count - 1) + 0.5);
+
+    return samples->data[i];
+}
+
+void
+bench_report(const char *bench, const char *name,
+             bench_samples_t *samples, double elapsed, uint64_t bytes)
+{
+    qsort(samples->data, samples->count, sizeof(double), &bench_compare);
+
+    printf("{\"bench\":\"%s\",\"case\":\"%s\",\"count\":%zu,"
+           "\"seconds\":%.6f,\"ops_per_sec\":%.1f,\"mb_per_sec\":%.2f,"
+           "\"p50_us\":%.2f,\"p99_us\":%.2f,\"p999_us\":%.2f}\n",
+           bench, name, samples->count, elapsed / 1000.0,
+           elapsed > 0 ? samples->count * 1000.0 / elapsed : 0,
+           elapsed > 0 ? bytes / 1048.576 / elapsed : 0,
+           bench_percentile(samples, 0.50) * 1000.0,
+           bench_percentile(samples, 0.99) * 1000.0,
+           bench_percentile(samples, 0.999) * 1000.0);
+    fflush(stdout);
+}
+
+static int
+bench_load(bench_file_t *file, const char *dir, const char *name)
+{
+    char path[PATH_MAX];
+    struct stat st;
+    FILE *fp;
+
+    snprintf(path, sizeof(path), "%s%s", dir, name);
+    if (stat(path, &st) != 0) {
+        return -1;
+    }
+
+    file->name = (char *)name;
+    file->size = st.st_size;
+    file->data = (uint8_t *)malloc(file->size + 1);
+    if (!file->data) {
+        return -1;
+    }
+
+    fp = fopen(path, "r");
+    if (!fp || fread(file->data, 1, file->size, fp) != file->size) {
+        if (fp) {
+            fclose(fp);
+        }
+        free(file->data);
+        return -1;
+    }
+    fclose(fp);
+
+    return 0;
+}
+
+/* repeated until the iterations or the time budget are used up */
+static void
+bench_render_files(const char *name, bench_file_t *files, size_t count,
+                   unsigned int html)
+{
+    bench_samples_t samples = { NULL, 0, 0 };
+    double start, t, elapsed = 0;
+    uint64_t bytes = 0;
+    render_t *render;
+    size_t i, n;
+
+    render = render_get(BENCH_EXTENSIONS);
+    if (render == NULL) {
+        return;
+    }
+
+    start = bench_now();
+    for (n = 0; n < iterations && elapsed < seconds * 1000.0; n++) {
+        for (i = 0; i < count; i++) {
+            /* render_markdown() appends, each render starts empty */
+            render->ob->size = 0;
+            render->toc->size = 0;
+            t = bench_now();
+            render_markdown(render, files[i].data, files[i].size,
+                            html, HOWDOWN_TOC_STARING, HOWDOWN_TOC_NESTING);
+            bench_samples_add(&samples, bench_now() - t);
+            bytes += files[i].size;
+        }
+        elapsed = bench_now() - start;
+    }
+
+    bench_report(html & HOEDOWN_HTML_TOC ? "render_toc" : "render",
+                 name, &samples, elapsed, bytes);
+    bench_samples_free(&samples);
+}
+
+static void
+bench_contents(bench_file_t *file)
+{
+    bench_samples_t samples = { NULL, 0, 0 };
+    double start, t, elapsed = 0;
+    uint64_t bytes = 0;
+    contents_t *contents;
+    render_t *render;
+    size_t n;
+
+    render = render_get(BENCH_EXTENSIONS);
+    if (render == NULL) {
+        return;
+    }
+    render_markdown(render, file->data, file->size, HOEDOWN_HTML_TOC,
+                    HOWDOWN_TOC_STARING, HOWDOWN_TOC_NESTING);
+
+    start = bench_now();
+    for (n = 0; n < iterations * 100 && elapsed < seconds * 1000.0; n++) {
+        t = bench_now();
+        contents = contents_generate((const char *)render->ob->data,
+                                     render->ob->size,
+                                     (const char *)render->toc->data,
+                                     render->toc->size, NULL);
+        if (contents) {
+            bytes += contents->length;
+            contents_free(contents);
+        }
+        bench_samples_add(&samples, bench_now() - t);
+        if (n % 64 == 0) {
+            elapsed = bench_now() - start;
+        }
+    }
+    elapsed = bench_now() - start;
+
+    bench_report("contents_generate", file->name, &samples, elapsed, bytes);
+    bench_samples_free(&samples);
+}
+
+static int
+bench_render(const char *dir)
+{
+    bench_file_t *files, *small;
+    size_t count, i, nsmall = 0, nfiles = 0;
+    char **names;
+
+    names = corpus_list(dir, &count);
+    if (count == 0) {
+        fprintf(stderr, "mmhd_bench: no markdown files in %s\n", dir);
+        return -1;
+    }
+
+    files = (bench_file_t *)calloc(count, sizeof(bench_file_t));
+    small = (bench_file_t *)calloc(count, sizeof(bench_file_t));
+    if (!files || !small) {
+        free(files);
+        free(small);
+        corpus_free(names, count);
+        return -1;
+    }
+
+    /* files under small/ are rendered as one case */
+    for (i = 0; i < count; i++) {
+        if (strncmp(names[i], "/small/", 7) == 0) {
+            if (bench_load(&small[nsmall], dir, names[i]) == 0) {
+                nsmall++;
+            }
+        } else if (bench_load(&files[nfiles], dir, names[i]) == 0) {
+            nfiles++;
+        }
+    }
+
+    for (i = 0; i < nfiles; i++) {
+        bench_render_files(files[i].name, &files[i], 1, 0);
+        bench_render_files(files[i].name, &files[i], 1, HOEDOWN_HTML_TOC);
+    }
+    if (nsmall) {
+        bench_render_files("/small/*", small, nsmall, 0);
+        bench_render_files("/small/*", small, nsmall, HOEDOWN_HTML_TOC);
+    }
+
+    for (i = 0; i < nfiles; i++) {
+        if (strcmp(files[i].name, "/mixed.md") == 0) {
+            bench_contents(&files[i]);
+        }
+    }
+
+    for (i = 0; i < nfiles; i++) {
+        free(files[i].data);
+    }
+    for (i = 0; i < nsmall; i++) {
+        free(small[i].data);
+    }
+    free(files);
+    free(small);
+    corpus_free(names, count);
+
+    return 0;
+}
+
+/* byte-for-byte against the loop of hoedown */
+static int
+bench_escape_check(escape_kernel_t kernel, const uint8_t *data, size_t size,
+                   int secure, hoedown_buffer *expect, hoedown_buffer *ob)
+{
+    expect->size = 0;
+    ob->size = 0;
+    hoedown_escape_html_scalar(expect, data, size, secure);
+    escape_html_kernel(kernel, ob, data, size, secure);
+
+    if (expect->size != ob->size
+        || memcmp(expect->data, ob->data, ob->size) != 0) {
+        fprintf(stderr, "mmhd_bench: escape %s differs: size %zu%s\n",
+                escape_kernel_name(kernel), size,
+                secure ? " (secure)" : "");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * corpus files, every length and alignment of a random buffer that is
+ * dense in escaped bytes and their neighbours, and all byte values
+ */
+static int
+bench_escape_verify(escape_kernel_t kernel, bench_file_t *files,
+                    size_t count, hoedown_buffer *expect, hoedown_buffer *ob)
+{
+    static const char near[] = "\"&'/<>%()+.;=?\xa2\xa6\xa7\xaf\xbc\xbe";
+    uint8_t data[BENCH_ESCAPE_RANDOM + 64], all[256];
+    size_t i, size, offset;
+    int secure;
+
+    srand(1);
+    for (i = 0; i < sizeof(all); i++) {
+        all[i] = (uint8_t)i;
+    }
+    for (i = 0; i < sizeof(data); i++) {
+        if (rand() % 4 == 0) {
+            data[i] = near[rand() % (sizeof(near) - 1)];
+        } else {
+            data[i] = (uint8_t)rand();
+        }
+    }
+
+    for (secure = 0; secure <= 1; secure++) {
+        for (i = 0; i < count; i++) {
+            if (bench_escape_check(kernel, files[i].data, files[i].size,
+                                   secure, expect, ob) != 0) {
+                return -1;
+            }
+        }
+        for (offset = 0; offset < 64; offset++) {
+            for (size = 0; size <= BENCH_ESCAPE_RANDOM; size++) {
+                if (bench_escape_check(kernel, data + offset, size, secure,
+                                       expect, ob) != 0) {
+                    return -1;
+                }
+            }
+        }
+        if (bench_escape_check(kernel, all, sizeof(all), secure,
+                               expect, ob) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void
+bench_escape_files(const char *name, int kernel, bench_file_t *files,
+                   size_t count, hoedown_buffer *ob)
+{
+    bench_samples_t samples = { NULL, 0, 0 };
+    double start, t, elapsed = 0;
+    uint64_t bytes = 0;
+    size_t i, n;
+
+    start = bench_now();
+    for (n = 0; n < iterations && elapsed < seconds * 1000.0; n++) {
+        for (i = 0; i < count; i++) {
+            ob->size = 0;
+            t = bench_now();
+            if (kernel < 0) {
+                hoedown_escape_html_scalar(ob, files[i].data,
+                                           files[i].size, 0);
+            } else {
+                escape_html_kernel(kernel, ob, files[i].data,
+                                   files[i].size, 0);
+            }
+            bench_samples_add(&samples, bench_now() - t);
+            bytes += files[i].size;
+        }
+        elapsed = bench_now() - start;
+    }
+
+    bench_report("escape", name, &samples, elapsed, bytes);
+    bench_samples_free(&samples);
+}
+
+/* kernels the cpu supports, checked then timed against hoedown */
+static int
+bench_escape(const char *dir)
+{
+    hoedown_buffer *expect, *ob;
+    bench_file_t *files;
+    size_t count, i, nfiles = 0;
+    char **names;
+    int kernel, ret = 0;
+
+    names = corpus_list(dir, &count);
+    if (count == 0) {
+        fprintf(stderr, "mmhd_bench: no markdown files in %s\n", dir);
+        return -1;
+    }
+
+    files = (bench_file_t *)calloc(count, sizeof(bench_file_t));
+    expect = hoedown_buffer_new(BENCH_ESCAPE_UNIT);
+    ob = hoedown_buffer_new(BENCH_ESCAPE_UNIT);
+    if (!files || !expect || !ob) {
+        ret = -1;
+        goto out;
+    }
+
+    for (i = 0; i < count; i++) {
+        if (bench_load(&files[nfiles], dir, names[i]) == 0) {
+            nfiles++;
+        }
+    }
+
+    for (kernel = 0; kernel <= (int)escape_kernel(); kernel++) {
+        if (bench_escape_verify(kernel, files, nfiles, expect, ob) != 0) {
+            ret = -1;
+            goto out;
+        }
+    }
+
+    bench_escape_files("hoedown", -1, files, nfiles, ob);
+    for (kernel = 0; kernel <= (int)escape_kernel(); kernel++) {
+        bench_escape_files(escape_kernel_name(kernel), kernel,
+                           files, nfiles, ob);
+    }
+
+out:
+    for (i = 0; i < nfiles; i++) {
+        free(files[i].data);
+    }
+    free(files);
+    if (expect) {
+        hoedown_buffer_free(expect);
+    }
+    if (ob) {
+        hoedown_buffer_free(ob);
+    }
+    corpus_free(names, count);
+
+    return ret;
+}
+
+/*
+ * random markdown: inline markup, entities, line breaks and bytes above
+ * ascii between plain runs of every length up to a vector and a half
+ */
+static size_t
+bench_inline_fuzz(uint8_t *data, size_t max)
+{
+    static const char *pieces[] = {
+        "*", "**", "_", "__", "`", "``", "~~", "^", "==", "\"", "\\",
+        "\\*", "[", "]", "(", ")", "![", "](", "{", "}", "<", ">", "&",
+        "&amp;", "&#39;", "'", ":", "@", "www.", "http://", "mailto:",
+        "#", "|", "-", "1. ", "> ", "    ", "\t", "  \n", "\n", "\n\n",
+        "\xc3\xa9", "\xe2\x80\x94", "\x80", "\xff"
+    };
+    static const char text[] = "abcdefghijklmnopqrstuvwxyz ";
+    size_t size = 0, len, i, n;
+    const char *piece;
+
+    n = rand() % max;
+    while (size < n) {
+        if (rand() % 2) {
+            len = rand() % 48;
+            for (i = 0; i < len && size < max; i++) {
+                data[size++] = text[rand() % (sizeof(text) - 1)];
+            }
+        } else {
+            piece = pieces[rand() % (sizeof(pieces) / sizeof(pieces[0]))];
+            len = strlen(piece);
+            if (size + len > max) {
+                break;
+            }
+            memcpy(data + size, piece, len);
+            size += len;
+        }
+    }
+
+    return size;
+}
+
+/* html of each kernel byte-for-byte against the byte loop of hoedown */
+static int
+bench_inline_check(const char *name, unsigned int extensions,
+                   const uint8_t *data, size_t size, hoedown_buffer *expect)
+{
+    render_t *render;
+    int kernel;
+
+    for (kernel = INLINE_SCALAR; kernel <= (int)inline_kernel(); kernel++) {
+        /* a new render appends to ob */
+        render = render_get(extensions);
+        if (render == NULL) {
+            return -1;
+        }
+
+        inline_kernel_set(kernel);
+        render_markdown(render, data, size, 0,
+                        HOWDOWN_TOC_STARING, HOWDOWN_TOC_NESTING);
+
+        if (kernel == INLINE_SCALAR) {
+            expect->size = 0;
+            hoedown_buffer_put(expect, render->ob->data, render->ob->size);
+        } else if (expect->size != render->ob->size
+                   || memcmp(expect->data, render->ob->data,
+                             expect->size) != 0) {
+            fprintf(stderr, "mmhd_bench: inline %s differs: %s,"
+                    " extensions 0x%x\n",
+                    inline_kernel_name(kernel), name, extensions);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* corpus files and the fuzzed documents with and without extensions */
+static int
+bench_inline_verify(bench_file_t *files, size_t count,
+                    hoedown_buffer *expect)
+{
+    static const unsigned int extensions[] = {
+        0, BENCH_EXTENSIONS, BENCH_INLINE_EXTENSIONS
+    };
+    uint8_t data[BENCH_INLINE_SIZE];
+    char name[32];
+    size_t i, e, size;
+    int ret = 0;
+
+    for (e = 0; e < sizeof(extensions) / sizeof(extensions[0]); e++) {
+        for (i = 0; i < count && ret == 0; i++) {
+            ret = bench_inline_check(files[i].name, extensions[e],
+                                     files[i].data, files[i].size, expect);
+        }
+        srand(1);
+        for (i = 0; i < BENCH_INLINE_FUZZ && ret == 0; i++) {
+            size = bench_inline_fuzz(data, sizeof(data));
+            snprintf(name, sizeof(name), "fuzz %zu", i);
+            ret = bench_inline_check(name, extensions[e], data, size,
+                                     expect);
+        }
+    }
+
+    inline_kernel_set(inline_kernel());
+
+    return ret;
+}
+
+static void
+bench_inline_files(int kernel, bench_file_t *files, size_t count)
+{
+    bench_samples_t samples = { NULL, 0, 0 };
+    double start, t, elapsed = 0;
+    uint64_t bytes = 0;
+    render_t *render;
+    size_t i, n;
+
+    inline_kernel_set(kernel);
+
+    start = bench_now();
+    for (n = 0; n < iterations && elapsed < seconds * 1000.0; n++) {
+        for (i = 0; i < count; i++) {
+            t = bench_now();
+            render = render_get(BENCH_EXTENSIONS);
+            if (render == NULL) {
+                break;
+            }
+            render_markdown(render, files[i].data, files[i].size, 0,
+                            HOWDOWN_TOC_STARING, HOWDOWN_TOC_NESTING);
+            bench_samples_add(&samples, bench_now() - t);
+            bytes += files[i].size;
+        }
+        elapsed = bench_now() - start;
+    }
+
+    inline_kernel_set(inline_kernel());
+
+    bench_report("inline", inline_kernel_name(kernel),
+                 &samples, elapsed, bytes);
+    bench_samples_free(&samples);
+}
+
+/*
+ * inline scan kernels the cpu supports: the rendered html is checked
+ * against the scalar scan, then the corpus render is timed with each
+ */
+static int
+bench_inline(const char *dir)
+{
+    hoedown_buffer *expect;
+    bench_file_t *files;
+    size_t count, i, nfiles = 0;
+    char **names;
+    int kernel, ret = 0;
+
+    names = corpus_list(dir, &count);
+    if (count == 0) {
+        fprintf(stderr, "mmhd_bench: no markdown files in %s\n", dir);
+        return -1;
+    }
+
+    files = (bench_file_t *)calloc(count, sizeof(bench_file_t));
+    expect = hoedown_buffer_new(BENCH_ESCAPE_UNIT);
+    if (!files || !expect) {
+        ret = -1;
+        goto out;
+    }
+
+    for (i = 0; i < count; i++) {
+        if (bench_load(&files[nfiles], dir, names[i]) == 0) {
+            nfiles++;
+        }
+    }
+
+    if (bench_inline_verify(files, nfiles, expect) != 0) {
+        ret = -1;
+        goto out;
+    }
+
+    for (kernel = 0; kernel <= (int)inline_kernel(); kernel++) {
+        bench_inline_files(kernel, files, nfiles);
+    }
+
+out:
+    for (i = 0; i < nfiles; i++) {
+        free(files[i].data);
+    }
+    free(files);
+    if (expect) {
+        hoedown_buffer_free(expect);
+    }
+    corpus_free(names, count);
+
+    return ret;
+}
+
+/* headers the toc of a single parse may write differently */
+static const char bench_toc_sample[] =
+    "# plain header\n\n"
+    "## *emphasis* and **strong**\n\n"
+    "## `code <span>` span\n\n"
+    "### [link](http://example.com/) text\n\n"
+    "### ![image](image.png) alt\n\n"
+    "#### <http://example.com/> autolink\n\n"
+    "#### entities &amp; &copy; and & alone\n\n"
+    "##### escaped \\<b\\> and \\*\n\n"
+    "##### raw <span>html</span>\n\n"
+    "###### ~~strike~~ and \"quote\"\n\n"
+    "## back up\n";
+
+/* the toc as mmhd wrote it before, a parse with the toc renderer */
+static void
+bench_toc_renderer(hoedown_buffer *ob, const uint8_t *data, size_t size,
+                   unsigned int html)
+{
+    hoedown_callbacks callbacks;
+    hoedown_html_renderopt options;
+    struct hoedown_markdown *markdown;
+
+    hoedown_html_toc_renderer(&callbacks, &options, 0);
+
+    options.flags = html;
+    options.toc_data.starting_level = HOWDOWN_TOC_STARING;
+    options.toc_data.nesting_level = HOWDOWN_TOC_NESTING;
+    options.toc_data.header = NULL;
+    options.toc_data.footer = NULL;
+
+    markdown = hoedown_markdown_new(BENCH_EXTENSIONS, 16,
+                                    &callbacks, &options);
+    if (markdown) {
+        hoedown_markdown_render(ob, data, size, markdown);
+        hoedown_markdown_free(markdown);
+    }
+}
+
+/* differing lines go to stderr, -toc renderer +single parse */
+static size_t
+bench_toc_diff(const hoedown_buffer *expect, const hoedown_buffer *toc,
+               const char *name)
+{
+    const uint8_t *a = expect->data, *a_end = expect->data + expect->size;
+    const uint8_t *b = toc->data, *b_end = toc->data + toc->size;
+    const uint8_t *a_eol, *b_eol;
+    size_t differ = 0;
+
+    while (a < a_end || b < b_end) {
+        a_eol = memchr(a, '\n', a_end - a);
+        b_eol = memchr(b, '\n', b_end - b);
+        if (!a_eol) {
+            a_eol = a_end;
+        }
+        if (!b_eol) {
+            b_eol = b_end;
+        }
+
+        if (a_eol - a != b_eol - b || memcmp(a, b, a_eol - a) != 0) {
+            if (differ == 0) {
+                fprintf(stderr, "%s:\n", name);
+            }
+            fprintf(stderr, "-%.*s\n+%.*s\n",
+                    (int)(a_eol - a), a, (int)(b_eol - b), b);
+            differ++;
+        }
+
+        a = a_eol < a_end ? a_eol + 1 : a_end;
+        b = b_eol < b_end ? b_eol + 1 : b_end;
+    }
+
+    return differ;
+}
+
+static void
+bench_toc_file(const char *name, const uint8_t *data, size_t size,
+               hoedown_buffer *expect)
+{
+    static const unsigned int flags[] = {
+        HOEDOWN_HTML_TOC,
+        HOEDOWN_HTML_TOC | HOEDOWN_HTML_SKIP_TOC_ESCAPE
+    };
+    render_t *render;
+    size_t i, differ;
+
+    for (i = 0; i < sizeof(flags) / sizeof(flags[0]); i++) {
+        render = render_get(BENCH_EXTENSIONS);
+        if (render == NULL) {
+            return;
+        }
+
+        expect->size = 0;
+        bench_toc_renderer(expect, data, size, flags[i]);
+        render_markdown(render, data, size, flags[i],
+                        HOWDOWN_TOC_STARING, HOWDOWN_TOC_NESTING);
+
+        differ = bench_toc_diff(expect, render->toc, name);
+
+        printf("{\"bench\":\"toc\",\"case\":\"%s\",\"escape\":%s,"
+               "\"same\":%s,\"lines\":%zu}\n",
+               name, i == 0 ? "true" : "false",
+               differ ? "false" : "true", differ);
+    }
+}
+
+/*
+ * toc of the single parse against the toc renderer of hoedown, on the
+ * corpus and on headers with inline markup. differences are reported,
+ * not failed: the toc text of a header is taken from its html.
+ */
+static int
+bench_toc(const char *dir)
+{
+    hoedown_buffer *expect;
+    bench_file_t file;
+    size_t count, i;
+    char **names;
+
+    names = corpus_list(dir, &count);
+
+    expect = hoedown_buffer_new(BENCH_ESCAPE_UNIT);
+    if (!expect) {
+        corpus_free(names, count);
+        return -1;
+    }
+
+    bench_toc_file("sample", (const uint8_t *)bench_toc_sample,
+                   sizeof(bench_toc_sample) - 1, expect);
+
+    for (i = 0; i < count; i++) {
+        if (strncmp(names[i], "/small/", 7) == 0) {
+            continue;
+        }
+        if (bench_load(&file, dir, names[i]) == 0) {
+            bench_toc_file(file.name, file.data, file.size, expect);
+            free(file.data);
+        }
+    }
+
+    hoedown_buffer_free(expect);
+    corpus_free(names, count);
+
+    return 0;
+}
+
+static pid_t
+bench_server_start(const char *server, int port, const char *dir,
+                   char **args, int nargs)
+{
+    char portarg[16];
+    char **argv;
+    pid_t pid;
+    int i, n = 0;
+
+    argv = (char **)calloc(nargs + 8, sizeof(char *));
+    if (!argv) {
+        return -1;
+    }
+
+    snprintf(portarg, sizeof(portarg), "%d", port);
+    argv[n++] = (char *)server;
+    argv[n++] = "-p";
+    argv[n++] = portarg;
+    argv[n++] = "-r";
+    argv[n++] = (char *)dir;
+    for (i = 0; i < nargs; i++) {
+        argv[n++] = args[i];
+    }
+    argv[n] = NULL;
+
+    pid = fork();
+    if (pid == 0) {
+        int fd = open("/dev/null", O_WRONLY);
+        if (fd != -1) {
+            dup2(fd, STDOUT_FILENO);
+            close(fd);
+        }
+        execv(server, argv);
+        fprintf(stderr, "mmhd_bench: failed to execute %s\n", server);
+        _exit(127);
+    }
+    free(argv);
+
+    return pid;
+}
+
+static int
+bench_http(const char *dir, const char *server, int port,
+           int concurrency, size_t requests, char **args, int nargs)
+{
+    bench_samples_t samples = { NULL, 0, 0 };
+    uint64_t bytes = 0;
+    size_t count, errors = 0;
+    double start, elapsed;
+    char **urls, name[64];
+    pid_t pid;
+    int i, ret = -1;
+
+    urls = corpus_list(dir, &count);
+    if (count == 0) {
+        fprintf(stderr, "mmhd_bench: no markdown files in %s\n", dir);
+        return -1;
+    }
+
+    pid = bench_server_start(server, port, dir, args, nargs);
+    if (pid <= 0) {
+        corpus_free(urls, count);
+        return -1;
+    }
+
+    /* wait for the listening socket, then render every page once */
+    for (i = 0; i < 100; i++) {
+        usleep(50000);
+        if (client_run(DEFAULT_HOST, port, urls, 1, 1, 1,
+                       &samples, &bytes, &errors) == 0 && errors == 0) {
+            break;
+        }
+        errors = 0;
+    }
+    if (i == 100) {
+        fprintf(stderr, "mmhd_bench: server did not start on port %d\n",
+                port);
+        goto out;
+    }
+    client_run(DEFAULT_HOST, port, urls, count, concurrency, count,
+               &samples, &bytes, &errors);
+    bench_samples_free(&samples);
+    bytes = 0;
+    errors = 0;
+
+    start = bench_now();
+    client_run(DEFAULT_HOST, port, urls, count, concurrency, requests,
+               &samples, &bytes, &errors);
+    elapsed = bench_now() - start;
+
+    snprintf(name, sizeof(name), "c%d", concurrency);
+    bench_report("http", name, &samples, elapsed, bytes);
+    if (errors) {
+        fprintf(stderr, "mmhd_bench: %zu failed requests\n", errors);
+    }
+    ret = 0;
+
+out:
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    bench_samples_free(&samples);
+    corpus_free(urls, count);
+
+    return ret;
+}
+
+static void
+usage(char *command)
+{
+    printf("Usage: %s [OPTION]... COMMAND DIR [-- SERVER OPTION...]\n",
+           command);
+    printf("\nCommands:\n");
+    printf("  corpus                  generate the markdown corpus in DIR\n");
+    printf("  render                  render and contents_generate"
+           " microbenchmarks\n");
+    printf("  escape                  check the escape kernels against"
+           " hoedown and time them\n");
+    printf("  inline                  check the inline scan kernels"
+           " against hoedown and time them\n");
+    printf("  toc                     compare the toc with the toc"
+           " renderer of hoedown\n");
+    printf("  http                    start mmhd on DIR and drive it over"
+           " http\n");
+    printf("\nOptions:\n");
+    printf("  -n, --iterations=NUM    render iterations per case"
+           " [DEFAULT: %d]\n", DEFAULT_ITERATIONS);
+    printf("  -t, --time=SEC          time budget per case [DEFAULT: %.0f]\n",
+           DEFAULT_SECONDS);
+    printf("  -s, --server=FILE       mmhd binary [DEFAULT: %s]\n",
+           DEFAULT_SERVER);
+    printf("  -p, --port=PORT         server port [DEFAULT: %d]\n",
+           DEFAULT_PORT);
+    printf("  -c, --concurrency=NUM   client connections [DEFAULT: %d]\n",
+           DEFAULT_CONCURRENCY);
+    printf("  -r, --requests=NUM      http requests [DEFAULT: %d]\n",
+           DEFAULT_REQUESTS);
+    printf("\nResults are written as one json object per line.\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    char *server = DEFAULT_SERVER;
+    int port = DEFAULT_PORT;
+    int concurrency = DEFAULT_CONCURRENCY;
+    size_t requests = DEFAULT_REQUESTS;
+    char *command, *dir;
+    int opt;
+
+    const struct option long_options[] = {
+        { "iterations", 1, NULL, 'n' },
+        { "time", 1, NULL, 't' },
+        { "server", 1, NULL, 's' },
+        { "port", 1, NULL, 'p' },
+        { "concurrency", 1, NULL, 'c' },
+        { "requests", 1, NULL, 'r' },
+        { "help", 0, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    while ((opt = getopt_long(argc, argv, "n:t:s:p:c:r:h",
+                              long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'n':
+                iterations = strtoul(optarg, NULL, 10);
+                break;
+            case 't':
+                seconds = atof(optarg);
+                break;
+            case 's':
+                server = optarg;
+                break;
+            case 'p':
+                port = atoi(optarg);
+                break;
+            case 'c':
+                concurrency = atoi(optarg);
+                break;
+            case 'r':
+                requests = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                usage(argv[0]);
+                return -1;
+        }
+    }
+
+    if (argc - optind < 2 || iterations == 0 || concurrency <= 0) {
+        usage(argv[0]);
+        return -1;
+    }
+    command = argv[optind];
+    dir = argv[optind + 1];
+
+    signal(SIGPIPE, SIG_IGN);
+
+    if (strcmp(command, "corpus") == 0) {
+        if (corpus_generate(dir) != 0) {
+            fprintf(stderr, "mmhd_bench: failed to generate corpus: %s\n",
+                    dir);
+            return -1;
+        }
+        return 0;
+    } else if (strcmp(command, "render") == 0) {
+        if (style_init(NULL) != 0) {
+            return -1;
+        }
+        return bench_render(dir);
+    } else if (strcmp(command, "escape") == 0) {
+        return bench_escape(dir);
+    } else if (strcmp(command, "inline") == 0) {
+        return bench_inline(dir);
+    } else if (strcmp(command, "toc") == 0) {
+        return bench_toc(dir);
+    } else if (strcmp(command, "http") == 0) {
+        return bench_http(dir, server, port, concurrency, requests,
+                          argv + optind + 2, argc - optind - 2);
+    }
+
+    usage(argv[0]);
+
+    return -1;
+}
@@ -0,0 +1,31 @@
+#ifndef __MMHD_BENCH_H__
+#define __MMHD_BENCH_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+typedef struct bench_samples {
+    double *data; /* msec */
+    size_t count;
+    size_t alloc;
+} bench_samples_t;
+
+double bench_now(void);
+
+int bench_samples_add(bench_samples_t *samples, double msec);
+void bench_samples_free(bench_samples_t *samples);
+
+/* one json object per line on stdout */
+void bench_report(const char *bench, const char *name,
+                  bench_samples_t *samples, double elapsed, uint64_t bytes);
+
+int corpus_generate(const char *dir);
+char **corpus_list(const char *dir, size_t *count);
+void corpus_free(char **files, size_t count);
+
+int client_run(const char *host, int port, char **urls, size_t nurls,
+               int concurrency, size_t requests,
+               bench_samples_t *samples, uint64_t *bytes, size_t *errors);
+
+#endif
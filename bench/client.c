@@ -0,0 +1,246 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "bench.h"
+
+#define CLIENT_BUFFER_SIZE 65536
+
+typedef struct client {
+    const char *host;
+    int port;
+    char **urls;
+    size_t nurls;
+    size_t requests;
+    size_t *next;
+    bench_samples_t samples;
+    uint64_t bytes;
+    size_t errors;
+    pthread_t thread;
+} client_t;
+
+static int
+client_connect(const char *host, int port)
+{
+    struct sockaddr_in addr;
+    int fd, on = 1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+        return -1;
+    }
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static int
+client_send(int fd, const char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        n = write(fd, buf, len);
+        if (n <= 0) {
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/*
+ * reads one response, returns the body size or -1. keep is cleared when
+ * the server closes the connection or gives no Content-Length.
+ */
+static ssize_t
+client_response(int fd, char *buf, size_t size, int *keep)
+{
+    size_t len = 0, header = 0, body;
+    long long content_length = -1;
+    char *end = NULL, *p;
+    ssize_t n;
+    int status;
+
+    while (!end) {
+        if (len == size - 1) {
+            return -1;
+        }
+        n = read(fd, buf + len, size - 1 - len);
+        if (n <= 0) {
+            return -1;
+        }
+        len += n;
+        buf[len] = '\0';
+        end = strstr(buf, "\r\n\r\n");
+    }
+    header = end + 4 - buf;
+
+    if (sscanf(buf, "HTTP/1.%*d %d", &status) != 1 || status >= 500) {
+        return -1;
+    }
+
+    /* HTTP/1.0 closes unless asked to keep the connection */
+    if (strncmp(buf, "HTTP/1.0", 8) == 0) {
+        *keep = 0;
+    }
+
+    for (p = strstr(buf, "\r\n"); p && p < end; p = strstr(p + 2, "\r\n")) {
+        if (strncasecmp(p + 2, "Content-Length:", 15) == 0) {
+            content_length = strtoll(p + 17, NULL, 10);
+        } else if (strncasecmp(p + 2, "Connection: close", 17) == 0) {
+            *keep = 0;
+        } else if (strncasecmp(p + 2, "Connection: keep-alive", 22) == 0) {
+            *keep = 1;
+        }
+    }
+
+    body = len - header;
+    if (content_length < 0) {
+        /* until the connection is closed */
+        *keep = 0;
+        while ((n = read(fd, buf, size)) > 0) {
+            body += n;
+        }
+        return body;
+    }
+
+    while (body < (size_t)content_length) {
+        n = read(fd, buf, size);
+        if (n <= 0) {
+            return -1;
+        }
+        body += n;
+    }
+
+    return body;
+}
+
+static void *
+client_worker(void *arg)
+{
+    client_t *client = (client_t *)arg;
+    char request[1024], *buf;
+    size_t i, len;
+    ssize_t body;
+    double start;
+    int fd = -1, keep;
+
+    buf = (char *)malloc(CLIENT_BUFFER_SIZE);
+    if (!buf) {
+        return NULL;
+    }
+
+    for (;;) {
+        i = __sync_fetch_and_add(client->next, 1);
+        if (i >= client->requests) {
+            break;
+        }
+
+        len = snprintf(request, sizeof(request),
+                       "GET %s HTTP/1.1\r\nHost: %s:%d\r\n"
+                       "Accept-Encoding: identity\r\n\r\n",
+                       client->urls[i % client->nurls],
+                       client->host, client->port);
+
+        start = bench_now();
+
+        if (fd == -1) {
+            fd = client_connect(client->host, client->port);
+            if (fd == -1) {
+                client->errors++;
+                continue;
+            }
+        }
+
+        keep = 1;
+        body = -1;
+        if (client_send(fd, request, len) == 0) {
+            body = client_response(fd, buf, CLIENT_BUFFER_SIZE, &keep);
+        }
+        if (body < 0) {
+            client->errors++;
+            keep = 0;
+        } else {
+            bench_samples_add(&client->samples, bench_now() - start);
+            client->bytes += body;
+        }
+
+        if (!keep) {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    if (fd != -1) {
+        close(fd);
+    }
+    free(buf);
+
+    return NULL;
+}
+
+/* keep-alive connections, one per thread, urls requested in turn */
+int
+client_run(const char *host, int port, char **urls, size_t nurls,
+           int concurrency, size_t requests,
+           bench_samples_t *samples, uint64_t *bytes, size_t *errors)
+{
+    client_t *clients;
+    size_t next = 0, j;
+    int i, n;
+
+    clients = (client_t *)calloc(concurrency, sizeof(client_t));
+    if (!clients) {
+        return -1;
+    }
+
+    for (n = 0; n < concurrency; n++) {
+        clients[n].host = host;
+        clients[n].port = port;
+        clients[n].urls = urls;
+        clients[n].nurls = nurls;
+        clients[n].requests = requests;
+        clients[n].next = &next;
+        if (pthread_create(&clients[n].thread, NULL,
+                           &client_worker, &clients[n]) != 0) {
+            break;
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        pthread_join(clients[i].thread, NULL);
+        for (j = 0; j < clients[i].samples.count; j++) {
+            bench_samples_add(samples, clients[i].samples.data[j]);
+        }
+        *bytes += clients[i].bytes;
+        *errors += clients[i].errors;
+        bench_samples_free(&clients[i].samples);
+    }
+
+    free(clients);
+
+    return n > 0 ? 0 : -1;
+}
@@ -0,0 +1,409 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <dirent.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "bench.h"
+
+#define CORPUS_SMALL_FILES 1000
+#define CORPUS_HUGE_SIZE (16 * 1024 * 1024)
+
+static const char *corpus_words[] = {
+    "markdown", "server", "render", "cache", "header", "table", "code",
+    "latency", "thread", "buffer", "parse", "style", "document", "http",
+    "request", "response", "micro", "content", "escape", "inline"
+};
+#define CORPUS_WORDS (sizeof(corpus_words) / sizeof(corpus_words[0]))
+
+/* deterministic, the corpus is the same on every run */
+static unsigned int corpus_seed = 1;
+
+static unsigned int
+corpus_rand(void)
+{
+    corpus_seed = corpus_seed * 1103515245U + 12345U;
+    return (corpus_seed >> 16) & 0x7fff;
+}
+
+static const char *
+corpus_word(void)
+{
+    return corpus_words[corpus_rand() % CORPUS_WORDS];
+}
+
+static void
+corpus_sentence(FILE *fp, int words)
+{
+    int i;
+
+    for (i = 0; i < words; i++) {
+        const char *word = corpus_word();
+        switch (corpus_rand() % 16) {
+            case 0:
+                fprintf(fp, "*%s*", word);
+                break;
+            case 1:
+                fprintf(fp, "**%s**", word);
+                break;
+            case 2:
+                fprintf(fp, "`%s()`", word);
+                break;
+            case 3:
+                fprintf(fp, "[%s](http://example.com/%s)", word, word);
+                break;
+            case 4:
+                fprintf(fp, "%s & <%s>", word, word);
+                break;
+            default:
+                fputs(word, fp);
+                break;
+        }
+        fputc(i + 1 < words ? ' ' : '.', fp);
+    }
+}
+
+static void
+corpus_paragraph(FILE *fp)
+{
+    int i, n = 2 + corpus_rand() % 4;
+
+    for (i = 0; i < n; i++) {
+        corpus_sentence(fp, 6 + corpus_rand() % 10);
+        fputc(i + 1 < n ? ' ' : '\n', fp);
+    }
+    fputc('\n', fp);
+}
+
+static void
+corpus_table(FILE *fp, int rows, int cols)
+{
+    int r, c;
+
+    for (c = 0; c < cols; c++) {
+        fprintf(fp, "| %s %d ", corpus_word(), c);
+    }
+    fputs("|\n", fp);
+    for (c = 0; c < cols; c++) {
+        fputs(c % 2 ? "|:---:" : "|-----", fp);
+    }
+    fputs("|\n", fp);
+    for (r = 0; r < rows; r++) {
+        for (c = 0; c < cols; c++) {
+            fprintf(fp, "| %s `%d` ", corpus_word(), r * cols + c);
+        }
+        fputs("|\n", fp);
+    }
+    fputc('\n', fp);
+}
+
+static void
+corpus_code(FILE *fp, int lines)
+{
+    int i;
+
+    fputs("```c\n", fp);
+    for (i = 0; i < lines; i++) {
+        fprintf(fp, "    if (%s_%d < %d && %s) { return \"<%s>\"; }\n",
+                corpus_word(), i, i * 7, corpus_word(), corpus_word());
+    }
+    fputs("```\n\n", fp);
+}
+
+static void
+corpus_list_items(FILE *fp, int items)
+{
+    int i;
+
+    for (i = 0; i < items; i++) {
+        fprintf(fp, "%s ", i % 3 ? "-" : "  -");
+        corpus_sentence(fp, 4 + corpus_rand() % 6);
+        fputc('\n', fp);
+    }
+    fputc('\n', fp);
+}
+
+static void
+corpus_mixed(FILE *fp, int sections)
+{
+    int i;
+
+    for (i = 0; i < sections; i++) {
+        fprintf(fp, "%.*s %s %d\n\n", 1 + i % 4, "####", corpus_word(), i);
+        corpus_paragraph(fp);
+        switch (i % 4) {
+            case 0:
+                corpus_list_items(fp, 5);
+                break;
+            case 1:
+                corpus_code(fp, 6);
+                break;
+            case 2:
+                corpus_table(fp, 4, 4);
+                break;
+            default:
+                fputs("> ", fp);
+                corpus_paragraph(fp);
+                break;
+        }
+    }
+}
+
+static FILE *
+corpus_open(const char *dir, const char *name)
+{
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+
+    return fopen(path, "w");
+}
+
+static int
+corpus_tables(const char *dir)
+{
+    FILE *fp = corpus_open(dir, "tables.md");
+    int i;
+
+    if (!fp) {
+        return -1;
+    }
+    fputs("# Tables\n\n", fp);
+    for (i = 0; i < 200; i++) {
+        corpus_table(fp, 10, 6);
+    }
+
+    return fclose(fp);
+}
+
+static int
+corpus_fenced(const char *dir)
+{
+    FILE *fp = corpus_open(dir, "code.md");
+    int i;
+
+    if (!fp) {
+        return -1;
+    }
+    fputs("# Fenced code\n\n", fp);
+    for (i = 0; i < 300; i++) {
+        corpus_paragraph(fp);
+        corpus_code(fp, 4 + i % 20);
+    }
+
+    return fclose(fp);
+}
+
+static int
+corpus_footnotes(const char *dir)
+{
+    FILE *fp = corpus_open(dir, "footnotes.md");
+    int i;
+
+    if (!fp) {
+        return -1;
+    }
+    fputs("# Footnotes\n\n", fp);
+    for (i = 0; i < 500; i++) {
+        corpus_sentence(fp, 10);
+        fprintf(fp, "[^%d]\n\n", i);
+    }
+    for (i = 0; i < 500; i++) {
+        fprintf(fp, "[^%d]: ", i);
+        corpus_sentence(fp, 8);
+        fputs("\n\n", fp);
+    }
+
+    return fclose(fp);
+}
+
+static int
+corpus_headers(const char *dir)
+{
+    FILE *fp = corpus_open(dir, "headers.md");
+    int i;
+
+    if (!fp) {
+        return -1;
+    }
+    for (i = 0; i < 2000; i++) {
+        /* 1..6 going down and back up, every level is nested */
+        int level = 1 + (i % 10 < 6 ? i % 10 : 10 - i % 10);
+        fprintf(fp, "%.*s %s <em>%s</em> %d\n\n", level, "######",
+                corpus_word(), corpus_word(), i);
+        corpus_sentence(fp, 12);
+        fputs("\n\n", fp);
+    }
+
+    return fclose(fp);
+}
+
+static int
+corpus_huge(const char *dir)
+{
+    FILE *fp = corpus_open(dir, "huge.md");
+
+    if (!fp) {
+        return -1;
+    }
+    while (ftell(fp) < CORPUS_HUGE_SIZE) {
+        corpus_mixed(fp, 64);
+    }
+
+    return fclose(fp);
+}
+
+static int
+corpus_small(const char *dir)
+{
+    char path[PATH_MAX];
+    FILE *fp;
+    int i;
+
+    snprintf(path, sizeof(path), "%s/small", dir);
+    if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+        return -1;
+    }
+
+    for (i = 0; i < CORPUS_SMALL_FILES; i++) {
+        snprintf(path, sizeof(path), "%s/small/%04d.md", dir, i);
+        fp = fopen(path, "w");
+        if (!fp) {
+            return -1;
+        }
+        corpus_mixed(fp, 2);
+        if (fclose(fp) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * tables, fenced code, footnotes, deep headers, one huge file and many
+ * small files below dir.
+ */
+int
+corpus_generate(const char *dir)
+{
+    FILE *fp;
+
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        return -1;
+    }
+
+    corpus_seed = 1;
+
+    fp = corpus_open(dir, "mixed.md");
+    if (!fp) {
+        return -1;
+    }
+    corpus_mixed(fp, 200);
+    if (fclose(fp) != 0) {
+        return -1;
+    }
+
+    if (corpus_tables(dir) != 0 || corpus_fenced(dir) != 0
+        || corpus_footnotes(dir) != 0 || corpus_headers(dir) != 0
+        || corpus_huge(dir) != 0 || corpus_small(dir) != 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+corpus_add(char ***files, size_t *count, size_t *alloc, const char *path)
+{
+    if (*count == *alloc) {
+        size_t n = *alloc ? *alloc * 2 : 64;
+        char **p = realloc(*files, n * sizeof(char *));
+        if (!p) {
+            return -1;
+        }
+        *files = p;
+        *alloc = n;
+    }
+
+    (*files)[*count] = strdup(path);
+    if (!(*files)[*count]) {
+        return -1;
+    }
+    (*count)++;
+
+    return 0;
+}
+
+static void
+corpus_scan(const char *dir, const char *sub,
+            char ***files, size_t *count, size_t *alloc)
+{
+    char path[PATH_MAX], rel[PATH_MAX];
+    struct dirent *dent;
+    struct stat st;
+    DIR *dp;
+
+    snprintf(path, sizeof(path), "%s%s", dir, sub);
+    dp = opendir(path);
+    if (!dp) {
+        return;
+    }
+
+    while ((dent = readdir(dp)) != NULL) {
+        size_t len = strlen(dent->d_name);
+
+        if (dent->d_name[0] == '.') {
+            continue;
+        }
+        snprintf(rel, sizeof(rel), "%s/%s", sub, dent->d_name);
+        snprintf(path, sizeof(path), "%s%s", dir, rel);
+        if (stat(path, &st) != 0) {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            corpus_scan(dir, rel, files, count, alloc);
+        } else if (len > 3 && strcmp(dent->d_name + len - 3, ".md") == 0) {
+            corpus_add(files, count, alloc, rel);
+        }
+    }
+
+    closedir(dp);
+}
+
+static int
+corpus_compare(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* markdown files below dir as sorted urls ("/small/0001.md") */
+char **
+corpus_list(const char *dir, size_t *count)
+{
+    char **files = NULL;
+    size_t alloc = 0;
+
+    *count = 0;
+    corpus_scan(dir, "", &files, count, &alloc);
+
+    if (*count) {
+        qsort(files, *count, sizeof(char *), &corpus_compare);
+    }
+
+    return files;
+}
+
+void
+corpus_free(char **files, size_t count)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        free(files[i]);
+    }
+    free(files);
+}
@@ -0,0 +1,70 @@
+#!/bin/sh
+#
+# profile guided build of mmhd: pgo.sh SRCDIR OUTDIR [CMAKE OPTION...]
+#
+# OUTDIR/base is the release build. OUTDIR/pgo is built instrumented,
+# serves the bench corpus to mmhd_bench http with the render cache off,
+# and is rebuilt with the profile. both are then driven the same way and
+# the throughput is printed as a json line.
+#
+set -e
+
+SRCDIR=$(cd "${1:?SRCDIR}" && pwd)
+mkdir -p "${2:?OUTDIR}"
+OUTDIR=$(cd "$2" && pwd)
+shift 2
+
+REQUESTS=${PGO_REQUESTS:-20000}
+CONCURRENCY=${PGO_CONCURRENCY:-8}
+PORT=${PGO_PORT:-18889}
+JOBS=${PGO_JOBS:-$(getconf _NPROCESSORS_ONLN 2>/dev/null || echo 1)}
+
+# every request renders
+SERVER_OPTIONS="-m 0"
+
+# build DIR TARGETS [CMAKE OPTION...]
+build() {
+    dir=$1
+    targets=$2
+    shift 2
+    mkdir -p "$dir"
+    (cd "$dir" \
+        && cmake "$SRCDIR" -DCMAKE_BUILD_TYPE=Release "$@" >/dev/null \
+        && make -j"$JOBS" $targets >/dev/null)
+}
+
+# throughput SERVER: requests per second
+throughput() {
+    "$OUTDIR/base/mmhd_bench" -s "$1" -p "$PORT" -c "$CONCURRENCY" \
+        -r "$REQUESTS" http "$OUTDIR/corpus" -- $SERVER_OPTIONS \
+        | sed -n 's/.*"ops_per_sec":\([0-9.]*\).*/\1/p'
+}
+
+echo "pgo: release build" >&2
+build "$OUTDIR/base" "mmhd mmhd_bench" "$@"
+if [ ! -d "$OUTDIR/corpus" ]; then
+    "$OUTDIR/base/mmhd_bench" corpus "$OUTDIR/corpus"
+fi
+
+echo "pgo: instrumented build" >&2
+if [ -d "$OUTDIR/pgo" ]; then
+    find "$OUTDIR/pgo" -name '*.gcda' -exec rm -f {} +
+fi
+build "$OUTDIR/pgo" mmhd -DPGO=generate "$@"
+
+# the profile is written when mmhd_bench stops the server
+echo "pgo: training" >&2
+throughput "$OUTDIR/pgo/mmhd" >/dev/null
+
+echo "pgo: profile build" >&2
+build "$OUTDIR/pgo" mmhd -DPGO=use "$@"
+
+echo "pgo: measuring" >&2
+base=$(throughput "$OUTDIR/base/mmhd")
+pgo=$(throughput "$OUTDIR/pgo/mmhd")
+
+awk -v base="${base:-0}" -v pgo="${pgo:-0}" 'BEGIN {
+    printf("{\"bench\":\"pgo\",\"base_ops_per_sec\":%.1f," \
+           "\"pgo_ops_per_sec\":%.1f,\"change_percent\":%.1f}\n",
+           base, pgo, base > 0 ? (pgo - base) * 100.0 / base : 0)
+}'
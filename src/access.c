@@ -0,0 +1,368 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+
+#include "access.h"
+
+#define ACCESS_LOG_RING 4096 /* records, power of two */
+#define ACCESS_LOG_BATCH 65536
+#define ACCESS_LOG_LINE 2048
+#define ACCESS_LOG_INTERVAL 100 /* msec between drains when idle */
+
+/*
+ * bounded multi-producer ring: a slot is free for the producer holding
+ * position pos when its sequence is pos, readable by the writer when it
+ * is pos + 1.
+ */
+typedef struct access_slot {
+    size_t sequence;
+    access_record_t record;
+} access_slot_t;
+
+static struct {
+    access_slot_t slots[ACCESS_LOG_RING];
+    size_t enqueue __attribute__ ((aligned(64)));
+    size_t dequeue __attribute__ ((aligned(64)));
+    uint64_t dropped;
+    uint64_t reported;
+    int enabled;
+    int stop;
+    int reopen;
+    int format;
+    int fd;
+    char *path;
+    pthread_t thread;
+} access_log = { .fd = -1 };
+
+void
+access_log_push(const access_record_t *record)
+{
+    access_slot_t *slot;
+    size_t pos, sequence;
+    intptr_t diff;
+
+    if (!__atomic_load_n(&access_log.enabled, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    pos = __atomic_load_n(&access_log.enqueue, __ATOMIC_RELAXED);
+    for (;;) {
+        slot = &access_log.slots[pos & (ACCESS_LOG_RING - 1)];
+        sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        diff = (intptr_t)sequence - (intptr_t)pos;
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&access_log.enqueue, &pos,
+                                            pos + 1, 1, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            /* full, the writer is behind */
+            __atomic_fetch_add(&access_log.dropped, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            pos = __atomic_load_n(&access_log.enqueue, __ATOMIC_RELAXED);
+        }
+    }
+
+    slot->record = *record;
+    __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+}
+
+static int
+access_log_pop(access_record_t *record)
+{
+    access_slot_t *slot;
+    size_t pos = access_log.dequeue;
+
+    slot = &access_log.slots[pos & (ACCESS_LOG_RING - 1)];
+    if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != pos + 1) {
+        return 0;
+    }
+
+    *record = slot->record;
+    __atomic_store_n(&slot->sequence, pos + ACCESS_LOG_RING,
+                     __ATOMIC_RELEASE);
+    access_log.dequeue = pos + 1;
+
+    return 1;
+}
+
+void
+access_log_reopen(void)
+{
+    __atomic_store_n(&access_log.reopen, 1, __ATOMIC_RELAXED);
+}
+
+uint64_t
+access_log_dropped(void)
+{
+    return __atomic_load_n(&access_log.dropped, __ATOMIC_RELAXED);
+}
+
+static int
+access_log_file(const char *path)
+{
+    if (strcmp(path, "-") == 0) {
+        return dup(STDOUT_FILENO);
+    }
+
+    return open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+}
+
+static void
+access_log_write(const char *data, size_t size)
+{
+    ssize_t n;
+
+    while (size > 0) {
+        n = write(access_log.fd, data, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        data += n;
+        size -= n;
+    }
+}
+
+/* quotes, backslashes and control characters escaped as json or \xhh */
+static size_t
+access_log_escape(char *buf, size_t size, const char *str, int json)
+{
+    size_t len = 0;
+    const unsigned char *p;
+
+    for (p = (const unsigned char *)str; *p && len + 7 < size; p++) {
+        if (*p == '"' || *p == '\\') {
+            buf[len++] = '\\';
+            buf[len++] = *p;
+        } else if (*p < 0x20 || *p == 0x7f) {
+            len += snprintf(buf + len, size - len,
+                            json ? "\\u%04x" : "\\x%02x", *p);
+        } else {
+            buf[len++] = *p;
+        }
+    }
+    buf[len] = '\0';
+
+    return len;
+}
+
+static size_t
+access_log_format(char *buf, size_t size, const access_record_t *record)
+{
+    char date[64], url[ACCESS_LOG_URL_SIZE*6];
+    struct tm tm;
+    int len;
+
+    localtime_r(&record->time, &tm);
+    access_log_escape(url, sizeof(url), record->url,
+                      access_log.format == ACCESS_LOG_JSON);
+
+    if (access_log.format == ACCESS_LOG_JSON) {
+        strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S%z", &tm);
+        len = snprintf(buf, size,
+                       "{\"time\":\"%s\",\"remote\":\"%s\","
+                       "\"method\":\"%s\",\"url\":\"%s\","
+                       "\"protocol\":\"%s\",\"status\":%u,"
+                       "\"bytes\":%llu,\"duration_ms\":%.3f}\n",
+                       date, record->addr, record->method, url,
+                       record->version, record->status,
+                       (unsigned long long)record->bytes,
+                       record->duration);
+    } else {
+        /* common log format, the duration in msec is appended */
+        strftime(date, sizeof(date), "%d/%b/%Y:%H:%M:%S %z", &tm);
+        if (record->bytes) {
+            len = snprintf(buf, size,
+                           "%s - - [%s] \"%s %s %s\" %u %llu %.3f\n",
+                           record->addr, date, record->method, url,
+                           record->version, record->status,
+                           (unsigned long long)record->bytes,
+                           record->duration);
+        } else {
+            len = snprintf(buf, size, "%s - - [%s] \"%s %s %s\" %u - %.3f\n",
+                           record->addr, date, record->method, url,
+                           record->version, record->status,
+                           record->duration);
+        }
+    }
+
+    if (len < 0) {
+        return 0;
+    }
+    return (size_t)len < size ? (size_t)len : size - 1;
+}
+
+static void
+access_log_flush(char *batch, size_t *len)
+{
+    char *line, *next;
+
+    if (*len == 0) {
+        return;
+    }
+
+    if (access_log.fd >= 0) {
+        access_log_write(batch, *len);
+    } else {
+        /* one message per record */
+        batch[*len - 1] = '\0';
+        for (line = batch; line; line = next) {
+            next = strchr(line, '\n');
+            if (next) {
+                *next++ = '\0';
+            }
+            syslog(LOG_DAEMON | LOG_INFO, "%s", line);
+        }
+    }
+
+    *len = 0;
+}
+
+static void
+access_log_add(char *batch, size_t *len, const char *line, size_t size)
+{
+    if (*len + size > ACCESS_LOG_BATCH) {
+        access_log_flush(batch, len);
+    }
+    memcpy(batch + *len, line, size);
+    *len += size;
+}
+
+static void *
+access_log_run(void *arg)
+{
+    struct timespec interval = { 0, ACCESS_LOG_INTERVAL * 1000000L };
+    char *batch, line[ACCESS_LOG_LINE];
+    access_record_t record;
+    uint64_t dropped;
+    size_t len = 0, size, count;
+    int fd, stop;
+
+    batch = (char *)malloc(ACCESS_LOG_BATCH);
+    if (!batch) {
+        return NULL;
+    }
+
+    for (;;) {
+        stop = __atomic_load_n(&access_log.stop, __ATOMIC_ACQUIRE);
+
+        if (__atomic_exchange_n(&access_log.reopen, 0, __ATOMIC_RELAXED)
+            && access_log.path) {
+            /* rotated by logrotate and the like, keep the old on failure */
+            fd = access_log_file(access_log.path);
+            if (fd >= 0) {
+                close(access_log.fd);
+                access_log.fd = fd;
+            }
+        }
+
+        for (count = 0; access_log_pop(&record); count++) {
+            size = access_log_format(line, sizeof(line), &record);
+            access_log_add(batch, &len, line, size);
+        }
+
+        dropped = access_log_dropped();
+        if (dropped != access_log.reported) {
+            size = snprintf(line, sizeof(line),
+                            access_log.format == ACCESS_LOG_JSON
+                            ? "{\"dropped\":%llu}\n"
+                            : "mmhd: dropped %llu access log records\n",
+                            (unsigned long long)(dropped
+                                                 - access_log.reported));
+            access_log_add(batch, &len, line, size);
+            access_log.reported = dropped;
+        }
+
+        access_log_flush(batch, &len);
+
+        if (stop) {
+            break;
+        }
+        if (count == 0) {
+            nanosleep(&interval, NULL);
+        }
+    }
+
+    free(batch);
+
+    return NULL;
+}
+
+/*
+ * records are formatted and written in batches by a background thread,
+ * path is a file name, "-" for stdout or "syslog".
+ */
+int
+access_log_open(const char *path, int format)
+{
+    size_t i;
+
+    for (i = 0; i < ACCESS_LOG_RING; i++) {
+        access_log.slots[i].sequence = i;
+    }
+    access_log.enqueue = 0;
+    access_log.dequeue = 0;
+    access_log.format = format;
+    access_log.stop = 0;
+
+    if (strcmp(path, ACCESS_LOG_SYSLOG) == 0) {
+        access_log.fd = -1;
+        access_log.path = NULL;
+    } else {
+        access_log.path = strdup(path);
+        if (!access_log.path) {
+            return -1;
+        }
+        access_log.fd = access_log_file(path);
+        if (access_log.fd < 0) {
+            free(access_log.path);
+            access_log.path = NULL;
+            return -1;
+        }
+    }
+
+    if (pthread_create(&access_log.thread, NULL,
+                       &access_log_run, NULL) != 0) {
+        if (access_log.fd >= 0) {
+            close(access_log.fd);
+            access_log.fd = -1;
+        }
+        free(access_log.path);
+        access_log.path = NULL;
+        return -1;
+    }
+
+    __atomic_store_n(&access_log.enabled, 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/* records pushed before the call are written */
+void
+access_log_close(void)
+{
+    if (!access_log.enabled) {
+        return;
+    }
+
+    __atomic_store_n(&access_log.enabled, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&access_log.stop, 1, __ATOMIC_RELEASE);
+    pthread_join(access_log.thread, NULL);
+
+    if (access_log.fd >= 0) {
+        close(access_log.fd);
+        access_log.fd = -1;
+    }
+    free(access_log.path);
+    access_log.path = NULL;
+}
@@ -0,0 +1,37 @@
+#ifndef __MMHD_ACCESS_H__
+#define __MMHD_ACCESS_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+#define ACCESS_LOG_SYSLOG "syslog"
+
+#define ACCESS_LOG_URL_SIZE 256
+#define ACCESS_LOG_ADDR_SIZE 48
+
+enum {
+    ACCESS_LOG_COMMON = 0,
+    ACCESS_LOG_JSON
+};
+
+typedef struct access_record {
+    time_t time;
+    char addr[ACCESS_LOG_ADDR_SIZE];
+    char method[8];
+    char version[12];
+    char url[ACCESS_LOG_URL_SIZE];
+    unsigned int status;
+    uint64_t bytes;
+    double duration; /* msec */
+} access_record_t;
+
+int access_log_open(const char *path, int format);
+void access_log_close(void);
+/* never blocks: the record is dropped when the buffer is full */
+void access_log_push(const access_record_t *record);
+/* async-signal-safe, the writer reopens the file */
+void access_log_reopen(void);
+uint64_t access_log_dropped(void);
+
+#endif
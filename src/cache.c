@@ -0,0 +1,310 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "cache.h"
+
+#define CACHE_BUCKETS 256
+
+struct cache {
+    cache_entry_t **buckets;
+    size_t nbuckets;
+    size_t count;
+    size_t size;
+    size_t max_size;
+    size_t max_count;
+    unsigned long hits;
+    unsigned long misses;
+    void (*free_cb)(void *data);
+    cache_entry_t *lru_head; /* most recently used */
+    cache_entry_t *lru_tail; /* least recently used */
+    pthread_mutex_t lock;
+};
+
+unsigned int
+cache_hash(const char *key)
+{
+    unsigned int hash = 2166136261U;
+
+    while (*key) {
+        hash ^= (unsigned char)*key++;
+        hash *= 16777619U;
+    }
+
+    return hash;
+}
+
+static size_t
+cache_entry_cost(cache_entry_t *entry)
+{
+    return sizeof(cache_entry_t) + strlen(entry->key) + 1 + entry->size;
+}
+
+static void
+cache_entry_free(cache_entry_t *entry)
+{
+    if (entry->free_cb) {
+        entry->free_cb(entry->data);
+    } else {
+        free(entry->data);
+    }
+    free(entry->key);
+    free(entry);
+}
+
+static void
+cache_lru_unlink(cache_t *cache, cache_entry_t *entry)
+{
+    if (entry->lru_prev) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        cache->lru_head = entry->lru_next;
+    }
+    if (entry->lru_next) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        cache->lru_tail = entry->lru_prev;
+    }
+    entry->lru_prev = NULL;
+    entry->lru_next = NULL;
+}
+
+static void
+cache_lru_push(cache_t *cache, cache_entry_t *entry)
+{
+    entry->lru_prev = NULL;
+    entry->lru_next = cache->lru_head;
+    if (cache->lru_head) {
+        cache->lru_head->lru_prev = entry;
+    } else {
+        cache->lru_tail = entry;
+    }
+    cache->lru_head = entry;
+}
+
+static void
+cache_remove(cache_t *cache, cache_entry_t *entry)
+{
+    cache_entry_t **p = &cache->buckets[entry->hash & (cache->nbuckets - 1)];
+
+    while (*p) {
+        if (*p == entry) {
+            *p = entry->next;
+            break;
+        }
+        p = &(*p)->next;
+    }
+    entry->next = NULL;
+
+    cache_lru_unlink(cache, entry);
+    cache->count--;
+    cache->size -= cache_entry_cost(entry);
+
+    /* drop the reference held by the cache */
+    cache_release(entry);
+}
+
+static void
+cache_resize(cache_t *cache)
+{
+    size_t i, nbuckets = cache->nbuckets * 2;
+    cache_entry_t **buckets;
+
+    buckets = (cache_entry_t **)calloc(nbuckets, sizeof(cache_entry_t *));
+    if (!buckets) {
+        return;
+    }
+
+    for (i = 0; i < cache->nbuckets; i++) {
+        cache_entry_t *entry = cache->buckets[i], *next;
+        while (entry) {
+            next = entry->next;
+            entry->next = buckets[entry->hash & (nbuckets - 1)];
+            buckets[entry->hash & (nbuckets - 1)] = entry;
+            entry = next;
+        }
+    }
+
+    free(cache->buckets);
+    cache->buckets = buckets;
+    cache->nbuckets = nbuckets;
+}
+
+static cache_entry_t *
+cache_lookup(cache_t *cache, const char *key, unsigned int hash)
+{
+    cache_entry_t *entry = cache->buckets[hash & (cache->nbuckets - 1)];
+
+    while (entry) {
+        if (entry->hash == hash && strcmp(entry->key, key) == 0) {
+            return entry;
+        }
+        entry = entry->next;
+    }
+
+    return NULL;
+}
+
+cache_t *
+cache_new(size_t max_size, size_t max_count, void (*free_cb)(void *data))
+{
+    cache_t *cache = (cache_t *)calloc(1, sizeof(cache_t));
+    if (!cache) {
+        return NULL;
+    }
+
+    cache->nbuckets = CACHE_BUCKETS;
+    cache->buckets = (cache_entry_t **)calloc(cache->nbuckets,
+                                              sizeof(cache_entry_t *));
+    if (!cache->buckets) {
+        free(cache);
+        return NULL;
+    }
+    cache->max_size = max_size;
+    cache->max_count = max_count;
+    cache->free_cb = free_cb;
+
+    pthread_mutex_init(&cache->lock, NULL);
+
+    return cache;
+}
+
+void
+cache_free(cache_t *cache)
+{
+    if (!cache) {
+        return;
+    }
+
+    while (cache->lru_tail) {
+        cache_remove(cache, cache->lru_tail);
+    }
+
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->buckets);
+    free(cache);
+}
+
+cache_entry_t *
+cache_get(cache_t *cache, const char *key)
+{
+    unsigned int hash = cache_hash(key);
+    cache_entry_t *entry;
+
+    pthread_mutex_lock(&cache->lock);
+
+    entry = cache_lookup(cache, key, hash);
+    if (entry) {
+        cache_lru_unlink(cache, entry);
+        cache_lru_push(cache, entry);
+        __sync_add_and_fetch(&entry->refcount, 1);
+        cache->hits++;
+    } else {
+        cache->misses++;
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+
+    return entry;
+}
+
+static cache_entry_t *
+cache_entry_create(const char *key, void *data, size_t size,
+                   void (*free_cb)(void *data))
+{
+    cache_entry_t *entry;
+
+    entry = (cache_entry_t *)calloc(1, sizeof(cache_entry_t));
+    if (entry) {
+        entry->key = strdup(key);
+    }
+    if (!entry || !entry->key) {
+        if (free_cb) {
+            free_cb(data);
+        } else {
+            free(data);
+        }
+        free(entry);
+        return NULL;
+    }
+    entry->hash = cache_hash(key);
+    entry->data = data;
+    entry->size = size;
+    entry->free_cb = free_cb;
+    entry->refcount = 1; /* caller */
+
+    return entry;
+}
+
+cache_entry_t *
+cache_entry_new(const char *key, void *data, size_t size)
+{
+    return cache_entry_create(key, data, size, NULL);
+}
+
+cache_entry_t *
+cache_set(cache_t *cache, const char *key, void *data, size_t size)
+{
+    cache_entry_t *entry, *old;
+    size_t cost;
+
+    entry = cache_entry_create(key, data, size, cache->free_cb);
+    if (!entry) {
+        return NULL;
+    }
+
+    cost = cache_entry_cost(entry);
+    if (cache->max_size && cost > cache->max_size) {
+        /* too large to cache: hand it back unlinked */
+        return entry;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+
+    old = cache_lookup(cache, key, entry->hash);
+    if (old) {
+        cache_remove(cache, old);
+    }
+
+    while (cache->lru_tail
+           && ((cache->max_size && cache->size + cost > cache->max_size)
+               || (cache->max_count && cache->count >= cache->max_count))) {
+        cache_remove(cache, cache->lru_tail);
+    }
+
+    if (cache->count >= cache->nbuckets) {
+        cache_resize(cache);
+    }
+
+    entry->next = cache->buckets[entry->hash & (cache->nbuckets - 1)];
+    cache->buckets[entry->hash & (cache->nbuckets - 1)] = entry;
+    cache_lru_push(cache, entry);
+    cache->count++;
+    cache->size += cost;
+    entry->refcount++; /* cache */
+
+    pthread_mutex_unlock(&cache->lock);
+
+    return entry;
+}
+
+void
+cache_release(cache_entry_t *entry)
+{
+    if (entry && __sync_sub_and_fetch(&entry->refcount, 1) == 0) {
+        cache_entry_free(entry);
+    }
+}
+
+void
+cache_stats(cache_t *cache, cache_stats_t *stats)
+{
+    pthread_mutex_lock(&cache->lock);
+
+    stats->hits = cache->hits;
+    stats->misses = cache->misses;
+    stats->count = cache->count;
+    stats->size = cache->size;
+
+    pthread_mutex_unlock(&cache->lock);
+}
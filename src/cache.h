@@ -0,0 +1,47 @@
+#ifndef __MMHD_CACHE_H__
+#define __MMHD_CACHE_H__
+
+#include <stddef.h>
+
+struct cache;
+
+typedef struct cache_entry {
+    char *key;
+    unsigned int hash;
+    void *data;
+    size_t size;
+    int refcount;
+    void (*free_cb)(void *data);
+    struct cache_entry *next;
+    struct cache_entry *lru_prev;
+    struct cache_entry *lru_next;
+} cache_entry_t;
+
+typedef struct cache cache_t;
+
+typedef struct cache_stats {
+    unsigned long hits;
+    unsigned long misses;
+    size_t count;
+    size_t size;
+} cache_stats_t;
+
+unsigned int cache_hash(const char *key);
+
+/* max_size bytes and max_count entries, 0 is unlimited */
+cache_t *cache_new(size_t max_size, size_t max_count,
+                   void (*free_cb)(void *data));
+void cache_free(cache_t *cache);
+
+/* unlinked entry owning data, freed on the last cache_release() */
+cache_entry_t *cache_entry_new(const char *key, void *data, size_t size);
+
+/* returned entries hold a reference, drop it with cache_release() */
+cache_entry_t *cache_get(cache_t *cache, const char *key);
+cache_entry_t *cache_set(cache_t *cache, const char *key,
+                         void *data, size_t size);
+void cache_release(cache_entry_t *entry);
+
+void cache_stats(cache_t *cache, cache_stats_t *stats);
+
+#endif
@@ -0,0 +1,266 @@
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "compress.h"
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+static const char *compress_types[] = {
+    "text/",
+    "application/javascript",
+    "application/json",
+    "application/xml",
+    "image/svg+xml",
+    "application/wasm",
+    NULL
+};
+
+/* preferred encoding of an Accept-Encoding header, gzip wins ties */
+int
+compress_negotiate(const char *accept_encoding)
+{
+#ifdef HAVE_ZLIB
+    const char *p = accept_encoding, *q;
+    /* -1 while not listed, * covers the codings not listed */
+    double gzip = -1, deflate = -1, any = 0, quality;
+    size_t len;
+
+    if (!p) {
+        return COMPRESS_IDENTITY;
+    }
+
+    while (*p) {
+        while (*p == ' ' || *p == '\t' || *p == ',') {
+            p++;
+        }
+        len = strcspn(p, " \t;,");
+        if (len == 0) {
+            break;
+        }
+
+        quality = 1;
+        q = p + len;
+        while (*q == ' ' || *q == '\t') {
+            q++;
+        }
+        if (*q == ';') {
+            q++;
+            while (*q == ' ' || *q == '\t') {
+                q++;
+            }
+            if (strncasecmp(q, "q=", 2) == 0) {
+                quality = atof(q + 2);
+            }
+        }
+
+        if ((len == 4 && strncasecmp(p, "gzip", 4) == 0)
+            || (len == 6 && strncasecmp(p, "x-gzip", 6) == 0)) {
+            gzip = quality;
+        } else if (len == 7 && strncasecmp(p, "deflate", 7) == 0) {
+            deflate = quality;
+        } else if (len == 1 && *p == '*') {
+            any = quality;
+        }
+
+        p += len;
+        while (*p && *p != ',') {
+            p++;
+        }
+    }
+
+    if (gzip < 0) {
+        gzip = any;
+    }
+    if (deflate < 0) {
+        deflate = any;
+    }
+
+    if (gzip > 0 && gzip >= deflate) {
+        return COMPRESS_GZIP;
+    } else if (deflate > 0) {
+        return COMPRESS_DEFLATE;
+    }
+#endif
+
+    return COMPRESS_IDENTITY;
+}
+
+int
+compress_type(const char *content_type)
+{
+    int i;
+
+    for (i = 0; compress_types[i]; i++) {
+        if (strncasecmp(content_type, compress_types[i],
+                        strlen(compress_types[i])) == 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+const char *
+compress_name(int encoding)
+{
+    switch (encoding) {
+        case COMPRESS_GZIP:
+            return "gzip";
+        case COMPRESS_DEFLATE:
+            return "deflate";
+    }
+
+    return "identity";
+}
+
+void *
+compress_iov(const struct iovec *iov, int iovcnt, int encoding, size_t *size)
+{
+#ifdef HAVE_ZLIB
+    z_stream stream;
+    unsigned char *out;
+    size_t total = 0, bound;
+    int i, ret = Z_OK;
+
+    for (i = 0; i < iovcnt; i++) {
+        total += iov[i].iov_len;
+    }
+
+    memset(&stream, 0, sizeof(stream));
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                     encoding == COMPRESS_GZIP ? 15 + 16 : 15,
+                     8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return NULL;
+    }
+
+    bound = deflateBound(&stream, total);
+    out = (unsigned char *)malloc(bound);
+    if (!out) {
+        deflateEnd(&stream);
+        return NULL;
+    }
+
+    stream.next_out = out;
+    stream.avail_out = bound;
+
+    for (i = 0; i < iovcnt; i++) {
+        stream.next_in = (unsigned char *)iov[i].iov_base;
+        stream.avail_in = iov[i].iov_len;
+        ret = deflate(&stream, i == iovcnt - 1 ? Z_FINISH : Z_NO_FLUSH);
+        if (ret == Z_STREAM_ERROR) {
+            break;
+        }
+    }
+    if (iovcnt == 0) {
+        ret = deflate(&stream, Z_FINISH);
+    }
+
+    deflateEnd(&stream);
+
+    if (ret != Z_STREAM_END) {
+        free(out);
+        return NULL;
+    }
+
+    *size = stream.total_out;
+
+    return out;
+#else
+    return NULL;
+#endif
+}
+
+/* cached compressed copy of iov, compressed on the first request */
+cache_entry_t *
+compress_entry(cache_t *cache, const char *key,
+               const struct iovec *iov, int iovcnt, int encoding)
+{
+    cache_entry_t *entry = NULL;
+    void *data;
+    size_t size = 0;
+
+    if (cache) {
+        entry = cache_get(cache, key);
+        if (entry) {
+            return entry;
+        }
+    }
+
+    data = compress_iov(iov, iovcnt, encoding, &size);
+    if (!data) {
+        return NULL;
+    }
+
+    if (cache) {
+        return cache_set(cache, key, data, size);
+    }
+
+    return cache_entry_new(key, data, size);
+}
+
+/*
+ * cached compressed copy of a file, read and compressed on a miss.
+ * files are read rather than mapped: one rewritten in place and cut
+ * short under a mapping would kill the server with SIGBUS. a file that
+ * is no longer size bytes long is not compressed.
+ */
+cache_entry_t *
+compress_file(cache_t *cache, const char *key,
+              const char *path, size_t size, int encoding)
+{
+    cache_entry_t *entry = NULL;
+    struct iovec iov;
+    char *data = NULL;
+    size_t offset = 0;
+    ssize_t len;
+    int fd;
+
+    if (cache) {
+        entry = cache_get(cache, key);
+        if (entry) {
+            return entry;
+        }
+    }
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    if (size > 0) {
+        data = (char *)malloc(size);
+        if (!data) {
+            close(fd);
+            return NULL;
+        }
+    }
+
+    while (offset < size) {
+        len = pread(fd, data + offset, size - offset, offset);
+        if (len <= 0) {
+            break;
+        }
+        offset += len;
+    }
+    close(fd);
+
+    if (offset != size) {
+        free(data);
+        return NULL;
+    }
+
+    iov.iov_base = data;
+    iov.iov_len = size;
+
+    entry = compress_entry(cache, key, &iov, 1, encoding);
+
+    free(data);
+
+    return entry;
+}
@@ -0,0 +1,27 @@
+#ifndef __MMHD_COMPRESS_H__
+#define __MMHD_COMPRESS_H__
+
+#include <sys/uio.h>
+
+#include "cache.h"
+
+#define COMPRESS_IDENTITY 0
+#define COMPRESS_GZIP     1
+#define COMPRESS_DEFLATE  2
+
+/* static files larger than this are sent uncompressed */
+#define COMPRESS_MAX_SIZE (1024 * 1024)
+
+int compress_negotiate(const char *accept_encoding);
+int compress_type(const char *content_type);
+const char *compress_name(int encoding);
+
+void *compress_iov(const struct iovec *iov, int iovcnt, int encoding,
+                   size_t *size);
+cache_entry_t *compress_entry(cache_t *cache, const char *key,
+                              const struct iovec *iov, int iovcnt,
+                              int encoding);
+cache_entry_t *compress_file(cache_t *cache, const char *key,
+                             const char *path, size_t size, int encoding);
+
+#endif
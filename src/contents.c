@@ -0,0 +1,346 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+#include "contents.h"
+
+#define BLOCK_SIZE 32768  /* 32k page size */
+
+#define DEFAULT_STYLE "<!DOCTYPE html><html><head><meta http-equiv=\"Content-Type\" content=\"text/html;charset=UTF-8\"/><title>Markdown</title><style type=\"text/css\"><!--h1{font-size:28px;color:rgb(0, 0, 0);}h2{font-size:24px;border-bottom:1px solid rgb(204,204,204);color:rgb(0,0,0);maargin:20px 0pt 10px;padding:0pt;font-wight:bold;}ul,ol{padding-left:30px;}strong,b{font-weight:bold;}table{border-collapse:collapse;border-spacing:0;font:inherit;margin:auto;}table td{border-bottom:1px solid #ddd;}table th{font-weight:bold;}table th,table td{border:1px solid rgb(204,204,204);padding:6px 13px;}table tr{border-top:1px solid #ccc;background-color:#fff}img{display:block;margin:auto;}video{display:block;margin:auto;}pre{background-color:#f8f8f8;border:1px solid #ddd;border-radius:3px 3px 3px 3px;font-size:13px;line-height:19px;overflow:auto;padding:6px 10px;}pre code,pre tt{background-color:transparent;border:medium none;margin:0;padding:0;}pre>code{white-space:pre;}code{white-space:nowrap;}code,tt{background-color:#f8f8f8;border:1px solid #ddd;border-radius:3px 3px 3px 3px;margin:0 2px;padding:0 5px;}.toc{padding:1em 1.5em;color:#999;font-size:.75em;margin-bottom:3em;border:1px solid #999;float:right;list-style-position:inside;background:#fff;}.toc li{}.toc>li{margin-bottom:1em;}.toc a,.toc a:link,.toc a:visited{color:#666;text-decoration:none;}.toc a:hover{color:#999;text-decoration:underline;}.toc>li>a{font-weight:bold;}.toc li li{}.toc li li a{}--></style></head><body></body></html>"
+
+static const char *style_file = NULL;
+static style_t *style_current = NULL;
+static time_t style_checked = 0;
+static pthread_mutex_t style_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static style_t *
+style_load(const char *filename)
+{
+    style_t *style;
+    struct stat statbuf;
+    char *str;
+
+    style = (style_t *)calloc(1, sizeof(style_t));
+    if (!style) {
+        return NULL;
+    }
+
+    if (filename && stat(filename, &statbuf) == 0) {
+        FILE *file = fopen(filename, "rb");
+        if (file) {
+            style->data = (char *)malloc(sizeof(char) * (statbuf.st_size + 1));
+            if (style->data) {
+                style->size = fread(style->data, 1, statbuf.st_size, file);
+                style->data[style->size] = '\0';
+                style->allocated = 1;
+                style->mtime = statbuf.st_mtime;
+                style->fsize = statbuf.st_size;
+                style->ino = statbuf.st_ino;
+                style->version = (unsigned int)statbuf.st_mtime * 31
+                    ^ (unsigned int)statbuf.st_size * 17
+                    ^ (unsigned int)statbuf.st_ino;
+            }
+            fclose(file);
+        }
+        if (!style->data) {
+            free(style);
+            return NULL;
+        }
+    } else {
+        style->data = DEFAULT_STYLE;
+        style->size = strlen(style->data);
+    }
+
+    str = strstr(style->data, "</body>");
+    if (str) {
+        style->head = str - style->data;
+    } else {
+        style->head = style->size;
+    }
+
+    style->refcount = 1;
+
+    return style;
+}
+
+int
+style_init(const char *filename)
+{
+    style_t *style = style_load(filename);
+    if (!style) {
+        return -1;
+    }
+
+    style_file = filename;
+    style_current = style;
+    style_checked = time(NULL);
+
+    return 0;
+}
+
+void
+style_cleanup(void)
+{
+    style_release(style_current);
+    style_current = NULL;
+}
+
+style_t *
+style_get(void)
+{
+    style_t *style, *old;
+    struct stat statbuf;
+    time_t now;
+
+    pthread_mutex_lock(&style_lock);
+    style = style_current;
+    __sync_add_and_fetch(&style->refcount, 1);
+    pthread_mutex_unlock(&style_lock);
+
+    /* reload the style file when it is changed, checked once a second */
+    now = time(NULL);
+    if (!style_file || now == style_checked) {
+        return style;
+    }
+    style_checked = now;
+
+    if (stat(style_file, &statbuf) == 0
+        && (statbuf.st_mtime != style->mtime
+            || statbuf.st_size != style->fsize
+            || statbuf.st_ino != style->ino)) {
+        style_t *reload = style_load(style_file);
+        if (reload) {
+            reload->refcount++; /* caller */
+
+            pthread_mutex_lock(&style_lock);
+            old = style_current;
+            style_current = reload;
+            pthread_mutex_unlock(&style_lock);
+
+            style_release(old);
+            style_release(style);
+            style = reload;
+        }
+    }
+
+    return style;
+}
+
+void
+style_release(style_t *style)
+{
+    if (style && __sync_sub_and_fetch(&style->refcount, 1) == 0) {
+        if (style->allocated) {
+            free(style->data);
+        }
+        free(style);
+    }
+}
+
+fragment_t *
+fragment_new(const char *toc, size_t toc_size,
+             const char *body, size_t body_size)
+{
+    fragment_t *fragment;
+
+    fragment = (fragment_t *)malloc(sizeof(fragment_t) + toc_size + body_size);
+    if (!fragment) {
+        return NULL;
+    }
+
+    fragment->toc_size = toc_size;
+    fragment->body_size = body_size;
+    if (toc_size) {
+        memcpy(fragment->data, toc, toc_size);
+    }
+    if (body_size) {
+        memcpy(fragment->data + toc_size, body, body_size);
+    }
+
+    return fragment;
+}
+
+fragment_t *
+fragment_append(fragment_t *fragment, const char *body, size_t size)
+{
+    fragment_t *grown;
+    size_t used = 0;
+
+    if (fragment) {
+        used = fragment->toc_size + fragment->body_size;
+    }
+
+    grown = (fragment_t *)realloc(fragment, sizeof(fragment_t) + used + size);
+    if (!grown) {
+        free(fragment);
+        return NULL;
+    }
+
+    if (!fragment) {
+        grown->toc_size = 0;
+        grown->body_size = 0;
+    }
+    if (size) {
+        memcpy(grown->data + used, body, size);
+    }
+    grown->body_size += size;
+
+    return grown;
+}
+
+static void
+contents_push(contents_t *contents, const char *data, size_t size)
+{
+    if (data && size) {
+        contents->iov[contents->iovcnt].iov_base = (void *)data;
+        contents->iov[contents->iovcnt].iov_len = size;
+        contents->iovcnt++;
+        contents->length += size;
+    }
+}
+
+contents_t *
+contents_generate(const char *data, const size_t data_size,
+                  const char *toc, const size_t toc_size,
+                  cache_entry_t *entry)
+{
+    contents_t *contents;
+    style_t *style;
+
+    contents = (contents_t *)calloc(1, sizeof(contents_t));
+    if (!contents) {
+        cache_release(entry);
+        return NULL;
+    }
+
+    style = style_get();
+
+    contents->style = style;
+    contents->entry = entry;
+
+    contents_push(contents, style->data, style->head);
+    contents_push(contents, toc, toc_size);
+    contents_push(contents, data, data_size);
+    contents_push(contents, style->data + style->head,
+                  style->size - style->head);
+
+    return contents;
+}
+
+void
+contents_insert(contents_t *contents, const char *data, size_t size)
+{
+    style_t *style = contents->style;
+
+    if (!data || !size || contents->iovcnt == CONTENTS_IOV_MAX) {
+        return;
+    }
+
+    /* the tail, when the style has one, is the last vector */
+    if (style && style->size > style->head) {
+        contents->iovcnt--;
+        contents->length -= style->size - style->head;
+        contents_push(contents, data, size);
+        contents_push(contents, style->data + style->head,
+                      style->size - style->head);
+    } else {
+        contents_push(contents, data, size);
+    }
+}
+
+/* contents of a single buffer kept alive by entry, without the style */
+contents_t *
+contents_buffer(const char *data, const size_t size, cache_entry_t *entry)
+{
+    contents_t *contents;
+
+    contents = (contents_t *)calloc(1, sizeof(contents_t));
+    if (!contents) {
+        cache_release(entry);
+        return NULL;
+    }
+
+    contents->entry = entry;
+
+    contents_push(contents, data, size);
+
+    return contents;
+}
+
+void
+contents_free(contents_t *contents)
+{
+    if (contents) {
+        style_release(contents->style);
+        cache_release(contents->entry);
+        free(contents);
+    }
+}
+
+static void
+contents_destroy_cb(void *cls)
+{
+    contents_free((contents_t *)cls);
+}
+
+#if MHD_VERSION < 0x00097400
+static ssize_t
+contents_output_cb(void *cls, uint64_t pos, char *buf, size_t max)
+{
+    contents_t *contents = cls;
+    size_t offset = 0, len = 0;
+    int i;
+
+    for (i = 0; i < contents->iovcnt && len < max; i++) {
+        size_t size = contents->iov[i].iov_len;
+        if (pos < offset + size) {
+            size_t skip = pos > offset ? pos - offset : 0;
+            size_t n = size - skip;
+            if (n > max - len) {
+                n = max - len;
+            }
+            memcpy(buf + len, (char *)contents->iov[i].iov_base + skip, n);
+            len += n;
+            pos += n;
+        }
+        offset += size;
+    }
+
+    if (len == 0) {
+        return MHD_CONTENT_READER_END_OF_STREAM;
+    }
+
+    return len;
+}
+#endif
+
+struct MHD_Response *
+contents_response(contents_t *contents)
+{
+    struct MHD_Response *response;
+#if MHD_VERSION >= 0x00097400
+    struct MHD_IoVec iov[CONTENTS_IOV_MAX];
+    int i;
+
+    for (i = 0; i < contents->iovcnt; i++) {
+        iov[i].iov_base = contents->iov[i].iov_base;
+        iov[i].iov_len = contents->iov[i].iov_len;
+    }
+
+    response = MHD_create_response_from_iovec(iov, contents->iovcnt,
+                                              &contents_destroy_cb, contents);
+#else
+    response = MHD_create_response_from_callback(contents->length, BLOCK_SIZE,
+                                                 &contents_output_cb, contents,
+                                                 &contents_destroy_cb);
+#endif
+    if (response == NULL) {
+        contents_free(contents);
+    }
+
+    return response;
+}
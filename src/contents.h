@@ -0,0 +1,68 @@
+#ifndef __MMHD_CONTENTS_H__
+#define __MMHD_CONTENTS_H__
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <microhttpd.h>
+
+#include "cache.h"
+
+#define CONTENTS_IOV_MAX 5
+
+typedef struct style {
+    char *data;
+    size_t size;
+    size_t head; /* offset of </body> */
+    time_t mtime;
+    off_t fsize;
+    ino_t ino;
+    unsigned int version;
+    int allocated;
+    int refcount;
+} style_t;
+
+/* rendered fragment stored in the cache: toc followed by body */
+typedef struct fragment {
+    size_t toc_size;
+    size_t body_size;
+    char data[];
+} fragment_t;
+
+typedef struct contents {
+    style_t *style;
+    cache_entry_t *entry;
+    struct iovec iov[CONTENTS_IOV_MAX];
+    int iovcnt;
+    size_t length;
+} contents_t;
+
+int style_init(const char *style_file);
+void style_cleanup(void);
+style_t *style_get(void);
+void style_release(style_t *style);
+
+fragment_t *fragment_new(const char *toc, size_t toc_size,
+                         const char *body, size_t body_size);
+/*
+ * body grown by size, a new fragment without toc from NULL. on failure
+ * the fragment is freed and NULL returned.
+ */
+fragment_t *fragment_append(fragment_t *fragment,
+                            const char *body, size_t size);
+
+contents_t *contents_generate(const char *data, const size_t data_size,
+                              const char *toc, const size_t toc_size,
+                              cache_entry_t *entry);
+/* data put at the </body> split, in front of the style tail */
+void contents_insert(contents_t *contents, const char *data, size_t size);
+contents_t *contents_buffer(const char *data, const size_t size,
+                            cache_entry_t *entry);
+void contents_free(contents_t *contents);
+struct MHD_Response *contents_response(contents_t *contents);
+
+#endif
@@ -0,0 +1,225 @@
+#include <pthread.h>
+
+#include "escape.h"
+#include "hoedown/src/escape.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ESCAPE_X86 1
+#include <immintrin.h>
+#endif
+
+typedef size_t (*escape_scan_t)(const uint8_t *data, size_t i, size_t size,
+                                int secure);
+
+/* same table and entities as hoedown */
+static const uint8_t HTML_ESCAPE_TABLE[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 1, 0, 0, 0, 2, 3, 0, 0, 0, 0, 0, 0, 0, 4,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 5, 0, 6, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+};
+
+static const char *HTML_ESCAPES[] = {
+    "",
+    "&quot;",
+    "&amp;",
+    "&#39;",
+    "&#47;",
+    "&lt;",
+    "&gt;"
+};
+
+static pthread_once_t escape_once = PTHREAD_ONCE_INIT;
+static escape_kernel_t escape_best = ESCAPE_SCALAR;
+
+/*
+ * the kernels return the offset of the next byte to escape, or size.
+ * a slash is written as is unless secure, the vector kernels do not end
+ * a run on it then.
+ */
+static size_t
+escape_scan_scalar(const uint8_t *data, size_t i, size_t size, int secure)
+{
+    while (i < size && HTML_ESCAPE_TABLE[data[i]] == 0) {
+        i++;
+    }
+
+    return i;
+}
+
+#ifdef ESCAPE_X86
+/*
+ * four compares for six bytes: '&' 0x26 and '\'' 0x27 differ in bit 0,
+ * '<' 0x3c and '>' 0x3e in bit 1. without secure the slash compare
+ * repeats the quote one.
+ */
+__attribute__((target("sse2")))
+static size_t
+escape_scan_sse2(const uint8_t *data, size_t i, size_t size, int secure)
+{
+    const __m128i quot = _mm_set1_epi8('"');
+    const __m128i apos = _mm_set1_epi8('\'');
+    const __m128i gt = _mm_set1_epi8('>');
+    const __m128i slash = _mm_set1_epi8(secure ? '/' : '"');
+    const __m128i bit0 = _mm_set1_epi8(1);
+    const __m128i bit1 = _mm_set1_epi8(2);
+    __m128i v, m;
+    int mask;
+
+    for (; i + 16 <= size; i += 16) {
+        v = _mm_loadu_si128((const __m128i *)(data + i));
+        m = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, quot),
+                         _mm_cmpeq_epi8(v, slash)),
+            _mm_or_si128(_mm_cmpeq_epi8(_mm_or_si128(v, bit0), apos),
+                         _mm_cmpeq_epi8(_mm_or_si128(v, bit1), gt)));
+        mask = _mm_movemask_epi8(m);
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+
+    return escape_scan_scalar(data, i, size, secure);
+}
+
+__attribute__((target("avx2")))
+static size_t
+escape_scan_avx2(const uint8_t *data, size_t i, size_t size, int secure)
+{
+    const __m256i quot = _mm256_set1_epi8('"');
+    const __m256i apos = _mm256_set1_epi8('\'');
+    const __m256i gt = _mm256_set1_epi8('>');
+    const __m256i slash = _mm256_set1_epi8(secure ? '/' : '"');
+    const __m256i bit0 = _mm256_set1_epi8(1);
+    const __m256i bit1 = _mm256_set1_epi8(2);
+    __m256i v, m;
+    unsigned int mask;
+
+    for (; i + 32 <= size; i += 32) {
+        v = _mm256_loadu_si256((const __m256i *)(data + i));
+        m = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, quot),
+                            _mm256_cmpeq_epi8(v, slash)),
+            _mm256_or_si256(
+                _mm256_cmpeq_epi8(_mm256_or_si256(v, bit0), apos),
+                _mm256_cmpeq_epi8(_mm256_or_si256(v, bit1), gt)));
+        mask = (unsigned int)_mm256_movemask_epi8(m);
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+
+    return escape_scan_sse2(data, i, size, secure);
+}
+#endif
+
+static const escape_scan_t escape_scans[ESCAPE_KERNEL_MAX] = {
+    escape_scan_scalar,
+#ifdef ESCAPE_X86
+    escape_scan_sse2,
+    escape_scan_avx2,
+#endif
+};
+
+static const char *escape_names[ESCAPE_KERNEL_MAX] = {
+    "scalar", "sse2", "avx2"
+};
+
+static void
+escape_detect(void)
+{
+#ifdef ESCAPE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        escape_best = ESCAPE_AVX2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        escape_best = ESCAPE_SSE2;
+    }
+#endif
+}
+
+escape_kernel_t
+escape_kernel(void)
+{
+    pthread_once(&escape_once, escape_detect);
+
+    return escape_best;
+}
+
+const char *
+escape_kernel_name(escape_kernel_t kernel)
+{
+    if (kernel >= ESCAPE_KERNEL_MAX) {
+        return NULL;
+    }
+
+    return escape_names[kernel];
+}
+
+/* the loop of hoedown with the scan of a kernel */
+static void
+escape_html(escape_scan_t scan, hoedown_buffer *ob, const uint8_t *data,
+            size_t size, int secure)
+{
+    size_t i = 0, mark;
+
+    while (1) {
+        mark = i;
+        i = scan(data, i, size, secure);
+
+        /* nothing to escape */
+        if (mark == 0 && i >= size) {
+            hoedown_buffer_put(ob, data, size);
+            return;
+        }
+
+        if (i > mark) {
+            hoedown_buffer_put(ob, data + mark, i - mark);
+        }
+
+        if (i >= size) {
+            break;
+        }
+
+        if (!secure && data[i] == '/') {
+            hoedown_buffer_putc(ob, '/');
+        } else {
+            hoedown_buffer_puts(ob, HTML_ESCAPES[HTML_ESCAPE_TABLE[data[i]]]);
+        }
+        i++;
+    }
+}
+
+int
+escape_html_kernel(escape_kernel_t kernel, hoedown_buffer *ob,
+                   const uint8_t *data, size_t size, int secure)
+{
+    /* avx2 implies sse2 */
+    if (kernel > escape_kernel()) {
+        return -1;
+    }
+
+    escape_html(escape_scans[kernel], ob, data, size, secure);
+
+    return 0;
+}
+
+/* called by the hoedown html renderer for code, text and attributes */
+void
+hoedown_escape_html(hoedown_buffer *ob, const uint8_t *data, size_t size,
+                    int secure)
+{
+    escape_html(escape_scans[escape_kernel()], ob, data, size, secure);
+}
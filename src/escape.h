@@ -0,0 +1,31 @@
+#ifndef __MMHD_ESCAPE_H__
+#define __MMHD_ESCAPE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hoedown/src/buffer.h"
+
+typedef enum {
+    ESCAPE_SCALAR = 0,
+    ESCAPE_SSE2,
+    ESCAPE_AVX2,
+    ESCAPE_KERNEL_MAX
+} escape_kernel_t;
+
+/*
+ * the byte loop of hoedown, renamed at build time so that
+ * hoedown_escape_html() is the one of escape.c
+ */
+void hoedown_escape_html_scalar(hoedown_buffer *ob, const uint8_t *data,
+                                size_t size, int secure);
+
+/* best kernel the cpu supports, detected once */
+escape_kernel_t escape_kernel(void);
+const char *escape_kernel_name(escape_kernel_t kernel);
+
+/* -1 when the cpu lacks the kernel */
+int escape_html_kernel(escape_kernel_t kernel, hoedown_buffer *ob,
+                       const uint8_t *data, size_t size, int secure);
+
+#endif
@@ -0,0 +1,750 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "export.h"
+#include "compress.h"
+#include "contents.h"
+#include "mime.h"
+
+#define EXPORT_HEADER "# mmhd export 1\n"
+#define EXPORT_INDEX_FILE "index.html"
+#define EXPORT_FILES_MIN 256
+#define EXPORT_COPY_UNIT (64 * 1024)
+
+/* manifest kinds */
+#define EXPORT_PAGE   'm'
+#define EXPORT_INDEX  'i' /* directory index, also written as index.html */
+#define EXPORT_STATIC 's'
+
+/* line of the manifest: kind mtime.nsec size flags path */
+typedef struct export_record {
+    char kind;
+    long sec;
+    long nsec;
+    long long size;
+    unsigned int flags;
+    char *path;
+    int seen;
+} export_record_t;
+
+typedef struct export_file {
+    char *path; /* relative to the root */
+    struct stat st;
+    char kind;
+    export_record_t *old;
+    int done;
+} export_file_t;
+
+typedef struct export {
+    const export_params_t *params;
+    export_stats_t *stats;
+    unsigned int page_flags;
+    unsigned int static_flags;
+    dev_t out_dev;
+    ino_t out_ino;
+    export_file_t *files;
+    size_t count;
+    size_t alloc;
+    size_t next;
+    export_record_t *records;
+    size_t nrecords;
+    char *manifest;
+} export_t;
+
+static int
+export_record_compare(const void *a, const void *b)
+{
+    return strcmp(((const export_record_t *)a)->path,
+                  ((const export_record_t *)b)->path);
+}
+
+static export_record_t *
+export_record_find(export_t *export, const char *path)
+{
+    export_record_t key;
+
+    if (export->nrecords == 0) {
+        return NULL;
+    }
+
+    key.path = (char *)path;
+
+    return bsearch(&key, export->records, export->nrecords,
+                   sizeof(export_record_t), export_record_compare);
+}
+
+/* records point into the manifest text, a broken line is dropped */
+static void
+export_manifest_read(export_t *export)
+{
+    char path[PATH_MAX], *line, *next;
+    export_record_t *record;
+    size_t lines = 0, size;
+    FILE *fp;
+    int n;
+
+    snprintf(path, sizeof(path), "%s/%s",
+             export->params->outdir, EXPORT_MANIFEST);
+    fp = fopen(path, "r");
+    if (!fp) {
+        return;
+    }
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    rewind(fp);
+
+    export->manifest = (char *)malloc(size + 1);
+    if (!export->manifest || fread(export->manifest, 1, size, fp) != size) {
+        free(export->manifest);
+        export->manifest = NULL;
+        fclose(fp);
+        return;
+    }
+    fclose(fp);
+    export->manifest[size] = '\0';
+
+    /* written by another version: everything is redone */
+    if (strncmp(export->manifest, EXPORT_HEADER,
+                sizeof(EXPORT_HEADER) - 1) != 0) {
+        return;
+    }
+
+    for (line = export->manifest; *line; line++) {
+        lines += (*line == '\n');
+    }
+    export->records = (export_record_t *)calloc(lines + 1,
+                                                sizeof(export_record_t));
+    if (!export->records) {
+        return;
+    }
+
+    line = export->manifest + sizeof(EXPORT_HEADER) - 1;
+    for (; *line; line = next) {
+        next = strchr(line, '\n');
+        if (!next) {
+            break;
+        }
+        *next++ = '\0';
+
+        record = &export->records[export->nrecords];
+        n = 0;
+        if (sscanf(line, "%c %ld.%ld %lld %x %n", &record->kind,
+                   &record->sec, &record->nsec, &record->size,
+                   &record->flags, &n) != 5
+            || n == 0 || line[n] == '\0') {
+            continue;
+        }
+        record->path = line + n;
+        export->nrecords++;
+    }
+
+    qsort(export->records, export->nrecords, sizeof(export_record_t),
+          export_record_compare);
+}
+
+/* only the files done or unchanged, failed ones are retried next time */
+static int
+export_manifest_write(export_t *export)
+{
+    char path[PATH_MAX], tmp[PATH_MAX+8];
+    export_file_t *file;
+    FILE *fp;
+    size_t i;
+    int ret;
+
+    snprintf(path, sizeof(path), "%s/%s",
+             export->params->outdir, EXPORT_MANIFEST);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    fp = fopen(tmp, "w");
+    if (!fp) {
+        return -1;
+    }
+
+    fputs(EXPORT_HEADER, fp);
+    for (i = 0; i < export->count; i++) {
+        file = &export->files[i];
+        if (!file->done) {
+            continue;
+        }
+        fprintf(fp, "%c %ld.%09ld %lld %x %s\n", file->kind,
+                (long)file->st.st_mtim.tv_sec,
+                (long)file->st.st_mtim.tv_nsec,
+                (long long)file->st.st_size,
+                file->kind == EXPORT_STATIC
+                ? export->static_flags : export->page_flags,
+                file->path);
+    }
+
+    ret = ferror(fp);
+    if (fclose(fp) != 0 || ret != 0 || rename(tmp, path) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void
+export_error(export_t *export, const char *path, int err)
+{
+    __sync_add_and_fetch(&export->stats->failed, 1);
+    if (export->params->error) {
+        export->params->error(path, err, export->params->arg);
+    }
+}
+
+/* index.html next to path in the output */
+static int
+export_index_path(char *buf, size_t size, const char *dir,
+                  const char *path)
+{
+    const char *slash = strrchr(path, '/');
+
+    if (slash) {
+        return snprintf(buf, size, "%s/%.*s/%s", dir, (int)(slash - path),
+                        path, EXPORT_INDEX_FILE) >= (int)size ? -1 : 0;
+    }
+
+    return snprintf(buf, size, "%s/%s", dir, EXPORT_INDEX_FILE)
+        >= (int)size ? -1 : 0;
+}
+
+static void
+export_unlink(const char *path)
+{
+    char gz[PATH_MAX+4];
+
+    unlink(path);
+    snprintf(gz, sizeof(gz), "%s.gz", path);
+    unlink(gz);
+}
+
+static int
+export_add(export_t *export, const char *path, const struct stat *st,
+           char kind)
+{
+    export_file_t *file;
+
+    if (export->count == export->alloc) {
+        size_t alloc = export->alloc ? export->alloc * 2 : EXPORT_FILES_MIN;
+        file = realloc(export->files, alloc * sizeof(export_file_t));
+        if (!file) {
+            return -1;
+        }
+        export->files = file;
+        export->alloc = alloc;
+    }
+
+    file = &export->files[export->count];
+    memset(file, 0, sizeof(export_file_t));
+    file->path = strdup(path);
+    if (!file->path) {
+        return -1;
+    }
+    file->st = *st;
+    file->kind = kind;
+
+    /* an index page no more: its index.html goes before any is written */
+    file->old = export_record_find(export, path);
+    if (file->old) {
+        file->old->seen = 1;
+        if (file->old->kind == EXPORT_INDEX && kind != EXPORT_INDEX) {
+            char index[PATH_MAX];
+            if (export_index_path(index, sizeof(index),
+                                  export->params->outdir, path) == 0) {
+                export_unlink(index);
+            }
+        }
+    }
+    export->count++;
+
+    return 0;
+}
+
+/*
+ * files below rel, output directories are made on the way. hidden
+ * files, directory links and the output directory are skipped.
+ */
+static void
+export_scan(export_t *export, const char *rel)
+{
+    const export_params_t *params = export->params;
+    char dir[PATH_MAX], path[PATH_MAX], child[PATH_MAX];
+    struct dirent *dent;
+    struct stat st;
+    const char *ext;
+    char kind;
+    DIR *dp;
+
+    snprintf(dir, sizeof(dir), "%s/%s", params->root_dir, rel);
+    dp = opendir(dir);
+    if (!dp) {
+        export_error(export, dir, errno);
+        return;
+    }
+
+    while ((dent = readdir(dp)) != NULL) {
+        if (dent->d_name[0] == '.' || strchr(dent->d_name, '\n')) {
+            continue;
+        }
+        if (snprintf(child, sizeof(child), "%s%s%s", rel, *rel ? "/" : "",
+                     dent->d_name) >= (int)sizeof(child)
+            || snprintf(path, sizeof(path), "%s/%s", params->root_dir,
+                        child) >= (int)sizeof(path)) {
+            continue;
+        }
+        if (lstat(path, &st) != 0) {
+            continue;
+        }
+
+        if (S_ISDIR(st.st_mode)) {
+            if (st.st_dev == export->out_dev && st.st_ino == export->out_ino) {
+                continue;
+            }
+            if (snprintf(path, sizeof(path), "%s/%s", params->outdir, child)
+                >= (int)sizeof(path)) {
+                export_error(export, child, ENAMETOOLONG);
+                continue;
+            }
+            if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+                export_error(export, path, errno);
+                continue;
+            }
+            export_scan(export, child);
+            continue;
+        }
+
+        if (S_ISLNK(st.st_mode) && stat(path, &st) != 0) {
+            continue;
+        }
+        if (!S_ISREG(st.st_mode)) {
+            continue;
+        }
+
+        ext = strrchr(dent->d_name, '.');
+        if (ext == dent->d_name) {
+            ext = NULL;
+        }
+        if (!mime_lookup(ext)->markdown) {
+            kind = EXPORT_STATIC;
+        } else if (strcmp(dent->d_name, params->directory_index) == 0) {
+            kind = EXPORT_INDEX;
+        } else {
+            kind = EXPORT_PAGE;
+        }
+
+        if (export_add(export, child, &st, kind) != 0) {
+            export_error(export, path, ENOMEM);
+        }
+    }
+
+    closedir(dp);
+}
+
+/* written beside and renamed, readers never see a partial file */
+static int
+export_write(const char *path, const struct iovec *iov, int iovcnt)
+{
+    char tmp[PATH_MAX+8];
+    const char *p;
+    size_t left;
+    ssize_t len;
+    int fd, i;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        return -1;
+    }
+
+    for (i = 0; i < iovcnt; i++) {
+        p = (const char *)iov[i].iov_base;
+        left = iov[i].iov_len;
+        while (left > 0) {
+            len = write(fd, p, left);
+            if (len < 0 && errno == EINTR) {
+                continue;
+            }
+            if (len <= 0) {
+                close(fd);
+                unlink(tmp);
+                return -1;
+            }
+            p += len;
+            left -= len;
+        }
+    }
+
+    if (close(fd) != 0 || rename(tmp, path) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+export_copy(const char *src, const char *tmp)
+{
+    char buf[EXPORT_COPY_UNIT], *p;
+    ssize_t len, written;
+    int in, out, ret = 0;
+
+    in = open(src, O_RDONLY | O_CLOEXEC);
+    if (in == -1) {
+        return -1;
+    }
+    out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out == -1) {
+        close(in);
+        return -1;
+    }
+
+    while (ret == 0 && (len = read(in, buf, sizeof(buf))) != 0) {
+        if (len < 0) {
+            ret = errno == EINTR ? 0 : -1;
+            continue;
+        }
+        for (p = buf; len > 0; p += written, len -= written) {
+            written = write(out, p, len);
+            if (written < 0 && errno == EINTR) {
+                written = 0;
+            } else if (written <= 0) {
+                ret = -1;
+                break;
+            }
+        }
+    }
+
+    close(in);
+    if (close(out) != 0) {
+        ret = -1;
+    }
+
+    return ret;
+}
+
+/* path made a hard link of src, a copy on another file system */
+static int
+export_link(const char *src, const char *path, int copy)
+{
+    char tmp[PATH_MAX+8];
+    struct stat a, b;
+
+    /* rename() of a link to the same file does nothing */
+    if (stat(src, &a) == 0 && stat(path, &b) == 0
+        && a.st_dev == b.st_dev && a.st_ino == b.st_ino) {
+        return 0;
+    }
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    unlink(tmp);
+    if (link(src, tmp) != 0
+        && (!copy || export_copy(src, tmp) != 0)) {
+        unlink(tmp);
+        return -1;
+    }
+
+    if (rename(tmp, path) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* the gzip sibling, or none */
+static int
+export_gzip(const char *path, cache_entry_t *gz)
+{
+    char gzpath[PATH_MAX+4];
+    struct iovec iov;
+    int ret;
+
+    snprintf(gzpath, sizeof(gzpath), "%s.gz", path);
+    if (!gz) {
+        unlink(gzpath);
+        return 0;
+    }
+
+    iov.iov_base = gz->data;
+    iov.iov_len = gz->size;
+    ret = export_write(gzpath, &iov, 1);
+    cache_release(gz);
+
+    return ret;
+}
+
+static int
+export_page(export_t *export, export_file_t *file, const char *src,
+            const char *dst)
+{
+    const export_params_t *params = export->params;
+    char index[PATH_MAX], source[PATH_MAX], gz[PATH_MAX+4], igz[PATH_MAX+4];
+    cache_entry_t *entry, *centry = NULL;
+    fragment_t *fragment;
+    contents_t *contents;
+    struct stat st;
+    int ret, err;
+
+    entry = params->render(src, &file->st, params->arg);
+    if (!entry) {
+        errno = EIO;
+        return -1;
+    }
+
+    fragment = (fragment_t *)entry->data;
+    contents = contents_generate(
+        fragment->data + fragment->toc_size, fragment->body_size,
+        fragment->data, fragment->toc_size, entry);
+    if (!contents) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    ret = export_write(dst, contents->iov, contents->iovcnt);
+    err = errno;
+    if (ret == 0 && params->compress
+        && contents->length >= params->compress_min) {
+        centry = compress_entry(NULL, dst, contents->iov, contents->iovcnt,
+                                COMPRESS_GZIP);
+    }
+    contents_free(contents);
+    if (ret != 0) {
+        errno = err;
+        return -1;
+    }
+    if (export_gzip(dst, centry) != 0) {
+        return -1;
+    }
+
+    /* a directory url is served from index.html, unless there is one */
+    if (file->kind != EXPORT_INDEX
+        || export_index_path(index, sizeof(index), params->outdir,
+                             file->path) != 0
+        || export_index_path(source, sizeof(source), params->root_dir,
+                             file->path) != 0
+        || stat(source, &st) == 0) {
+        return 0;
+    }
+    if (export_link(dst, index, 0) != 0) {
+        return -1;
+    }
+
+    snprintf(gz, sizeof(gz), "%s.gz", dst);
+    snprintf(igz, sizeof(igz), "%s.gz", index);
+    if (stat(gz, &st) == 0) {
+        return export_link(gz, igz, 0);
+    }
+    unlink(igz);
+
+    return 0;
+}
+
+static int
+export_static(export_t *export, export_file_t *file, const char *src,
+              const char *dst)
+{
+    const export_params_t *params = export->params;
+    cache_entry_t *centry = NULL;
+    const char *ext;
+
+    if (export_link(src, dst, 1) != 0) {
+        return -1;
+    }
+
+    /* same files as the server compresses */
+    ext = strrchr(file->path, '.');
+    if (params->compress && ext && !strchr(ext, '/')
+        && compress_type(mime_lookup(ext)->type)
+        && (size_t)file->st.st_size >= params->compress_min
+        && file->st.st_size <= COMPRESS_MAX_SIZE) {
+        centry = compress_file(NULL, dst, src, file->st.st_size,
+                               COMPRESS_GZIP);
+    }
+
+    return export_gzip(dst, centry);
+}
+
+static void
+export_file(export_t *export, export_file_t *file)
+{
+    const export_params_t *params = export->params;
+    char src[PATH_MAX], dst[PATH_MAX], index[PATH_MAX];
+    export_record_t *old = file->old;
+    unsigned int flags;
+    struct stat st;
+    int ret;
+
+    if (snprintf(src, sizeof(src), "%s/%s", params->root_dir, file->path)
+        >= (int)sizeof(src)
+        || snprintf(dst, sizeof(dst), "%s/%s", params->outdir, file->path)
+        >= (int)sizeof(dst)) {
+        export_error(export, file->path, ENAMETOOLONG);
+        return;
+    }
+
+    flags = file->kind == EXPORT_STATIC
+        ? export->static_flags : export->page_flags;
+    if (old && old->kind == file->kind
+        && old->sec == (long)file->st.st_mtim.tv_sec
+        && old->nsec == (long)file->st.st_mtim.tv_nsec
+        && old->size == (long long)file->st.st_size
+        && old->flags == flags && stat(dst, &st) == 0
+        /* the index.html of a removed static one is written again */
+        && (file->kind != EXPORT_INDEX
+            || export_index_path(index, sizeof(index), params->outdir,
+                                 file->path) != 0
+            || stat(index, &st) == 0)) {
+        __sync_add_and_fetch(&export->stats->unchanged, 1);
+        file->done = 1;
+        return;
+    }
+
+    if (file->kind == EXPORT_STATIC) {
+        ret = export_static(export, file, src, dst);
+    } else {
+        ret = export_page(export, file, src, dst);
+    }
+
+    if (ret != 0) {
+        export_error(export, src, errno);
+        return;
+    }
+
+    if (file->kind == EXPORT_STATIC) {
+        __sync_add_and_fetch(&export->stats->copied, 1);
+    } else {
+        __sync_add_and_fetch(&export->stats->rendered, 1);
+    }
+    file->done = 1;
+}
+
+static void *
+export_worker(void *arg)
+{
+    export_t *export = (export_t *)arg;
+    size_t i;
+
+    while (1) {
+        i = __sync_fetch_and_add(&export->next, 1);
+        if (i >= export->count) {
+            break;
+        }
+        export_file(export, &export->files[i]);
+    }
+
+    return NULL;
+}
+
+/* outputs of the files gone since the last run */
+static void
+export_remove(export_t *export)
+{
+    char path[PATH_MAX];
+    export_record_t *record;
+    size_t i;
+
+    for (i = 0; i < export->nrecords; i++) {
+        record = &export->records[i];
+        if (record->seen) {
+            continue;
+        }
+        if (snprintf(path, sizeof(path), "%s/%s",
+                     export->params->outdir, record->path)
+            >= (int)sizeof(path)) {
+            continue;
+        }
+        export_unlink(path);
+        if (record->kind == EXPORT_INDEX
+            && export_index_path(path, sizeof(path),
+                                 export->params->outdir, record->path) == 0) {
+            export_unlink(path);
+        }
+        export->stats->removed++;
+    }
+}
+
+int
+export_run(const export_params_t *params, export_stats_t *stats)
+{
+    export_t export;
+    struct stat root, out;
+    pthread_t *workers;
+    char flags[PATH_MAX];
+    int i, n = 0;
+    size_t j;
+
+    memset(stats, 0, sizeof(export_stats_t));
+
+    if (mkdir(params->outdir, 0755) != 0 && errno != EEXIST) {
+        return -1;
+    }
+    if (stat(params->root_dir, &root) != 0
+        || stat(params->outdir, &out) != 0 || !S_ISDIR(out.st_mode)) {
+        return -1;
+    }
+    /* the sources would be replaced */
+    if (root.st_dev == out.st_dev && root.st_ino == out.st_ino) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(&export, 0, sizeof(export));
+    export.params = params;
+    export.stats = stats;
+    export.out_dev = out.st_dev;
+    export.out_ino = out.st_ino;
+
+    snprintf(flags, sizeof(flags), "%x|%d|%zu|%s", params->flags,
+             params->compress, params->compress_min,
+             params->directory_index);
+    export.page_flags = cache_hash(flags);
+    snprintf(flags, sizeof(flags), "%d|%zu", params->compress,
+             params->compress_min);
+    export.static_flags = cache_hash(flags);
+
+    export_manifest_read(&export);
+    export_scan(&export, "");
+    export_remove(&export);
+
+    workers = (pthread_t *)calloc(params->threads > 0 ? params->threads : 1,
+                                  sizeof(pthread_t));
+    if (workers) {
+        for (n = 0; n < params->threads; n++) {
+            if (pthread_create(&workers[n], NULL,
+                               &export_worker, &export) != 0) {
+                break;
+            }
+        }
+    }
+    if (n == 0) {
+        export_worker(&export);
+    }
+    for (i = 0; i < n; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+
+    if (export_manifest_write(&export) != 0) {
+        export_error(&export, EXPORT_MANIFEST, errno);
+    }
+
+    for (j = 0; j < export.count; j++) {
+        free(export.files[j].path);
+    }
+    free(export.files);
+    free(export.records);
+    free(export.manifest);
+
+    return 0;
+}
@@ -0,0 +1,44 @@
+#ifndef __MMHD_EXPORT_H__
+#define __MMHD_EXPORT_H__
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+
+/* exported files of the last run, in the output directory */
+#define EXPORT_MANIFEST ".mmhd-export"
+
+typedef struct export_params {
+    const char *root_dir;
+    const char *directory_index;
+    const char *outdir;
+    unsigned int flags; /* render flags and style, pages are redone on change */
+    int compress;       /* gzip siblings */
+    size_t compress_min;
+    int threads;
+    /* rendered fragment of a markdown file, as a referenced entry */
+    cache_entry_t *(*render)(const char *path, const struct stat *st,
+                             void *arg);
+    void (*error)(const char *path, int err, void *arg);
+    void *arg;
+} export_params_t;
+
+typedef struct export_stats {
+    size_t rendered;
+    size_t copied;
+    size_t unchanged;
+    size_t removed;
+    size_t failed;
+} export_stats_t;
+
+/*
+ * pages and static files below root_dir written to the same paths in
+ * outdir, static files hard-linked when possible. files unchanged since
+ * the last run are kept, the outputs of removed ones are deleted.
+ * -1 when outdir cannot be used.
+ */
+int export_run(const export_params_t *params, export_stats_t *stats);
+
+#endif
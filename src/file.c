@@ -0,0 +1,265 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "file.h"
+
+#define BLOCK_SIZE 32768  /* 32k page size */
+
+typedef struct file_part {
+    char header[256];
+    size_t header_size;
+    uint64_t start;
+    uint64_t length;
+} file_part_t;
+
+typedef struct file_ranges {
+    int fd;
+    int count;
+    file_part_t part[HTTP_RANGE_MAX];
+    char trailer[64];
+    size_t trailer_size;
+    char content_type[96];
+} file_ranges_t;
+
+static void
+file_free_cb(void *data)
+{
+    file_t *file = data;
+
+    if (file) {
+        close(file->fd);
+        free(file);
+    }
+}
+
+static int
+file_changed(const struct stat *a, const struct stat *b)
+{
+    return a->st_ino != b->st_ino || a->st_dev != b->st_dev
+        || a->st_size != b->st_size || a->st_mtime != b->st_mtime;
+}
+
+cache_t *
+file_cache_new(size_t max_count)
+{
+    return cache_new(0, max_count, &file_free_cb);
+}
+
+/*
+ * returns a descriptor owned by the caller (given to MHD, which closes it).
+ * cached descriptors are dup()ed, so a hit costs no open() and the cached
+ * one is replaced as soon as the stat of the path no longer matches.
+ */
+int
+file_open(cache_t *cache, const char *path, const struct stat *st)
+{
+    cache_entry_t *entry;
+    file_t *file;
+    int fd;
+
+    if (!cache) {
+        return open(path, O_RDONLY | O_CLOEXEC);
+    }
+
+    entry = cache_get(cache, path);
+    if (entry) {
+        file = entry->data;
+        if (!file_changed(&file->st, st)) {
+            fd = dup(file->fd);
+            cache_release(entry);
+            return fd;
+        }
+        cache_release(entry);
+    }
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+
+    file = (file_t *)malloc(sizeof(file_t));
+    if (!file) {
+        return fd;
+    }
+    file->fd = fd;
+
+    if (fstat(fd, &file->st) != 0 || file_changed(&file->st, st)) {
+        /* changed while opening, do not cache */
+        free(file);
+        return fd;
+    }
+
+    entry = cache_set(cache, path, file, 0);
+    if (!entry) {
+        return -1;
+    }
+
+    fd = dup(file->fd);
+    cache_release(entry);
+
+    return fd;
+}
+
+/* single range, still sent with sendfile */
+struct MHD_Response *
+file_range_response(int fd, uint64_t size, const http_range_t *range)
+{
+    struct MHD_Response *response;
+    char buf[96];
+
+#if MHD_VERSION >= 0x00094400
+    response = MHD_create_response_from_fd_at_offset64(range->length, fd,
+                                                       range->start);
+#else
+    response = MHD_create_response_from_fd_at_offset(range->length, fd,
+                                                     range->start);
+#endif
+    if (response == NULL) {
+        return NULL;
+    }
+
+    snprintf(buf, sizeof(buf), "bytes %llu-%llu/%llu",
+             (unsigned long long)range->start,
+             (unsigned long long)(range->start + range->length - 1),
+             (unsigned long long)size);
+    MHD_add_response_header(response, "Content-Range", buf);
+
+    return response;
+}
+
+static ssize_t
+file_ranges_output_cb(void *cls, uint64_t pos, char *buf, size_t max)
+{
+    file_ranges_t *ranges = cls;
+    uint64_t offset = 0;
+    size_t len = 0, n;
+    ssize_t ret;
+    int i;
+
+    for (i = 0; i <= ranges->count && len < max; i++) {
+        const char *header;
+        size_t header_size;
+
+        if (i == ranges->count) {
+            header = ranges->trailer;
+            header_size = ranges->trailer_size;
+        } else {
+            header = ranges->part[i].header;
+            header_size = ranges->part[i].header_size;
+        }
+
+        if (pos < offset + header_size) {
+            n = offset + header_size - pos;
+            if (n > max - len) {
+                n = max - len;
+            }
+            memcpy(buf + len, header + (pos - offset), n);
+            len += n;
+            pos += n;
+        }
+        offset += header_size;
+
+        if (i == ranges->count || len == max) {
+            continue;
+        }
+
+        if (pos < offset + ranges->part[i].length) {
+            n = offset + ranges->part[i].length - pos;
+            if (n > max - len) {
+                n = max - len;
+            }
+            ret = pread(ranges->fd, buf + len, n,
+                        ranges->part[i].start + (pos - offset));
+            if (ret <= 0) {
+                return MHD_CONTENT_READER_END_WITH_ERROR;
+            }
+            len += ret;
+            pos += ret;
+            if ((size_t)ret < n) {
+                break;
+            }
+        }
+        offset += ranges->part[i].length;
+    }
+
+    if (len == 0) {
+        return MHD_CONTENT_READER_END_OF_STREAM;
+    }
+
+    return len;
+}
+
+static void
+file_ranges_free_cb(void *cls)
+{
+    file_ranges_t *ranges = cls;
+
+    close(ranges->fd);
+    free(ranges);
+}
+
+/*
+ * multipart/byteranges body, the parts are read with pread since
+ * sendfile can not interleave the part headers.
+ */
+struct MHD_Response *
+file_ranges_response(int fd, uint64_t size,
+                     const http_range_t *ranges, int count,
+                     const char *content_type, const char **multipart_type)
+{
+    struct MHD_Response *response;
+    file_ranges_t *data;
+    char boundary[32];
+    uint64_t total = 0;
+    int i;
+
+    data = (file_ranges_t *)calloc(1, sizeof(file_ranges_t));
+    if (!data) {
+        return NULL;
+    }
+
+    snprintf(boundary, sizeof(boundary), "mmhd%08lx%08x",
+             (unsigned long)time(NULL), (unsigned int)getpid() ^ (fd << 16));
+
+    for (i = 0; i < count; i++) {
+        data->part[i].header_size = snprintf(
+            data->part[i].header, sizeof(data->part[i].header),
+            "\r\n--%s\r\nContent-Type: %s\r\n"
+            "Content-Range: bytes %llu-%llu/%llu\r\n\r\n",
+            boundary, content_type,
+            (unsigned long long)ranges[i].start,
+            (unsigned long long)(ranges[i].start + ranges[i].length - 1),
+            (unsigned long long)size);
+        if (data->part[i].header_size >= sizeof(data->part[i].header)) {
+            free(data);
+            return NULL;
+        }
+        data->part[i].start = ranges[i].start;
+        data->part[i].length = ranges[i].length;
+        total += data->part[i].header_size + data->part[i].length;
+    }
+    data->count = count;
+    data->trailer_size = snprintf(data->trailer, sizeof(data->trailer),
+                                  "\r\n--%s--\r\n", boundary);
+    total += data->trailer_size;
+
+    snprintf(data->content_type, sizeof(data->content_type),
+             "multipart/byteranges; boundary=%s", boundary);
+
+    response = MHD_create_response_from_callback(total, BLOCK_SIZE,
+                                                 &file_ranges_output_cb, data,
+                                                 &file_ranges_free_cb);
+    if (response == NULL) {
+        free(data);
+        return NULL;
+    }
+    data->fd = fd;
+
+    *multipart_type = data->content_type;
+
+    return response;
+}
@@ -0,0 +1,26 @@
+#ifndef __MMHD_FILE_H__
+#define __MMHD_FILE_H__
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+#include "http.h"
+
+typedef struct file {
+    int fd;
+    struct stat st;
+} file_t;
+
+cache_t *file_cache_new(size_t max_count);
+int file_open(cache_t *cache, const char *path, const struct stat *st);
+
+struct MHD_Response *file_range_response(int fd, uint64_t size,
+                                         const http_range_t *range);
+struct MHD_Response *file_ranges_response(int fd, uint64_t size,
+                                          const http_range_t *ranges,
+                                          int count,
+                                          const char *content_type,
+                                          const char **multipart_type);
+
+#endif
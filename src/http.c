@@ -0,0 +1,281 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "http.h"
+
+static const char *http_date_formats[] = {
+    "%a, %d %b %Y %H:%M:%S GMT", /* rfc 1123 */
+    "%A, %d-%b-%y %H:%M:%S GMT", /* rfc 850 */
+    "%a %b %e %H:%M:%S %Y",      /* asctime */
+    NULL
+};
+
+void
+http_date(char *buf, size_t size, time_t t)
+{
+    struct tm tm;
+
+    gmtime_r(&t, &tm);
+    strftime(buf, size, http_date_formats[0], &tm);
+}
+
+time_t
+http_date_parse(const char *str)
+{
+    struct tm tm;
+    int i;
+
+    for (i = 0; http_date_formats[i]; i++) {
+        memset(&tm, 0, sizeof(tm));
+        if (strptime(str, http_date_formats[i], &tm)) {
+            return timegm(&tm);
+        }
+    }
+
+    return (time_t)-1;
+}
+
+/* weak comparison of an If-None-Match list against etag */
+int
+http_etag_match(const char *header, const char *etag)
+{
+    const char *p = header, *end;
+    size_t len = strlen(etag);
+
+    while (*p) {
+        while (*p == ' ' || *p == '\t' || *p == ',') {
+            p++;
+        }
+        if (*p == '*') {
+            return 1;
+        }
+        if (strncmp(p, "W/", 2) == 0) {
+            p += 2;
+        }
+        end = p;
+        if (*end == '"') {
+            end = strchr(end + 1, '"');
+            if (!end) {
+                return 0;
+            }
+            end++;
+        } else {
+            while (*end && *end != ',') {
+                end++;
+            }
+        }
+        if ((size_t)(end - p) == len && strncmp(p, etag, len) == 0) {
+            return 1;
+        }
+        p = end;
+    }
+
+    return 0;
+}
+
+int
+http_not_modified(struct MHD_Connection *connection,
+                  const char *etag, time_t mtime)
+{
+    const char *value;
+    time_t since;
+
+    value = MHD_lookup_connection_value(connection, MHD_HEADER_KIND,
+                                        "If-None-Match");
+    if (value) {
+        /* If-None-Match takes precedence over If-Modified-Since */
+        return etag && http_etag_match(value, etag);
+    }
+
+    value = MHD_lookup_connection_value(connection, MHD_HEADER_KIND,
+                                        "If-Modified-Since");
+    if (value) {
+        since = http_date_parse(value);
+        return since != (time_t)-1 && mtime <= since;
+    }
+
+    return 0;
+}
+
+void
+http_validators(struct MHD_Response *response,
+                const char *etag, time_t mtime, int max_age)
+{
+    char buf[HTTP_DATE_SIZE];
+
+    if (etag && *etag) {
+        MHD_add_response_header(response, "ETag", etag);
+    }
+
+    if (mtime > 0) {
+        http_date(buf, sizeof(buf), mtime);
+        MHD_add_response_header(response, "Last-Modified", buf);
+    }
+
+    if (max_age >= 0) {
+        snprintf(buf, sizeof(buf), "max-age=%d", max_age);
+        MHD_add_response_header(response, "Cache-Control", buf);
+    }
+}
+
+/*
+ * parse a "bytes=" Range header against a file size.
+ * returns the number of satisfiable ranges, 0 when none is satisfiable
+ * and -1 when the header is to be ignored.
+ */
+int
+http_range_parse(const char *header, uint64_t size,
+                 http_range_t *ranges, int max)
+{
+    const char *p = header;
+    char *end;
+    unsigned long long first, last;
+    int count = 0;
+
+    if (strncasecmp(p, "bytes=", 6) != 0) {
+        return -1;
+    }
+    p += 6;
+
+    if (size == 0) {
+        return 0;
+    }
+
+    while (*p) {
+        while (*p == ' ' || *p == '\t' || *p == ',') {
+            p++;
+        }
+        if (!*p) {
+            break;
+        }
+
+        if (*p == '-') {
+            /* suffix: last n bytes */
+            last = strtoull(p + 1, &end, 10);
+            if (end == p + 1) {
+                return -1;
+            }
+            if (last == 0) {
+                p = end;
+                continue;
+            }
+            if (last > size) {
+                last = size;
+            }
+            first = size - last;
+            last = size - 1;
+        } else {
+            first = strtoull(p, &end, 10);
+            if (end == p || *end != '-') {
+                return -1;
+            }
+            p = end + 1;
+            if (*p >= '0' && *p <= '9') {
+                last = strtoull(p, &end, 10);
+                if (last < first) {
+                    return -1;
+                }
+            } else {
+                last = size - 1;
+                end = (char *)p;
+            }
+            if (last >= size) {
+                last = size - 1;
+            }
+        }
+        p = end;
+        while (*p == ' ' || *p == '\t') {
+            p++;
+        }
+        if (*p && *p != ',') {
+            return -1;
+        }
+
+        if (first >= size) {
+            continue;
+        }
+        if (count == max) {
+            /* too many ranges, send the whole file */
+            return -1;
+        }
+        ranges[count].start = first;
+        ranges[count].length = last - first + 1;
+        count++;
+    }
+
+    return count;
+}
+
+/* whether a Range is to be honoured given If-Range */
+int
+http_if_range(struct MHD_Connection *connection,
+              const char *etag, time_t mtime)
+{
+    const char *value;
+
+    value = MHD_lookup_connection_value(connection, MHD_HEADER_KIND,
+                                        "If-Range");
+    if (!value) {
+        return 1;
+    }
+
+    if (*value == '"') {
+        /* strong comparison */
+        return etag && strcmp(value, etag) == 0;
+    }
+    if (strncmp(value, "W/", 2) == 0) {
+        return 0;
+    }
+
+    return http_date_parse(value) == mtime;
+}
+
+int
+http_queue_not_modified(struct MHD_Connection *connection,
+                        const char *etag, time_t mtime, int max_age)
+{
+    struct MHD_Response *response;
+    int ret;
+
+    response = MHD_create_response_from_buffer(0, NULL,
+                                               MHD_RESPMEM_PERSISTENT);
+    if (response == NULL) {
+        return MHD_NO;
+    }
+
+    http_validators(response, etag, mtime, max_age);
+
+    ret = MHD_queue_response(connection, MHD_HTTP_NOT_MODIFIED, response);
+    MHD_destroy_response(response);
+
+    return ret;
+}
+
+int
+http_queue_range_not_satisfiable(struct MHD_Connection *connection,
+                                 uint64_t size)
+{
+    struct MHD_Response *response;
+    char buf[64];
+    int ret;
+
+    response = MHD_create_response_from_buffer(0, NULL,
+                                               MHD_RESPMEM_PERSISTENT);
+    if (response == NULL) {
+        return MHD_NO;
+    }
+
+    snprintf(buf, sizeof(buf), "bytes */%llu", (unsigned long long)size);
+    MHD_add_response_header(response, "Content-Range", buf);
+    MHD_add_response_header(response, "Accept-Ranges", "bytes");
+
+    ret = MHD_queue_response(connection, MHD_HTTP_RANGE_NOT_SATISFIABLE,
+                             response);
+    MHD_destroy_response(response);
+
+    return ret;
+}
@@ -0,0 +1,45 @@
+#ifndef __MMHD_HTTP_H__
+#define __MMHD_HTTP_H__
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <microhttpd.h>
+
+/* renamed in libmicrohttpd 0.9.62 */
+#ifndef MHD_HTTP_RANGE_NOT_SATISFIABLE
+#define MHD_HTTP_RANGE_NOT_SATISFIABLE MHD_HTTP_REQUESTED_RANGE_NOT_SATISFIABLE
+#endif
+
+#define HTTP_DATE_SIZE 32
+#define HTTP_ETAG_SIZE 64
+#define HTTP_RANGE_MAX 16
+
+typedef struct http_range {
+    uint64_t start;
+    uint64_t length;
+} http_range_t;
+
+void http_date(char *buf, size_t size, time_t t);
+time_t http_date_parse(const char *str);
+
+int http_etag_match(const char *header, const char *etag);
+int http_not_modified(struct MHD_Connection *connection,
+                      const char *etag, time_t mtime);
+void http_validators(struct MHD_Response *response,
+                     const char *etag, time_t mtime, int max_age);
+int http_range_parse(const char *header, uint64_t size,
+                     http_range_t *ranges, int max);
+int http_if_range(struct MHD_Connection *connection,
+                  const char *etag, time_t mtime);
+
+int http_queue_not_modified(struct MHD_Connection *connection,
+                            const char *etag, time_t mtime, int max_age);
+int http_queue_range_not_satisfiable(struct MHD_Connection *connection,
+                                     uint64_t size);
+
+#endif
@@ -0,0 +1,264 @@
+#include "inline.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define INLINE_X86 1
+#include <immintrin.h>
+#endif
+
+/* bytes checked one at a time before the vector tables are looked up */
+#define INLINE_SCALAR_PREFIX 16
+
+typedef size_t (*inline_scan_t)(const uint8_t *active_char,
+                                const uint8_t *data, size_t i, size_t size);
+
+static inline_kernel_t inline_best = INLINE_SCALAR;
+
+/* bumped by each new parser, a table at a reused address is rebuilt */
+static volatile unsigned long inline_generation = 1;
+
+/* the loop of hoedown */
+static size_t
+inline_scan_scalar(const uint8_t *active_char, const uint8_t *data,
+                   size_t i, size_t size)
+{
+    while (i < size && active_char[data[i]] == 0) {
+        i++;
+    }
+
+    return i;
+}
+
+static inline_scan_t inline_scan = inline_scan_scalar;
+
+#ifdef INLINE_X86
+/*
+ * a byte is active when the lookups of its low and high nibble share a
+ * bit: lo[n] has bit h set when the byte h << 4 | n is active, hi[h] is
+ * 1 << h. eight bits cover ascii, a table with an active byte above
+ * 0x7f is scanned by the byte loop.
+ */
+typedef struct inline_tables {
+    const uint8_t *active_char;
+    unsigned long generation;
+    int ascii;
+    __m128i lo;
+} inline_tables_t;
+
+/* the table of the parser of this thread seen last */
+static __thread inline_tables_t inline_cache;
+
+__attribute__((target("ssse3")))
+static const inline_tables_t *
+inline_tables(const uint8_t *active_char)
+{
+    inline_tables_t *tables = &inline_cache;
+    const __m128i zero = _mm_setzero_si128();
+    __m128i row, lo = zero, high = zero;
+    unsigned long generation = inline_generation;
+    int h;
+
+    if (tables->active_char == active_char
+        && tables->generation == generation) {
+        return tables->ascii ? tables : NULL;
+    }
+
+    for (h = 0; h < 8; h++) {
+        row = _mm_loadu_si128((const __m128i *)(active_char + h * 16));
+        lo = _mm_or_si128(lo,
+                          _mm_andnot_si128(_mm_cmpeq_epi8(row, zero),
+                                           _mm_set1_epi8((char)(1 << h))));
+    }
+    for (; h < 16; h++) {
+        row = _mm_loadu_si128((const __m128i *)(active_char + h * 16));
+        high = _mm_or_si128(high, row);
+    }
+
+    tables->active_char = active_char;
+    tables->generation = generation;
+    tables->ascii = _mm_movemask_epi8(_mm_cmpeq_epi8(high, zero)) == 0xffff;
+    tables->lo = lo;
+
+    return tables->ascii ? tables : NULL;
+}
+
+/* the active bytes are often close together, text runs are long */
+static int
+inline_scan_prefix(const uint8_t *active_char, const uint8_t *data,
+                   size_t *i, size_t size)
+{
+    size_t end = *i + INLINE_SCALAR_PREFIX;
+
+    for (; *i < size && *i < end; (*i)++) {
+        if (active_char[data[*i]]) {
+            return 1;
+        }
+    }
+
+    return *i == size;
+}
+
+__attribute__((target("ssse3")))
+static size_t
+inline_scan_tables(__m128i lo, const uint8_t *data, size_t i, size_t size)
+{
+    const __m128i hi = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, (char)128,
+                                     0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i v, m;
+    int mask;
+
+    for (; i + 16 <= size; i += 16) {
+        v = _mm_loadu_si128((const __m128i *)(data + i));
+        m = _mm_and_si128(
+            _mm_shuffle_epi8(lo, _mm_and_si128(v, nibble)),
+            _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi16(v, 4),
+                                               nibble)));
+        mask = _mm_movemask_epi8(_mm_cmpeq_epi8(m, zero)) ^ 0xffff;
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+
+    return i;
+}
+
+__attribute__((target("ssse3")))
+static size_t
+inline_scan_ssse3(const uint8_t *active_char, const uint8_t *data,
+                  size_t i, size_t size)
+{
+    const inline_tables_t *tables;
+
+    if (inline_scan_prefix(active_char, data, &i, size)) {
+        return i;
+    }
+    if (size - i < 16 || (tables = inline_tables(active_char)) == NULL) {
+        return inline_scan_scalar(active_char, data, i, size);
+    }
+
+    i = inline_scan_tables(tables->lo, data, i, size);
+
+    return inline_scan_scalar(active_char, data, i, size);
+}
+
+__attribute__((target("avx2")))
+static size_t
+inline_scan_avx2(const uint8_t *active_char, const uint8_t *data,
+                 size_t i, size_t size)
+{
+    const __m256i hi = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, (char)128,
+                                        0, 0, 0, 0, 0, 0, 0, 0,
+                                        1, 2, 4, 8, 16, 32, 64, (char)128,
+                                        0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    const __m256i zero = _mm256_setzero_si256();
+    const inline_tables_t *tables;
+    __m256i lo, v, m;
+    unsigned int mask;
+
+    if (inline_scan_prefix(active_char, data, &i, size)) {
+        return i;
+    }
+    if (size - i < 16 || (tables = inline_tables(active_char)) == NULL) {
+        return inline_scan_scalar(active_char, data, i, size);
+    }
+
+    /* vpshufb looks up each 128 bit lane in its own half */
+    lo = _mm256_broadcastsi128_si256(tables->lo);
+
+    for (; i + 32 <= size; i += 32) {
+        v = _mm256_loadu_si256((const __m256i *)(data + i));
+        m = _mm256_and_si256(
+            _mm256_shuffle_epi8(lo, _mm256_and_si256(v, nibble)),
+            _mm256_shuffle_epi8(hi,
+                                _mm256_and_si256(_mm256_srli_epi16(v, 4),
+                                                 nibble)));
+        mask = ~(unsigned int)_mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(m, zero));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+
+    i = inline_scan_tables(tables->lo, data, i, size);
+
+    return inline_scan_scalar(active_char, data, i, size);
+}
+#endif
+
+static const inline_scan_t inline_scans[INLINE_KERNEL_MAX] = {
+    inline_scan_scalar,
+#ifdef INLINE_X86
+    inline_scan_ssse3,
+    inline_scan_avx2,
+#endif
+};
+
+static const char *inline_names[INLINE_KERNEL_MAX] = {
+    "scalar", "ssse3", "avx2"
+};
+
+/* before main(), the scan of each run is a call through inline_scan */
+__attribute__((constructor))
+static void
+inline_detect(void)
+{
+#ifdef INLINE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        inline_best = INLINE_AVX2;
+    } else if (__builtin_cpu_supports("ssse3")) {
+        inline_best = INLINE_SSSE3;
+    }
+#endif
+    inline_scan = inline_scans[inline_best];
+}
+
+inline_kernel_t
+inline_kernel(void)
+{
+    return inline_best;
+}
+
+const char *
+inline_kernel_name(inline_kernel_t kernel)
+{
+    if (kernel >= INLINE_KERNEL_MAX) {
+        return NULL;
+    }
+
+    return inline_names[kernel];
+}
+
+int
+inline_kernel_set(inline_kernel_t kernel)
+{
+    /* avx2 implies ssse3 */
+    if (kernel > inline_best) {
+        return -1;
+    }
+
+    inline_scan = inline_scans[kernel];
+
+    return 0;
+}
+
+/* hoedown_markdown_new() of markdown.c is renamed by the build */
+struct hoedown_markdown *
+hoedown_markdown_new(unsigned int extensions, size_t max_nesting,
+                     const hoedown_callbacks *callbacks, void *opaque)
+{
+    __sync_add_and_fetch(&inline_generation, 1);
+
+    return hoedown_markdown_new_parser(extensions, max_nesting,
+                                       callbacks, opaque);
+}
+
+/* called by parse_inline() of hoedown for each run of text */
+size_t
+hoedown_inline_scan(const uint8_t *active_char, const uint8_t *data,
+                    size_t i, size_t size)
+{
+    return inline_scan(active_char, data, i, size);
+}
@@ -0,0 +1,43 @@
+#ifndef __MMHD_INLINE_H__
+#define __MMHD_INLINE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hoedown/src/markdown.h"
+
+typedef enum {
+    INLINE_SCALAR = 0,
+    INLINE_SSSE3,
+    INLINE_AVX2,
+    INLINE_KERNEL_MAX
+} inline_kernel_t;
+
+/*
+ * offset of the first byte from i that is set in the active_char table
+ * of the hoedown parser, or size. the build patches parse_inline() of
+ * markdown.c to call it instead of its byte loop.
+ */
+size_t hoedown_inline_scan(const uint8_t *active_char, const uint8_t *data,
+                           size_t i, size_t size);
+
+/*
+ * the parser constructor of hoedown, renamed at build time so that
+ * hoedown_markdown_new() of inline.c tells the table cache of each
+ * thread that a parser may reuse the address of a freed one
+ */
+struct hoedown_markdown *hoedown_markdown_new_parser(
+    unsigned int extensions, size_t max_nesting,
+    const hoedown_callbacks *callbacks, void *opaque);
+
+/* best kernel the cpu supports, detected before main() */
+inline_kernel_t inline_kernel(void);
+const char *inline_kernel_name(inline_kernel_t kernel);
+
+/*
+ * kernel of hoedown_inline_scan() from now on, -1 when the cpu lacks it.
+ * for the benchmark: not safe while other threads render.
+ */
+int inline_kernel_set(inline_kernel_t kernel);
+
+#endif
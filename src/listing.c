@@ -0,0 +1,280 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#include "listing.h"
+#include "hoedown/src/buffer.h"
+#include "hoedown/src/escape.h"
+
+#define LISTING_OUTPUT_UNIT 4096
+#define LISTING_ENTRIES_MIN 64
+
+cache_t *
+listing_cache_new(size_t max_count)
+{
+    return cache_new(0, max_count, NULL);
+}
+
+static int
+listing_compare(const void *a, const void *b)
+{
+    const listing_entry_t *x = a, *y = b;
+
+    if (x->directory != y->directory) {
+        return y->directory - x->directory;
+    }
+
+    return strcmp(x->name, y->name);
+}
+
+/*
+ * one readdir() and one stat() per entry, only when the directory mtime
+ * changed. names point into the names area of the same allocation.
+ */
+static listing_t *
+listing_read(const char *dirpath, size_t *size)
+{
+    listing_entry_t *entries = NULL, *tmp;
+    size_t count = 0, alloc = 0, names = 0, i;
+    listing_t *listing = NULL;
+    struct dirent *dp;
+    struct stat st;
+    char *name;
+    DIR *dir;
+    int fd;
+
+    dir = opendir(dirpath);
+    if (!dir) {
+        return NULL;
+    }
+    fd = dirfd(dir);
+
+    while ((dp = readdir(dir)) != NULL) {
+        /* hidden files are not listed */
+        if (dp->d_name[0] == '.') {
+            continue;
+        }
+#ifdef _DIRENT_HAVE_D_TYPE
+        if (dp->d_type != DT_UNKNOWN && dp->d_type != DT_REG
+            && dp->d_type != DT_DIR && dp->d_type != DT_LNK) {
+            continue;
+        }
+#endif
+        if (fstatat(fd, dp->d_name, &st, 0) != 0
+            || !(S_ISREG(st.st_mode) || S_ISDIR(st.st_mode))) {
+            continue;
+        }
+
+        if (count == alloc) {
+            alloc = alloc ? alloc * 2 : LISTING_ENTRIES_MIN;
+            tmp = (listing_entry_t *)realloc(entries,
+                                             alloc * sizeof(*entries));
+            if (!tmp) {
+                goto out;
+            }
+            entries = tmp;
+        }
+
+        name = strdup(dp->d_name);
+        if (!name) {
+            goto out;
+        }
+        entries[count].name = name;
+        entries[count].directory = S_ISDIR(st.st_mode);
+        entries[count].size = st.st_size;
+        entries[count].mtime = st.st_mtime;
+        names += strlen(name) + 1;
+        count++;
+    }
+
+    qsort(entries, count, sizeof(*entries), listing_compare);
+
+    *size = sizeof(listing_t) + count * sizeof(*entries) + names;
+    listing = (listing_t *)malloc(*size);
+    if (!listing) {
+        goto out;
+    }
+    listing->count = count;
+
+    name = (char *)&listing->entries[count];
+    for (i = 0; i < count; i++) {
+        size_t len = strlen(entries[i].name) + 1;
+
+        listing->entries[i] = entries[i];
+        listing->entries[i].name = memcpy(name, entries[i].name, len);
+        name += len;
+    }
+
+out:
+    for (i = 0; i < count; i++) {
+        free((char *)entries[i].name);
+    }
+    free(entries);
+    closedir(dir);
+
+    return listing;
+}
+
+cache_entry_t *
+listing_get(cache_t *cache, const char *dirpath, const struct stat *st)
+{
+    char key[PATH_MAX+64];
+    cache_entry_t *entry;
+    listing_t *listing;
+    size_t size;
+
+    snprintf(key, sizeof(key), "%s|%ld.%09ld|%lu", dirpath,
+             (long)st->st_mtim.tv_sec, (long)st->st_mtim.tv_nsec,
+             (unsigned long)st->st_ino);
+
+    if (cache) {
+        entry = cache_get(cache, key);
+        if (entry) {
+            return entry;
+        }
+    }
+
+    listing = listing_read(dirpath, &size);
+    if (!listing) {
+        return NULL;
+    }
+
+    if (cache) {
+        return cache_set(cache, key, listing, size);
+    }
+
+    return cache_entry_new(key, listing, size);
+}
+
+static void
+listing_escape_html(hoedown_buffer *ob, const char *str)
+{
+    hoedown_escape_html(ob, (const uint8_t *)str, strlen(str), 0);
+}
+
+/* percent encoded, slashes kept */
+static void
+listing_escape_href(hoedown_buffer *ob, const char *str)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    unsigned char c;
+
+    for (; *str; str++) {
+        c = (unsigned char)*str;
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+            || (c >= '0' && c <= '9') || strchr("-._~/", c)) {
+            hoedown_buffer_putc(ob, c);
+        } else {
+            hoedown_buffer_putc(ob, '%');
+            hoedown_buffer_putc(ob, hex[c >> 4]);
+            hoedown_buffer_putc(ob, hex[c & 0xf]);
+        }
+    }
+}
+
+/* links are absolute, the url may lack its trailing slash */
+static void
+listing_href(hoedown_buffer *ob, const char *url, const char *name,
+             int directory)
+{
+    size_t len = strlen(url);
+
+    hoedown_buffer_puts(ob, "<a href=\"");
+    listing_escape_href(ob, url);
+    if (len == 0 || url[len-1] != '/') {
+        hoedown_buffer_putc(ob, '/');
+    }
+    listing_escape_href(ob, name);
+    if (directory) {
+        hoedown_buffer_putc(ob, '/');
+    }
+    hoedown_buffer_puts(ob, "\">");
+    listing_escape_html(ob, name);
+    if (directory) {
+        hoedown_buffer_putc(ob, '/');
+    }
+    hoedown_buffer_puts(ob, "</a>");
+}
+
+fragment_t *
+listing_page(const listing_t *listing, const char *url,
+             size_t page, size_t page_size)
+{
+    size_t pages, i, last;
+    const listing_entry_t *entry;
+    fragment_t *fragment;
+    hoedown_buffer *ob;
+    char date[32];
+    struct tm tm;
+
+    pages = (listing->count + page_size - 1) / page_size;
+    if (pages == 0) {
+        pages = 1;
+    }
+    if (page == 0 || page > pages) {
+        return NULL;
+    }
+
+    ob = hoedown_buffer_new(LISTING_OUTPUT_UNIT);
+    if (!ob) {
+        return NULL;
+    }
+
+    hoedown_buffer_puts(ob, "<h1>Index of ");
+    listing_escape_html(ob, url);
+    hoedown_buffer_puts(ob, "</h1>\n<table class=\"listing\">\n"
+                        "<thead><tr><th>Name</th><th>Size</th>"
+                        "<th>Last modified</th></tr></thead>\n<tbody>\n");
+
+    if (strcmp(url, "/") != 0) {
+        hoedown_buffer_puts(ob, "<tr><td>");
+        listing_href(ob, url, "..", 1);
+        hoedown_buffer_puts(ob, "</td><td></td><td></td></tr>\n");
+    }
+
+    last = page * page_size;
+    if (last > listing->count) {
+        last = listing->count;
+    }
+    for (i = (page - 1) * page_size; i < last; i++) {
+        entry = &listing->entries[i];
+
+        hoedown_buffer_puts(ob, "<tr><td>");
+        listing_href(ob, url, entry->name, entry->directory);
+        if (entry->directory) {
+            hoedown_buffer_puts(ob, "</td><td>-");
+        } else {
+            hoedown_buffer_printf(ob, "</td><td>%lld",
+                                  (long long)entry->size);
+        }
+        gmtime_r(&entry->mtime, &tm);
+        strftime(date, sizeof(date), "%Y-%m-%d %H:%M", &tm);
+        hoedown_buffer_printf(ob, "</td><td>%s</td></tr>\n", date);
+    }
+
+    hoedown_buffer_puts(ob, "</tbody>\n</table>\n");
+
+    if (pages > 1) {
+        hoedown_buffer_puts(ob, "<p class=\"pages\">");
+        if (page > 1) {
+            hoedown_buffer_printf(ob, "<a href=\"?page=%zu\">&laquo;</a> ",
+                                  page - 1);
+        }
+        hoedown_buffer_printf(ob, "%zu / %zu", page, pages);
+        if (page < pages) {
+            hoedown_buffer_printf(ob, " <a href=\"?page=%zu\">&raquo;</a>",
+                                  page + 1);
+        }
+        hoedown_buffer_puts(ob, "</p>\n");
+    }
+
+    fragment = fragment_new(NULL, 0, (const char *)ob->data, ob->size);
+    hoedown_buffer_free(ob);
+
+    return fragment;
+}
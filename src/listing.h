@@ -0,0 +1,35 @@
+#ifndef __MMHD_LISTING_H__
+#define __MMHD_LISTING_H__
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+#include "contents.h"
+
+#define LISTING_PAGE_SIZE 500
+
+typedef struct listing_entry {
+    const char *name;
+    int directory;
+    off_t size;
+    time_t mtime;
+} listing_entry_t;
+
+/* single allocation: sorted entries followed by their names */
+typedef struct listing {
+    size_t count;
+    listing_entry_t entries[];
+} listing_t;
+
+cache_t *listing_cache_new(size_t max_count);
+
+/* directory read once per mtime, as a referenced entry */
+cache_entry_t *listing_get(cache_t *cache, const char *dirpath,
+                           const struct stat *st);
+
+/* page (from 1) of a listing below url, NULL past the last page */
+fragment_t *listing_page(const listing_t *listing, const char *url,
+                         size_t page, size_t page_size);
+
+#endif
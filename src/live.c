@@ -0,0 +1,671 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "live.h"
+#include "render.h"
+
+#define BLOCK_SIZE 4096
+
+/* a client this far behind is told to reload the page instead */
+#define LIVE_PENDING_MAX (1024 * 1024)
+
+#define LIVE_EVENT_RELOAD "event: reload\ndata: 1\n\n"
+
+/*
+ * the blocks of the page are the nodes from one mark comment to the next
+ * or to the script itself. a patch replaces the changed run of blocks,
+ * a page that does not match the count of the server reloads once.
+ */
+static const char live_script_html[] =
+    "<script>\n"
+    "(function () {\n"
+    "  var end = document.currentScript, key = 'mmhd:' + location.pathname,\n"
+    "      source = new EventSource(location.pathname + '?"
+    LIVE_ARGUMENT "=1');\n"
+    "  function marks() {\n"
+    "    var list = [], node = end.parentNode.firstChild;\n"
+    "    for (; node && node !== end; node = node.nextSibling) {\n"
+    "      if (node.nodeType === 8 && node.nodeValue === 'mmhd') {\n"
+    "        list.push(node);\n"
+    "      }\n"
+    "    }\n"
+    "    return list;\n"
+    "  }\n"
+    "  source.addEventListener('hello', function (event) {\n"
+    "    if (+event.data === marks().length) {\n"
+    "      sessionStorage.removeItem(key);\n"
+    "    } else if (sessionStorage.getItem(key)) {\n"
+    "      source.close();\n"
+    "    } else {\n"
+    "      sessionStorage.setItem(key, '1');\n"
+    "      location.reload();\n"
+    "    }\n"
+    "  });\n"
+    "  source.addEventListener('reload', function () {\n"
+    "    location.reload();\n"
+    "  });\n"
+    "  source.addEventListener('patch', function (event) {\n"
+    "    var data = event.data, i = data.indexOf('\\n'),\n"
+    "        head = (i < 0 ? data : data.slice(0, i)).split(' '),\n"
+    "        start = +head[0], remove = +head[1], list = marks(),\n"
+    "        stop, node, next, range;\n"
+    "    if (start + remove > list.length) {\n"
+    "      location.reload();\n"
+    "      return;\n"
+    "    }\n"
+    "    stop = start + remove < list.length ? list[start + remove] : end;\n"
+    "    for (node = start < list.length ? list[start] : stop;\n"
+    "         node !== stop; node = next) {\n"
+    "      next = node.nextSibling;\n"
+    "      node.parentNode.removeChild(node);\n"
+    "    }\n"
+    "    if (i >= 0) {\n"
+    "      range = document.createRange();\n"
+    "      range.selectNode(stop);\n"
+    "      stop.parentNode.insertBefore(\n"
+    "        range.createContextualFragment(data.slice(i + 1)), stop);\n"
+    "    }\n"
+    "  });\n"
+    "})();\n"
+    "</script>\n";
+
+/* rendered page split on the block marks, a single allocation */
+typedef struct live_page {
+    unsigned int toc; /* hash, a changed toc reloads the page */
+    size_t size;
+    size_t count;
+    size_t *offsets; /* count + 1 */
+    unsigned int *hashes;
+    char *html;
+} live_page_t;
+
+typedef struct live_client live_client_t;
+
+typedef struct live_doc {
+    char *filepath;
+    live_page_t *page;
+    int changed;
+    live_client_t *clients;
+    struct live_doc *next;
+} live_doc_t;
+
+struct live_client {
+    struct live *live;
+    live_doc_t *doc;
+    struct MHD_Connection *connection;
+    /* events not sent yet */
+    char *data;
+    size_t size;
+    size_t alloc;
+    size_t offset;
+    int suspended;
+    int closed;
+    int lost;
+    live_client_t *prev;
+    live_client_t *next;
+};
+
+struct live {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    live_doc_t *docs;
+    unsigned int extensions;
+    unsigned int html;
+    int stop;
+    int joined;
+    pthread_t thread;
+};
+
+static unsigned int
+live_hash(const char *data, size_t size)
+{
+    unsigned int hash = 2166136261U;
+    size_t i;
+
+    for (i = 0; i < size; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 16777619U;
+    }
+
+    return hash;
+}
+
+static live_page_t *
+live_page_new(const char *body, size_t body_size,
+              const char *toc, size_t toc_size)
+{
+    size_t len = sizeof(RENDER_BLOCK_MARK) - 1, count = 0, i = 0;
+    const char *p = body, *end = body + body_size, *mark;
+    live_page_t *page;
+    int leading;
+
+    /* a block starts at each mark */
+    while ((mark = memmem(p, end - p, RENDER_BLOCK_MARK, len)) != NULL) {
+        count++;
+        p = mark + len;
+    }
+    leading = body_size > 0
+        && (body_size < len || memcmp(body, RENDER_BLOCK_MARK, len) != 0);
+    count += leading;
+
+    page = (live_page_t *)malloc(sizeof(live_page_t)
+                                 + (count + 1) * sizeof(size_t)
+                                 + count * sizeof(unsigned int) + body_size);
+    if (!page) {
+        return NULL;
+    }
+
+    page->toc = live_hash(toc, toc_size);
+    page->size = body_size;
+    page->count = count;
+    page->offsets = (size_t *)(page + 1);
+    page->hashes = (unsigned int *)(page->offsets + count + 1);
+    page->html = (char *)(page->hashes + count);
+    if (body_size) {
+        memcpy(page->html, body, body_size);
+    }
+
+    if (leading) {
+        page->offsets[i++] = 0;
+    }
+    p = body;
+    while ((mark = memmem(p, end - p, RENDER_BLOCK_MARK, len)) != NULL) {
+        page->offsets[i++] = mark - body;
+        p = mark + len;
+    }
+    page->offsets[count] = body_size;
+
+    for (i = 0; i < count; i++) {
+        page->hashes[i] = live_hash(page->html + page->offsets[i],
+                                    page->offsets[i+1] - page->offsets[i]);
+    }
+
+    return page;
+}
+
+static int
+live_block_equal(const live_page_t *a, size_t i,
+                 const live_page_t *b, size_t j)
+{
+    size_t size = a->offsets[i+1] - a->offsets[i];
+
+    return a->hashes[i] == b->hashes[j]
+        && size == b->offsets[j+1] - b->offsets[j]
+        && memcmp(a->html + a->offsets[i], b->html + b->offsets[j],
+                  size) == 0;
+}
+
+/*
+ * length of the line up to the first '\n' or '\r'. hoedown writes '\n',
+ * memchr() finds it unless a raw block kept some '\r'.
+ */
+static size_t
+live_line(const char *html, size_t size, int cr)
+{
+    const char *lf;
+    size_t i;
+
+    if (!cr) {
+        lf = memchr(html, '\n', size);
+        return lf ? (size_t)(lf - html) : size;
+    }
+
+    for (i = 0; i < size && html[i] != '\n' && html[i] != '\r'; i++);
+
+    return i;
+}
+
+/* html sent as one data line per line, the client joins them again */
+static char *
+live_event_patch(size_t start, size_t remove,
+                 const char *html, size_t size, size_t *length)
+{
+    size_t i, n, lines = 1;
+    char *event, *p;
+    int cr;
+
+    cr = memchr(html, '\r', size) != NULL;
+    for (i = 0; i < size; i += n + 1) {
+        n = live_line(html + i, size - i, cr);
+        lines++;
+    }
+
+    event = (char *)malloc(64 + size + lines * 7);
+    if (!event) {
+        return NULL;
+    }
+
+    p = event + sprintf(event, "event: patch\ndata: %zu %zu\n",
+                        start, remove);
+    for (i = 0; i < size; i++) {
+        n = live_line(html + i, size - i, cr);
+        memcpy(p, "data: ", 6);
+        memcpy(p + 6, html + i, n);
+        p += 6 + n;
+        *p++ = '\n';
+        i += n;
+        if (i + 1 < size && html[i] == '\r' && html[i+1] == '\n') {
+            i++;
+        }
+    }
+    *p++ = '\n';
+
+    *length = p - event;
+
+    return event;
+}
+
+/* queued for the connection, which is resumed when it waits */
+static void
+live_client_push(live_client_t *client, const char *data, size_t size)
+{
+    size_t pending = client->size - client->offset, alloc;
+    char *buf;
+
+    if (client->closed || client->lost) {
+        return;
+    }
+
+    if (pending + size > LIVE_PENDING_MAX) {
+        client->lost = 1;
+        data = LIVE_EVENT_RELOAD;
+        size = sizeof(LIVE_EVENT_RELOAD) - 1;
+    }
+
+    if (client->offset) {
+        memmove(client->data, client->data + client->offset, pending);
+        client->size = pending;
+        client->offset = 0;
+    }
+
+    if (client->size + size > client->alloc) {
+        alloc = client->alloc ? client->alloc : BLOCK_SIZE;
+        while (alloc < client->size + size) {
+            alloc *= 2;
+        }
+        buf = (char *)realloc(client->data, alloc);
+        if (!buf) {
+            client->closed = 1;
+            return;
+        }
+        client->data = buf;
+        client->alloc = alloc;
+    }
+
+    memcpy(client->data + client->size, data, size);
+    client->size += size;
+
+    if (client->suspended) {
+        client->suspended = 0;
+        MHD_resume_connection(client->connection);
+    }
+}
+
+static live_doc_t *
+live_find(live_t *live, const char *filepath)
+{
+    live_doc_t *doc;
+
+    for (doc = live->docs; doc; doc = doc->next) {
+        if (strcmp(doc->filepath, filepath) == 0) {
+            return doc;
+        }
+    }
+
+    return NULL;
+}
+
+/* the changed run of blocks, or a reload when the toc changed */
+static void
+live_update(live_doc_t *doc, live_page_t *page)
+{
+    live_page_t *prev = doc->page;
+    size_t start = 0, end = 0, max, length;
+    live_client_t *client;
+    char *event = NULL;
+
+    max = prev->count < page->count ? prev->count : page->count;
+    while (start < max && live_block_equal(prev, start, page, start)) {
+        start++;
+    }
+    while (end < max - start
+           && live_block_equal(prev, prev->count - 1 - end,
+                               page, page->count - 1 - end)) {
+        end++;
+    }
+
+    doc->page = page;
+
+    if (prev->toc != page->toc) {
+        for (client = doc->clients; client; client = client->next) {
+            live_client_push(client, LIVE_EVENT_RELOAD,
+                             sizeof(LIVE_EVENT_RELOAD) - 1);
+        }
+    } else if (start < prev->count || start < page->count) {
+        event = live_event_patch(start, prev->count - start - end,
+                                 page->html + page->offsets[start],
+                                 page->offsets[page->count - end]
+                                 - page->offsets[start], &length);
+        for (client = doc->clients; client; client = client->next) {
+            if (event) {
+                live_client_push(client, event, length);
+            } else {
+                live_client_push(client, LIVE_EVENT_RELOAD,
+                                 sizeof(LIVE_EVENT_RELOAD) - 1);
+            }
+        }
+    }
+
+    free(event);
+    free(prev);
+}
+
+static void *
+live_run(void *arg)
+{
+    live_t *live = (live_t *)arg;
+    live_page_t *page;
+    render_t *render;
+    live_doc_t *doc;
+    char *filepath;
+
+    pthread_mutex_lock(&live->lock);
+
+    while (!live->stop) {
+        for (doc = live->docs; doc && !doc->changed; doc = doc->next);
+        if (!doc) {
+            pthread_cond_wait(&live->cond, &live->lock);
+            continue;
+        }
+        doc->changed = 0;
+        filepath = strdup(doc->filepath);
+        pthread_mutex_unlock(&live->lock);
+
+        /* one render for all the clients of the document */
+        page = NULL;
+        render = filepath ? render_get(live->extensions) : NULL;
+        if (render
+            && render_file(render, filepath, live->html,
+                           HOWDOWN_TOC_STARING, HOWDOWN_TOC_NESTING) == 0) {
+            page = live_page_new((const char *)render->ob->data,
+                                 render->ob->size,
+                                 (const char *)render->toc->data,
+                                 render->toc->size);
+        }
+
+        pthread_mutex_lock(&live->lock);
+
+        /* the last client may have left meanwhile */
+        doc = filepath ? live_find(live, filepath) : NULL;
+        if (doc && page) {
+            live_update(doc, page);
+            page = NULL;
+        }
+        free(page);
+        free(filepath);
+    }
+
+    pthread_mutex_unlock(&live->lock);
+
+    return NULL;
+}
+
+static ssize_t
+live_output_cb(void *cls, uint64_t pos, char *buf, size_t max)
+{
+    live_client_t *client = cls;
+    live_t *live = client->live;
+    size_t len;
+
+    pthread_mutex_lock(&live->lock);
+
+    if (client->offset < client->size) {
+        len = client->size - client->offset;
+        if (len > max) {
+            len = max;
+        }
+        memcpy(buf, client->data + client->offset, len);
+        client->offset += len;
+        if (client->offset == client->size) {
+            client->offset = 0;
+            client->size = 0;
+        }
+        pthread_mutex_unlock(&live->lock);
+        return len;
+    }
+
+    if (client->closed || client->lost) {
+        pthread_mutex_unlock(&live->lock);
+        return MHD_CONTENT_READER_END_OF_STREAM;
+    }
+
+    /* idle: off the event loop until the next change */
+    client->suspended = 1;
+    MHD_suspend_connection(client->connection);
+
+    pthread_mutex_unlock(&live->lock);
+
+    return 0;
+}
+
+static void
+live_free_cb(void *cls)
+{
+    live_client_t *client = cls;
+    live_t *live = client->live;
+    live_doc_t *doc = client->doc, **p;
+
+    pthread_mutex_lock(&live->lock);
+
+    if (doc) {
+        if (client->prev) {
+            client->prev->next = client->next;
+        } else {
+            doc->clients = client->next;
+        }
+        if (client->next) {
+            client->next->prev = client->prev;
+        }
+
+        /* nobody follows the document anymore */
+        if (!doc->clients) {
+            for (p = &live->docs; *p; p = &(*p)->next) {
+                if (*p == doc) {
+                    *p = doc->next;
+                    break;
+                }
+            }
+            free(doc->page);
+            free(doc->filepath);
+            free(doc);
+        }
+    }
+
+    pthread_mutex_unlock(&live->lock);
+
+    free(client->data);
+    free(client);
+}
+
+/*
+ * the render thread sleeps until a followed document is written, files
+ * nobody previews cost a lookup in the short list of documents.
+ */
+live_t *
+live_new(unsigned int extensions, unsigned int html)
+{
+    live_t *live = (live_t *)calloc(1, sizeof(live_t));
+    if (!live) {
+        return NULL;
+    }
+
+    pthread_mutex_init(&live->lock, NULL);
+    pthread_cond_init(&live->cond, NULL);
+    live->extensions = extensions;
+    live->html = html;
+
+    if (pthread_create(&live->thread, NULL, &live_run, live) != 0) {
+        pthread_mutex_destroy(&live->lock);
+        pthread_cond_destroy(&live->cond);
+        free(live);
+        return NULL;
+    }
+
+    return live;
+}
+
+void
+live_stop(live_t *live)
+{
+    live_doc_t *doc;
+    live_client_t *client;
+
+    if (!live || live->joined) {
+        return;
+    }
+
+    pthread_mutex_lock(&live->lock);
+
+    live->stop = 1;
+    for (doc = live->docs; doc; doc = doc->next) {
+        for (client = doc->clients; client; client = client->next) {
+            client->closed = 1;
+            if (client->suspended) {
+                client->suspended = 0;
+                MHD_resume_connection(client->connection);
+            }
+        }
+    }
+    pthread_cond_signal(&live->cond);
+
+    pthread_mutex_unlock(&live->lock);
+
+    pthread_join(live->thread, NULL);
+    live->joined = 1;
+}
+
+void
+live_free(live_t *live)
+{
+    live_doc_t *doc;
+
+    if (!live) {
+        return;
+    }
+
+    live_stop(live);
+
+    /* connections are gone with the daemon */
+    while ((doc = live->docs) != NULL) {
+        live->docs = doc->next;
+        free(doc->page);
+        free(doc->filepath);
+        free(doc);
+    }
+
+    pthread_mutex_destroy(&live->lock);
+    pthread_cond_destroy(&live->cond);
+    free(live);
+}
+
+void
+live_changed(const char *path, void *arg)
+{
+    live_t *live = (live_t *)arg;
+    live_doc_t *doc;
+
+    pthread_mutex_lock(&live->lock);
+
+    doc = live_find(live, path);
+    if (doc) {
+        doc->changed = 1;
+        pthread_cond_signal(&live->cond);
+    }
+
+    pthread_mutex_unlock(&live->lock);
+}
+
+const char *
+live_script(size_t *size)
+{
+    if (size) {
+        *size = sizeof(live_script_html) - 1;
+    }
+
+    return live_script_html;
+}
+
+struct MHD_Response *
+live_response(live_t *live, struct MHD_Connection *connection,
+              const char *filepath, const fragment_t *fragment)
+{
+    struct MHD_Response *response;
+    live_client_t *client;
+    live_doc_t *doc;
+    char hello[64];
+    int len;
+
+    client = (live_client_t *)calloc(1, sizeof(live_client_t));
+    if (!client) {
+        return NULL;
+    }
+    client->live = live;
+    client->connection = connection;
+
+    response = MHD_create_response_from_callback(MHD_SIZE_UNKNOWN, BLOCK_SIZE,
+                                                 &live_output_cb, client,
+                                                 &live_free_cb);
+    if (response == NULL) {
+        free(client);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&live->lock);
+
+    doc = live->stop ? NULL : live_find(live, filepath);
+    if (!doc && !live->stop) {
+        doc = (live_doc_t *)calloc(1, sizeof(live_doc_t));
+        if (doc) {
+            doc->filepath = strdup(filepath);
+            doc->page = live_page_new(
+                fragment->data + fragment->toc_size, fragment->body_size,
+                fragment->data, fragment->toc_size);
+            if (!doc->filepath || !doc->page) {
+                free(doc->filepath);
+                free(doc->page);
+                free(doc);
+                doc = NULL;
+            } else {
+                doc->next = live->docs;
+                live->docs = doc;
+            }
+        }
+    }
+
+    if (!doc) {
+        pthread_mutex_unlock(&live->lock);
+        /* frees the client */
+        MHD_destroy_response(response);
+        return NULL;
+    }
+
+    client->doc = doc;
+    client->next = doc->clients;
+    if (doc->clients) {
+        doc->clients->prev = client;
+    }
+    doc->clients = client;
+
+    /* the page of the browser must have as many blocks */
+    len = snprintf(hello, sizeof(hello), "event: hello\ndata: %zu\n\n",
+                   doc->page->count);
+    live_client_push(client, hello, len);
+
+    pthread_mutex_unlock(&live->lock);
+
+    return response;
+}
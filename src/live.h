@@ -0,0 +1,38 @@
+#ifndef __MMHD_LIVE_H__
+#define __MMHD_LIVE_H__
+
+#include <stddef.h>
+
+#include <microhttpd.h>
+
+#include "contents.h"
+
+/* query argument of the event stream of a page: ?live=1 */
+#define LIVE_ARGUMENT "live"
+
+typedef struct live live_t;
+
+/* previewed documents, each re-rendered once per change */
+live_t *live_new(unsigned int extensions, unsigned int html);
+void live_free(live_t *live);
+
+/* watch listener: path of a file written below the document root */
+void live_changed(const char *path, void *arg);
+
+/* ends the streams, MHD_stop_daemon() needs them resumed */
+void live_stop(live_t *live);
+
+/* client script put at the </body> split of markdown pages */
+const char *live_script(size_t *size);
+
+/*
+ * server-sent events of the changed blocks of filepath, the connection
+ * is suspended while there are none. fragment is the page the browser
+ * loaded, the baseline when nobody follows the document yet.
+ */
+struct MHD_Response *live_response(live_t *live,
+                                   struct MHD_Connection *connection,
+                                   const char *filepath,
+                                   const fragment_t *fragment);
+
+#endif
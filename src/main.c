@@ -5,43 +5,93 @@
 #include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
 #include <unistd.h>
 #include <getopt.h>
 #include <libgen.h>
 #include <limits.h>
+#include <dirent.h>
+#include <pthread.h>
 
 #include <microhttpd.h>
 
 #include <syslog.h>
 #include <signal.h>
+#include <time.h>
+#include <errno.h>
 
 #include "config.h"
 
+#ifdef HAVE_SYS_PRCTL_H
+#include <sys/prctl.h>
+#endif
+
+#include "cache.h"
+#include "contents.h"
+#include "export.h"
+#include "file.h"
+#include "http.h"
+#include "compress.h"
+#include "path.h"
+#include "listing.h"
+#include "live.h"
+#include "mime.h"
+#include "metrics.h"
+#include "stream.h"
+#include "access.h"
+#include "shared.h"
+#include "store.h"
+#include "watch.h"
+
 static int interrupted = 0;
+static int supervisor_reopen = 0;
 static int msgno = 0;
 
+static pthread_mutex_t notfound_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct MHD_Response *notfound = NULL;
+static unsigned int notfound_version = 0;
+
 #define msg_error(...) if (msgno >= 0) fprintf(stderr, "mmhd: "__VA_ARGS__)
 #define msg_verbose(...) if (msgno > 0) msg_error(__VA_ARGS__)
 #define msg_verbose_ex(_level, ...) if (msgno >= _level) msg_error(__VA_ARGS__)
 
-#include "hoedown/src/markdown.h"
-#include "hoedown/src/html.h"
-#include "hoedown/src/buffer.h"
-
-#define HOEDOWN_READ_UNIT   1024
-#define HOEDOWN_OUTPUT_UNIT 64
-
-#define BLOCK_SIZE 32768  /* 32k page size */
+#include "render.h"
 
 #define DEFAULT_PORT 8888
 #define DEFAULT_ROOTDIR "."
 #define DEFAULT_DIRECTORY_INDEX "index.md"
-#define DEFAULT_STYLE "<!DOCTYPE html><html><head><meta http-equiv=\"Content-Type\" content=\"text/html;charset=UTF-8\"/><title>Markdown</title><style type=\"text/css\"><!--h1{font-size:28px;color:rgb(0, 0, 0);}h2{font-size:24px;border-bottom:1px solid rgb(204,204,204);color:rgb(0,0,0);maargin:20px 0pt 10px;padding:0pt;font-wight:bold;}ul,ol{padding-left:30px;}strong,b{font-weight:bold;}table{border-collapse:collapse;border-spacing:0;font:inherit;margin:auto;}table td{border-bottom:1px solid #ddd;}table th{font-weight:bold;}table th,table td{border:1px solid rgb(204,204,204);padding:6px 13px;}table tr{border-top:1px solid #ccc;background-color:#fff}img{display:block;margin:auto;}video{display:block;margin:auto;}pre{background-color:#f8f8f8;border:1px solid #ddd;border-radius:3px 3px 3px 3px;font-size:13px;line-height:19px;overflow:auto;padding:6px 10px;}pre code,pre tt{background-color:transparent;border:medium none;margin:0;padding:0;}pre>code{white-space:pre;}code{white-space:nowrap;}code,tt{background-color:#f8f8f8;border:1px solid #ddd;border-radius:3px 3px 3px 3px;margin:0 2px;padding:0 5px;}.toc{padding:1em 1.5em;color:#999;font-size:.75em;margin-bottom:3em;border:1px solid #999;float:right;list-style-position:inside;background:#fff;}.toc li{}.toc>li{margin-bottom:1em;}.toc a,.toc a:link,.toc a:visited{color:#666;text-decoration:none;}.toc a:hover{color:#999;text-decoration:underline;}.toc>li>a{font-weight:bold;}.toc li li{}.toc li li a{}--></style></head><body></body></html>"
 #define DEFAULT_PIDFILE "/tmp/mmhd.pid"
-
-#define HOWDOWN_TOC_STARING 2
-#define HOWDOWN_TOC_NESTING 6
+#define DEFAULT_CACHE_SIZE (32 * 1024 * 1024)
+#define DEFAULT_OPEN_FILE_CACHE 256
+#define DEFAULT_PATH_CACHE 4096
+#define DEFAULT_LISTING_CACHE 64
+#define DEFAULT_EVENT "select"
+#define DEFAULT_THREADS 1
+#define DEFAULT_COMPRESS_MIN 256
+#define WORKERS_RESPAWN 1 /* sec, delay of a worker dying at startup */
+
+enum {
+    OPT_STATIC_MAX_AGE = 0x100,
+    OPT_MARKDOWN_MAX_AGE,
+    OPT_COMPRESS_MIN_LENGTH,
+    OPT_PREWARM,
+    OPT_PATH_CACHE,
+    OPT_MIME_TYPES,
+    OPT_METRICS,
+    OPT_SERVER_TIMING,
+    OPT_SLOW_REQUEST,
+    OPT_STREAM_MIN,
+    OPT_ACCESS_LOG,
+    OPT_ACCESS_LOG_FORMAT,
+    OPT_WORKERS,
+    OPT_CACHE_FILE,
+    OPT_LISTING,
+    OPT_LIVE,
+    OPT_EXPORT
+};
 
 typedef struct {
     char *root_dir;
@@ -49,28 +99,44 @@ typedef struct {
     char *style_file;
     unsigned int extensions;
     unsigned int html;
+    cache_t *cache;
+    cache_t *files;
+    cache_t *paths;
+    shared_cache_t *shared;
+    store_t *store;
+    watch_t *watch;
+    int static_max_age;
+    int markdown_max_age;
+    int compress;
+    size_t compress_min;
+    int metrics;
+    int server_timing;
+    double slow_request;
+    size_t stream_min;
+    int access_log;
+    cache_t *listings;
+    live_t *live;
 } response_params_t;
 
-struct mime_type_t {
-    int markdown;
-    const char *ext;
-    const char *type;
-};
+typedef struct {
+    struct timespec start;
+    struct timespec queued;
+    double phase[METRICS_PHASE_MAX]; /* msec, < 0 when not run */
+    char *url;
+    access_record_t access;
+} request_t;
 
-static const struct mime_type_t mimetype[] = {
-    { 1, ".md", "text/html; charset=UTF-8" },
-    { 1, ".markdown", "text/html; charset=UTF-8" },
-    { 0, ".html", "text/html; charset=UTF-8" },
-    { 0, ".htm", "text/html; charset=UTF-8" },
-    { 0, ".png", "image/png" },
-    { 0, ".jpg", "image/jpeg" },
-    { 0, ".jpeg", "image/jpeg" },
-    { 0, ".gif", "image/gif" },
-    { 0, ".ico", "image/x-ico" },
-    { 0, ".css", "text/css" },
-    { 0, ".js", "application/javascript" },
-    { 0, ".txt", "text/plain" }
-};
+typedef struct {
+    response_params_t *params;
+    char **paths;
+    size_t count;
+    size_t alloc;
+    size_t next;
+    size_t warmed;
+    int threads;
+    int stop;
+    pthread_t thread;
+} prewarm_t;
 
 struct markdown_opts_t {
     const char *name;
@@ -109,95 +175,705 @@ static const struct markdown_opts_t markdown_opts[] = {
 };
 
 
-static char *
-contents_generate(size_t *length,
-                  const char *data, const size_t data_size,
-                  const char *toc, const size_t toc_size,
-                  const char *style_file)
+/* block marks of the live preview are part of the rendered page */
+static void
+markdown_key(char *key, size_t size, const char *filepath,
+             const struct stat *st, response_params_t *params,
+             int toc_starting, int toc_nesting)
 {
-    char *retval = NULL;
-    size_t pos = 0;
-    char *style = NULL;
-    size_t style_size = 0;
-    int style_free = 0;
-    struct stat statbuf;
+    snprintf(key, size, "%s|%ld.%09ld|%lu|%lld|%x|%x|%d|%d%s",
+             filepath, (long)st->st_mtim.tv_sec, (long)st->st_mtim.tv_nsec,
+             (unsigned long)st->st_ino,
+             (long long)st->st_size, params->extensions, params->html,
+             toc_starting, toc_nesting, params->live ? "|live" : "");
+}
+
+/* render flags of a page in the cache file */
+static unsigned int
+markdown_flags(response_params_t *params, int toc_starting, int toc_nesting)
+{
+    char flags[64];
 
-    *length = 0;
+    snprintf(flags, sizeof(flags), "%x|%x|%d|%d%s", params->extensions,
+             params->html, toc_starting, toc_nesting,
+             params->live ? "|live" : "");
 
-    if (style_file && stat(style_file, &statbuf) == 0) {
-        FILE *file = fopen(style_file, "rb");
-        if (file) {
-            style_size = statbuf.st_size;
-            style = (char *)malloc(sizeof(char) * (style_size + 1));
-            if (style) {
-                fread(style, 1, style_size, file);
-                style_free = 1;
-            }
-            fclose(file);
+    return cache_hash(flags);
+}
+
+static cache_entry_t *
+markdown_keep(response_params_t *params, const char *key,
+              fragment_t *fragment)
+{
+    if (params->cache) {
+        return cache_set(params->cache, key, fragment,
+                         fragment->toc_size + fragment->body_size);
+    }
+
+    return cache_entry_new(key, fragment,
+                           fragment->toc_size + fragment->body_size);
+}
+
+/* rendered fragment from the cache, another worker or the cache file */
+static cache_entry_t *
+markdown_lookup(response_params_t *params, const char *filepath,
+                const struct stat *st, const char *key,
+                int toc_starting, int toc_nesting)
+{
+    cache_entry_t *entry = NULL;
+    fragment_t *fragment;
+    size_t size;
+
+    if (params->cache) {
+        entry = cache_get(params->cache, key);
+    }
+
+    if (entry) {
+        msg_verbose_ex(2, "Cache=[hit]\n");
+        return entry;
+    }
+
+    /* rendered by another worker */
+    fragment = shared_cache_get(params->shared, key, &size);
+    if (fragment) {
+        msg_verbose_ex(2, "Cache=[shared]\n");
+    } else if (params->store) {
+        fragment = store_get(params->store, filepath,
+                             markdown_flags(params, toc_starting,
+                                            toc_nesting),
+                             st, &size);
+        if (fragment && (size < sizeof(fragment_t)
+                         || size != sizeof(fragment_t) + fragment->toc_size
+                         + fragment->body_size)) {
+            free(fragment);
+            fragment = NULL;
+        }
+        if (fragment) {
+            msg_verbose_ex(2, "Cache=[file]\n");
+            shared_cache_set(params->shared, key, fragment, size);
         }
     }
-    if (!style) {
-        style = DEFAULT_STYLE;
-        style_size = strlen(style);
+
+    if (fragment == NULL) {
+        return NULL;
     }
 
-    retval = (char *)malloc(sizeof(char) * (data_size+toc_size+style_size+1));
-    if (!retval) {
-        if (style_free) {
-            free(style);
+    return markdown_keep(params, key, fragment);
+}
+
+/* the flushed html is kept for the cache */
+typedef struct {
+    fragment_t *fragment;
+    render_flush_t flush;
+    void *opaque;
+    int error;
+} markdown_flush_t;
+
+static void
+markdown_flush(const uint8_t *data, size_t size, void *opaque)
+{
+    markdown_flush_t *page = (markdown_flush_t *)opaque;
+
+    if (!page->error) {
+        page->fragment = fragment_append(page->fragment,
+                                         (const char *)data, size);
+        if (page->fragment == NULL) {
+            page->error = 1;
         }
+    }
+
+    page->flush(data, size, page->opaque);
+}
+
+/* rendered and cached, with flush the html is handed out meanwhile */
+static cache_entry_t *
+markdown_render(response_params_t *params, request_t *request,
+                const char *filepath, const struct stat *st, const char *key,
+                int toc_starting, int toc_nesting,
+                render_flush_t flush, void *flush_opaque)
+{
+    markdown_flush_t page = { NULL, flush, flush_opaque, 0 };
+    fragment_t *fragment;
+    render_t *render;
+    size_t size;
+
+    render = render_get(params->extensions);
+    if (render == NULL) {
         return NULL;
     }
+    if (flush) {
+        render->flush = &markdown_flush;
+        render->flush_opaque = &page;
+    }
 
-    if (style && style_size) {
-        char *str = strstr(style, "</body>");
-        if (str) {
-            pos = str - style;
-            memcpy(retval, style, pos);
-            *length += pos;
-        } else {
-            memcpy(retval, style, style_size);
-            *length += style_size;
+    /* contents and toc in a single parse */
+    if (render_file(render, filepath,
+                    params->html, toc_starting, toc_nesting) != 0) {
+        free(page.fragment);
+        return NULL;
+    }
+    if (request) {
+        request->phase[METRICS_READ] = render->read_time;
+        request->phase[METRICS_RENDER] = render->render_time;
+    }
+
+    if (flush) {
+        /* streamed pages have no toc */
+        fragment = NULL;
+        if (!page.error) {
+            fragment = fragment_append(page.fragment,
+                                       (const char *)render->ob->data
+                                       + render->kept,
+                                       render->ob->size - render->kept);
+        }
+    } else {
+        fragment = fragment_new((const char *)render->toc->data,
+                                render->toc->size,
+                                (const char *)render->ob->data,
+                                render->ob->size);
+    }
+    if (fragment == NULL) {
+        return NULL;
+    }
+
+    size = sizeof(fragment_t) + fragment->toc_size + fragment->body_size;
+    shared_cache_set(params->shared, key, fragment, size);
+    if (params->store) {
+        store_put(params->store, filepath,
+                  markdown_flags(params, toc_starting, toc_nesting),
+                  st, fragment, size);
+    }
+
+    return markdown_keep(params, key, fragment);
+}
+
+/* rendered fragment from the caches, or rendered and cached */
+static cache_entry_t *
+markdown_entry(response_params_t *params, request_t *request,
+               const char *filepath, const struct stat *st, const char *key,
+               int toc_starting, int toc_nesting)
+{
+    cache_entry_t *entry;
+
+    entry = markdown_lookup(params, filepath, st, key,
+                            toc_starting, toc_nesting);
+    if (entry) {
+        return entry;
+    }
+
+    return markdown_render(params, request, filepath, st, key,
+                           toc_starting, toc_nesting, NULL, NULL);
+}
+
+/* page rendered on a stream worker */
+typedef struct {
+    response_params_t *params;
+    struct stat st;
+    int toc_starting;
+    int toc_nesting;
+    char filepath[PATH_MAX+1];
+    char key[PATH_MAX+256];
+} markdown_stream_t;
+
+/* cached as markdown_entry() does, another request may have rendered it */
+static cache_entry_t *
+markdown_stream(void *arg, render_flush_t flush, void *opaque)
+{
+    markdown_stream_t *page = (markdown_stream_t *)arg;
+    cache_entry_t *entry;
+
+    entry = markdown_lookup(page->params, page->filepath, &page->st,
+                            page->key, page->toc_starting,
+                            page->toc_nesting);
+    if (entry) {
+        return entry;
+    }
+
+    return markdown_render(page->params, NULL, page->filepath, &page->st,
+                           page->key, page->toc_starting, page->toc_nesting,
+                           flush, opaque);
+}
+
+/* page of a directory listing from the cache, or built and cached */
+static cache_entry_t *
+listing_entry(response_params_t *params, request_t *request,
+              const char *url, const char *dirpath, const struct stat *st,
+              size_t page, const char *key)
+{
+    cache_entry_t *entry = NULL, *lentry;
+    struct timespec phase;
+    fragment_t *fragment;
+
+    if (params->cache) {
+        entry = cache_get(params->cache, key);
+    }
+
+    if (entry) {
+        msg_verbose_ex(2, "Cache=[hit]\n");
+        return entry;
+    }
+
+    /* the directory is read again only when its mtime changed */
+    clock_gettime(CLOCK_MONOTONIC, &phase);
+    lentry = listing_get(params->listings, dirpath, st);
+    if (lentry == NULL) {
+        return NULL;
+    }
+    fragment = listing_page((listing_t *)lentry->data, url, page,
+                            LISTING_PAGE_SIZE);
+    cache_release(lentry);
+    request->phase[METRICS_RENDER] = metrics_elapsed(&phase);
+    if (fragment == NULL) {
+        return NULL;
+    }
+
+    return markdown_keep(params, key, fragment);
+}
+
+/*
+ * cached fragment assembled in the style with script, compressed and
+ * cached next to the fragment when an encoding is negotiated. the entry
+ * is taken.
+ */
+static contents_t *
+page_contents(response_params_t *params, request_t *request,
+              cache_entry_t *entry, const char *key, const char *script,
+              int *encoding)
+{
+    fragment_t *fragment = (fragment_t *)entry->data;
+    char ckey[PATH_MAX+288];
+    cache_entry_t *centry;
+    contents_t *contents;
+    struct timespec phase;
+
+    clock_gettime(CLOCK_MONOTONIC, &phase);
+    contents = contents_generate(
+        fragment->data + fragment->toc_size, fragment->body_size,
+        fragment->data, fragment->toc_size, entry);
+    if (contents == NULL) {
+        return NULL;
+    }
+    if (script) {
+        contents_insert(contents, script, strlen(script));
+    }
+    request->phase[METRICS_ASSEMBLE] = metrics_elapsed(&phase);
+
+    if (!*encoding || contents->length < params->compress_min) {
+        *encoding = COMPRESS_IDENTITY;
+        return contents;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &phase);
+    snprintf(ckey, sizeof(ckey), "%s|%s|%08x", compress_name(*encoding),
+             key, contents->style->version);
+    centry = compress_entry(params->cache, ckey,
+                            contents->iov, contents->iovcnt, *encoding);
+    request->phase[METRICS_COMPRESS] = metrics_elapsed(&phase);
+    if (centry == NULL) {
+        *encoding = COMPRESS_IDENTITY;
+        return contents;
+    }
+
+    contents_free(contents);
+
+    return contents_buffer(centry->data, centry->size, centry);
+}
+
+static int
+prewarm_add(prewarm_t *prewarm, const char *path)
+{
+    if (prewarm->count == prewarm->alloc) {
+        size_t alloc = prewarm->alloc ? prewarm->alloc * 2 : 64;
+        char **paths = realloc(prewarm->paths, alloc * sizeof(char *));
+        if (!paths) {
+            return -1;
+        }
+        prewarm->paths = paths;
+        prewarm->alloc = alloc;
+    }
+
+    prewarm->paths[prewarm->count] = strdup(path);
+    if (!prewarm->paths[prewarm->count]) {
+        return -1;
+    }
+    prewarm->count++;
+
+    return 0;
+}
+
+/* markdown files below dir, symbolic links are not followed */
+static void
+prewarm_scan(prewarm_t *prewarm, const char *dir)
+{
+    char path[PATH_MAX+1];
+    struct dirent *dent;
+    struct stat st;
+    DIR *dp;
+
+    dp = opendir(dir);
+    if (!dp) {
+        return;
+    }
+
+    while ((dent = readdir(dp)) != NULL && !prewarm->stop) {
+        const char *ext;
+
+        if (strcmp(dent->d_name, ".") == 0
+            || strcmp(dent->d_name, "..") == 0) {
+            continue;
+        }
+        if (snprintf(path, sizeof(path), "%s/%s", dir, dent->d_name)
+            >= (int)sizeof(path)) {
+            continue;
+        }
+        if (lstat(path, &st) != 0) {
+            continue;
+        }
+
+        if (S_ISDIR(st.st_mode)) {
+            prewarm_scan(prewarm, path);
+        } else if (S_ISREG(st.st_mode)) {
+            ext = strrchr(dent->d_name, '.');
+            if (ext && ext != dent->d_name && mime_lookup(ext)->markdown) {
+                prewarm_add(prewarm, path);
+            }
+        }
+    }
+
+    closedir(dp);
+}
+
+static void *
+prewarm_worker(void *arg)
+{
+    prewarm_t *prewarm = (prewarm_t *)arg;
+    response_params_t *params = prewarm->params;
+    char key[PATH_MAX+256];
+    cache_entry_t *entry;
+    struct stat st;
+    size_t i;
+
+    while (!prewarm->stop) {
+        i = __sync_fetch_and_add(&prewarm->next, 1);
+        if (i >= prewarm->count) {
+            break;
+        }
+        if (stat(prewarm->paths[i], &st) != 0) {
+            continue;
+        }
+
+        /* same key as a request without ?toc */
+        markdown_key(key, sizeof(key), prewarm->paths[i], &st, params,
+                     HOWDOWN_TOC_STARING, HOWDOWN_TOC_NESTING);
+        entry = markdown_entry(params, NULL, prewarm->paths[i], &st, key,
+                               HOWDOWN_TOC_STARING, HOWDOWN_TOC_NESTING);
+        if (entry) {
+            __sync_add_and_fetch(&prewarm->warmed, 1);
+            cache_release(entry);
         }
     }
 
-    if (toc && toc_size) {
-        memcpy(retval + *length, toc, toc_size);
-        *length += toc_size;
+    return NULL;
+}
+
+static void *
+prewarm_run(void *arg)
+{
+    prewarm_t *prewarm = (prewarm_t *)arg;
+    struct timespec start;
+    pthread_t *workers;
+    int i, n = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    prewarm_scan(prewarm, prewarm->params->root_dir);
+
+    workers = (pthread_t *)calloc(prewarm->threads, sizeof(pthread_t));
+    if (workers) {
+        for (n = 0; n < prewarm->threads; n++) {
+            if (pthread_create(&workers[n], NULL,
+                               &prewarm_worker, prewarm) != 0) {
+                break;
+            }
+        }
     }
+    if (n == 0) {
+        prewarm_worker(prewarm);
+    }
+    for (i = 0; i < n; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+
+    msg_error("Prewarm=[%zu/%zu files, %.3fms]\n",
+              prewarm->warmed, prewarm->count, metrics_elapsed(&start));
+
+    return NULL;
+}
 
-    if (data && data_size) {
-        memcpy(retval + *length, data, data_size);
-        *length += data_size;
+static int
+prewarm_start(prewarm_t *prewarm, response_params_t *params)
+{
+    prewarm->params = params;
+    prewarm->threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (prewarm->threads <= 0) {
+        prewarm->threads = 1;
     }
 
-    if (pos) {
-        memcpy(retval + *length, style + pos, style_size - pos);
-        *length += (style_size - pos);
+    return pthread_create(&prewarm->thread, NULL, &prewarm_run, prewarm);
+}
+
+static void
+prewarm_stop(prewarm_t *prewarm)
+{
+    size_t i;
+
+    prewarm->stop = 1;
+    pthread_join(prewarm->thread, NULL);
+
+    for (i = 0; i < prewarm->count; i++) {
+        free(prewarm->paths[i]);
     }
+    free(prewarm->paths);
+}
+
+static cache_entry_t *
+export_render(const char *path, const struct stat *st, void *arg)
+{
+    response_params_t *params = (response_params_t *)arg;
+    char key[PATH_MAX+256];
 
-    if (style_free) {
-        free(style);
+    /* same page as a request without ?toc */
+    markdown_key(key, sizeof(key), path, st, params,
+                 HOWDOWN_TOC_STARING, HOWDOWN_TOC_NESTING);
+
+    return markdown_entry(params, NULL, path, st, key,
+                          HOWDOWN_TOC_STARING, HOWDOWN_TOC_NESTING);
+}
+
+static void
+export_failed(const char *path, int err, void *arg)
+{
+    msg_error("ERROR: Failed to export %s: %s\n", path, strerror(err));
+}
+
+/* static copy of the document root instead of serving it */
+static int
+export_tree(response_params_t *params, const char *outdir)
+{
+    export_params_t export = { params->root_dir, params->directory_index,
+                               outdir, 0, params->compress,
+                               params->compress_min, 0, &export_render,
+                               &export_failed, params };
+    export_stats_t stats;
+    struct timespec start;
+    style_t *style;
+
+    /* a new style changes every page */
+    style = style_get();
+    export.flags = markdown_flags(params, HOWDOWN_TOC_STARING,
+                                  HOWDOWN_TOC_NESTING) ^ style->version;
+    style_release(style);
+
+    export.threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (export.threads <= 0) {
+        export.threads = 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (export_run(&export, &stats) != 0) {
+        msg_error("ERROR: Failed to export to %s: %s\n",
+                  outdir, strerror(errno));
+        return -1;
     }
 
-    return retval;
+    msg_error("Export=[%zu rendered, %zu copied, %zu unchanged, %zu removed,"
+              " %zu failed, %.3fms]\n", stats.rendered, stats.copied,
+              stats.unchanged, stats.removed, stats.failed,
+              metrics_elapsed(&start));
+
+    return stats.failed ? -1 : 0;
 }
 
-static ssize_t
-file_output_cb(void *cls, uint64_t pos, char *buf, size_t max)
+static void
+request_access(request_t *request, struct MHD_Connection *connection)
 {
-    FILE *file = cls;
+    const union MHD_ConnectionInfo *info;
+    struct sockaddr *addr = NULL;
+    char *dst = request->access.addr;
+
+    info = MHD_get_connection_info(connection,
+                                   MHD_CONNECTION_INFO_CLIENT_ADDRESS);
+    if (info) {
+        addr = info->client_addr;
+    }
+
+    if (addr && addr->sa_family == AF_INET) {
+        inet_ntop(AF_INET, &((struct sockaddr_in *)addr)->sin_addr,
+                  dst, ACCESS_LOG_ADDR_SIZE);
+    } else if (addr && addr->sa_family == AF_INET6) {
+        inet_ntop(AF_INET6, &((struct sockaddr_in6 *)addr)->sin6_addr,
+                  dst, ACCESS_LOG_ADDR_SIZE);
+    } else {
+        snprintf(dst, ACCESS_LOG_ADDR_SIZE, "-");
+    }
+
+    request->access.duration = request->phase[METRICS_TOTAL];
+}
 
-    (void)fseek(file, pos, SEEK_SET);
+static void
+completed_cb(void *cls, struct MHD_Connection *connection,
+             void **ptr, enum MHD_RequestTerminationCode toe)
+{
+    response_params_t *params = (response_params_t *)cls;
+    request_t *request = *ptr;
+    int i;
+
+    if (request) {
+        request->phase[METRICS_TOTAL] = metrics_elapsed(&request->start);
+        msg_verbose_ex(2, "Time=[%.3fms]\n", request->phase[METRICS_TOTAL]);
+
+        if (request->queued.tv_sec || request->queued.tv_nsec) {
+            request->phase[METRICS_SEND] = metrics_elapsed(&request->queued);
+            for (i = 0; i < METRICS_PHASE_MAX; i++) {
+                if (request->phase[i] >= 0) {
+                    metrics_phase(i, request->phase[i]);
+                }
+            }
+        }
+
+        if (params->slow_request > 0
+            && request->phase[METRICS_TOTAL] >= params->slow_request) {
+            char timing[256];
+            size_t len = 0;
+
+            timing[0] = '\0';
+            for (i = 0; i < METRICS_PHASE_MAX - 1; i++) {
+                if (request->phase[i] >= 0 && len < sizeof(timing)) {
+                    len += snprintf(timing + len, sizeof(timing) - len,
+                                    " %s=%.3fms", metrics_phase_name(i),
+                                    request->phase[i]);
+                }
+            }
+            msg_error("Slow=[%s %.3fms%s]\n",
+                      request->url ? request->url : "-",
+                      request->phase[METRICS_TOTAL], timing);
+        }
+
+        if (params->access_log
+            && (request->queued.tv_sec || request->queued.tv_nsec)) {
+            request_access(request, connection);
+            access_log_push(&request->access);
+        }
+
+        free(request->url);
+        free(request);
+        *ptr = NULL;
+    }
+}
 
-    return fread(buf, 1, max, file);
+/* counted when the response is queued, the send phase starts here */
+static void
+request_queued(request_t *request, unsigned int status,
+               const char *content_type, uint64_t length)
+{
+    metrics_request(status, content_type, length);
+    request->access.status = status;
+    request->access.bytes = length;
+    clock_gettime(CLOCK_MONOTONIC, &request->queued);
 }
 
 static void
-file_destroy_cb(void *cls)
+request_server_timing(request_t *request, struct MHD_Response *response)
+{
+    char timing[256];
+    size_t len = 0;
+    int i;
+
+    for (i = 0; i < METRICS_SEND; i++) {
+        if (request->phase[i] >= 0 && len < sizeof(timing)) {
+            len += snprintf(timing + len, sizeof(timing) - len,
+                            "%s%s;dur=%.3f", len ? ", " : "",
+                            metrics_phase_name(i), request->phase[i]);
+        }
+    }
+    if (len < sizeof(timing)) {
+        snprintf(timing + len, sizeof(timing) - len, "%s%s;dur=%.3f",
+                 len ? ", " : "", metrics_phase_name(METRICS_TOTAL),
+                 metrics_elapsed(&request->start));
+    }
+
+    MHD_add_response_header(response, "Server-Timing", timing);
+}
+
+static int
+metrics_queue(struct MHD_Connection *connection)
 {
-    FILE *file = cls;
-    fclose(file);
+    struct MHD_Response *response;
+    size_t size = 0;
+    char *buf;
+    int ret;
+
+    buf = metrics_generate(&size);
+    if (buf == NULL) {
+        return MHD_NO;
+    }
+
+    response = MHD_create_response_from_buffer(size, buf,
+                                               MHD_RESPMEM_MUST_FREE);
+    if (response == NULL) {
+        free(buf);
+        return MHD_NO;
+    }
+    MHD_add_response_header(response, "Content-Type",
+                            "text/plain; version=0.0.4");
+    MHD_add_response_header(response, "Cache-Control", "no-store");
+
+    ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
+    MHD_destroy_response(response);
+
+    return ret;
+}
+
+/*
+ * the 404 page is built once per style version and the same response is
+ * queued for every missing url.
+ */
+static int
+notfound_queue(struct MHD_Connection *connection)
+{
+    struct MHD_Response *response;
+    contents_t *contents;
+    style_t *style;
+    int ret = MHD_NO;
+
+    pthread_mutex_lock(&notfound_lock);
+
+    style = style_get();
+    if (notfound == NULL || notfound_version != style->version) {
+        contents = contents_generate("File not found", 14, NULL, 0, NULL);
+        if (contents) {
+            response = contents_response(contents);
+            if (response) {
+                MHD_add_response_header(response, "Content-Type",
+                                        "text/html; charset=UTF-8");
+                if (notfound) {
+                    MHD_destroy_response(notfound);
+                }
+                notfound = response;
+                notfound_version = style->version;
+            }
+        }
+    }
+    style_release(style);
+
+    if (notfound) {
+        ret = MHD_queue_response(connection, MHD_HTTP_NOT_FOUND, notfound);
+    }
+
+    pthread_mutex_unlock(&notfound_lock);
+
+    return ret;
 }
 
 static int
@@ -207,222 +883,479 @@ response_cb(void *cls, struct MHD_Connection *connection, const char *url,
 {
     response_params_t *params = (response_params_t *)cls;
     char filepath[PATH_MAX+1] = {0,};
-    static int aptr;
+    request_t *request = *ptr;
     struct MHD_Response *response;
-    int ret;
-    FILE *file;
+    int i, ret, found = 0, directory = 0;
     struct stat statbuf;
+    struct timespec phase;
+    uint64_t length = 0;
+    cache_entry_t *pentry;
+    path_t *path;
     char *ext = NULL;
-    char *content = NULL;
-    size_t content_length = 0;
+    contents_t *contents;
     const char *content_type = "text/plain";
+    unsigned int status = MHD_HTTP_OK;
+    char etag[HTTP_ETAG_SIZE] = {0,};
+    time_t last_modified = 0;
+    int max_age = -1;
+    int encoding = COMPRESS_IDENTITY, vary = 0;
 
     if (strcmp(method, "GET") != 0) {
         /* unexpected method */
         return MHD_NO;
     }
 
-    if (&aptr != *ptr) {
+    if (request == NULL) {
         /* do never respond on first call */
-        *ptr = &aptr;
+        request = (request_t *)calloc(1, sizeof(request_t));
+        if (request == NULL) {
+            return MHD_NO;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &request->start);
+        for (i = 0; i < METRICS_PHASE_MAX; i++) {
+            request->phase[i] = -1;
+        }
+        if (params->slow_request > 0) {
+            request->url = strdup(url);
+        }
+        if (params->access_log) {
+            request->access.time = time(NULL);
+            snprintf(request->access.method, sizeof(request->access.method),
+                     "%s", method);
+            snprintf(request->access.version,
+                     sizeof(request->access.version), "%s", version);
+            snprintf(request->access.url, sizeof(request->access.url),
+                     "%s", url);
+        }
+        *ptr = request; /* freed by completed_cb */
         return MHD_YES;
     }
-    *ptr = NULL; /* reset when done */
 
     msg_verbose("URL=[%s]\n", url);
 
-    snprintf(filepath, PATH_MAX, "%s%s", params->root_dir, url);
-    if (stat(filepath, &statbuf) == 0) {
-        if (S_ISDIR(statbuf.st_mode)) {
-            snprintf(filepath, PATH_MAX, "%s%s%s",
-                     params->root_dir, url, params->directory_index);
-            if (stat(filepath, &statbuf) == 0) {
-                file = fopen(filepath, "rb");
-            } else {
-                file = NULL;
-            }
-        } else {
-            file = fopen(filepath, "rb");
-        }
-        if (file) {
-            msg_verbose_ex(2, "FilePath=[%s]\n", filepath);
-            ext = strrchr(filepath, '.');
-            if (!ext || ext == filepath) {
-                ext = NULL;
-            }
+    if (params->metrics && strcmp(url, METRICS_URL) == 0) {
+        return metrics_queue(connection);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &phase);
+    pentry = path_resolve(params->paths, params->watch, params->root_dir,
+                          params->directory_index, url);
+    if (pentry == NULL) {
+        return MHD_NO;
+    }
+    request->phase[METRICS_RESOLVE] = metrics_elapsed(&phase);
+    path = (path_t *)pentry->data;
+    if (path->found) {
+        found = 1;
+        statbuf = path->st;
+        snprintf(filepath, sizeof(filepath), "%s", path->filepath);
+        msg_verbose_ex(2, "FilePath=[%s]\n", filepath);
+        ext = strrchr(filepath, '.');
+        if (!ext || ext == filepath) {
+            ext = NULL;
         }
-    } else {
-        file = NULL;
+    } else if (path->directory && params->listings) {
+        directory = 1;
+        statbuf = path->st;
+        snprintf(filepath, sizeof(filepath), "%s", path->filepath);
+        msg_verbose_ex(2, "Directory=[%s]\n", filepath);
     }
+    cache_release(pentry);
+
+    if (!found && !directory) {
+        request_queued(request, MHD_HTTP_NOT_FOUND,
+                       "text/html; charset=UTF-8", 0);
+        return notfound_queue(connection);
+    } else if (directory) {
+        /* directory without its index file */
+        const char *arg;
+        cache_entry_t *entry;
+        char key[PATH_MAX+256];
+        style_t *style;
+        size_t page = 1;
+
+        arg = MHD_lookup_connection_value(connection,
+                                          MHD_GET_ARGUMENT_KIND, "page");
+        if (arg && atoi(arg) > 0) {
+            page = atoi(arg);
+        }
+
+        content_type = "text/html; charset=UTF-8";
+        snprintf(key, sizeof(key), "listing|%s|%ld.%09ld|%lu|%zu",
+                 filepath, (long)statbuf.st_mtim.tv_sec,
+                 (long)statbuf.st_mtim.tv_nsec,
+                 (unsigned long)statbuf.st_ino, page);
+
+        if (params->compress) {
+            vary = 1;
+            encoding = compress_negotiate(
+                MHD_lookup_connection_value(connection, MHD_HEADER_KIND,
+                                            "Accept-Encoding"));
+        }
+
+        style = style_get();
+        snprintf(etag, sizeof(etag), "\"%lx-%lx-%lx-%08x%s%s\"",
+                 (unsigned long)statbuf.st_ino,
+                 (unsigned long)statbuf.st_mtime,
+                 (unsigned long)statbuf.st_mtim.tv_nsec,
+                 cache_hash(key) ^ style->version,
+                 encoding ? "-" : "",
+                 encoding ? compress_name(encoding) : "");
+        last_modified = statbuf.st_mtime;
+        if (style->mtime > last_modified) {
+            last_modified = style->mtime;
+        }
+        style_release(style);
+
+        max_age = params->markdown_max_age;
+        if (http_not_modified(connection, etag, last_modified)) {
+            request_queued(request, MHD_HTTP_NOT_MODIFIED, content_type, 0);
+            return http_queue_not_modified(connection, etag,
+                                           last_modified, max_age);
+        }
+
+        /* past the last page or an unreadable directory */
+        entry = listing_entry(params, request, url, filepath, &statbuf,
+                              page, key);
+        if (entry == NULL) {
+            request_queued(request, MHD_HTTP_NOT_FOUND, content_type, 0);
+            return notfound_queue(connection);
+        }
 
-    if (file == NULL) {
-        content = contents_generate(&content_length,
-                                    "File not found", 14,
-                                    NULL, 0,
-                                    params->style_file);
-        if (content == NULL) {
+        contents = page_contents(params, request, entry, key, NULL,
+                                 &encoding);
+        if (contents == NULL) {
             return MHD_NO;
         }
 
-        response = MHD_create_response_from_buffer(content_length, content,
-                                                   MHD_RESPMEM_MUST_FREE);
+        length = contents->length;
+        response = contents_response(contents);
         if (response == NULL) {
-            free(content);
             return MHD_NO;
         }
+    } else {
+        const mime_t *mime = mime_lookup(ext);
+        const char *raw = NULL, *toc = NULL, *live = NULL;
 
-        content_type = "text/html; charset=UTF-8";
-    } else if (ext) {
-        int i;
-        const char *raw = NULL, *toc = NULL;
-
-        for (i = 0; i < (int)(sizeof(mimetype)/sizeof(mimetype[0])-1); i++) {
-            if (strcasecmp(ext, mimetype[i].ext) == 0) {
-                break;
-            }
-        }
-        content_type = mimetype[i].type;
+        content_type = mime->type;
 
         raw = MHD_lookup_connection_value(connection,
                                           MHD_GET_ARGUMENT_KIND, "raw");
         toc = MHD_lookup_connection_value(connection,
                                           MHD_GET_ARGUMENT_KIND, "toc");
+        if (params->live) {
+            live = MHD_lookup_connection_value(connection,
+                                               MHD_GET_ARGUMENT_KIND,
+                                               LIVE_ARGUMENT);
+        }
 
         if (raw != NULL) {
             content_type = "text/plain";
-        } else if (mimetype[i].markdown) {
-            unsigned int extensions = params->extensions;
+        }
+
+        if (raw == NULL && mime->markdown && live != NULL) {
+            /* events of the page, the loaded page is the baseline */
+            cache_entry_t *entry;
+            char key[PATH_MAX+256];
+
+            markdown_key(key, sizeof(key), filepath, &statbuf, params,
+                         HOWDOWN_TOC_STARING, HOWDOWN_TOC_NESTING);
+            entry = markdown_entry(params, request, filepath, &statbuf, key,
+                                   HOWDOWN_TOC_STARING, HOWDOWN_TOC_NESTING);
+            if (entry == NULL) {
+                return MHD_NO;
+            }
+
+            response = live_response(params->live, connection, filepath,
+                                     (fragment_t *)entry->data);
+            cache_release(entry);
+            if (response == NULL) {
+                return MHD_NO;
+            }
+            MHD_add_response_header(response, "Cache-Control", "no-cache");
+            content_type = "text/event-stream";
+        } else if (raw == NULL && mime->markdown) {
             unsigned int html = params->html;
             int toc_starting = HOWDOWN_TOC_STARING;
             int toc_nesting = HOWDOWN_TOC_NESTING;
-            hoedown_buffer *ib, *ob, *toc_ob = NULL;
-            hoedown_callbacks callbacks;
-            hoedown_html_renderopt options;
-            struct hoedown_markdown *markdown;
-            int read;
-
-            ib = hoedown_buffer_new(HOEDOWN_READ_UNIT);
-            hoedown_buffer_grow(ib, HOEDOWN_READ_UNIT);
-            while ((read = fread(ib->data + ib->size, 1,
-                                 ib->asize - ib->size, file)) > 0) {
-                ib->size += read;
-                hoedown_buffer_grow(ib, ib->size + HOEDOWN_READ_UNIT);
-            }
-
-            fclose(file);
-            file = NULL;
+            style_t *style;
+            cache_entry_t *entry = NULL;
+            const char *script = NULL;
+            char key[PATH_MAX+256];
+            int streaming = 0;
 
             /* toc */
-            if (html & HOEDOWN_HTML_TOC) {
-                html |= HOEDOWN_HTML_TOC;
-
-                if (toc) {
-                    size_t len = strlen(toc);
-                    int n;
-
-                    if (len > 0) {
-                        char *delim, *toc_b = NULL, *toc_e = NULL;
-                        delim = strchr(toc, ',');
-                        if (delim) {
-                            int i = delim - toc;
-                            toc_b = strndup(toc, i++);
-                            if (toc_b) {
-                                n = atoi(toc_b);
-                                if (n) {
-                                    toc_starting = n;
-                                }
-                                free(toc_b);
+            if (html & HOEDOWN_HTML_TOC && toc) {
+                size_t len = strlen(toc);
+                int n;
+
+                if (len > 0) {
+                    char *delim, *toc_b = NULL, *toc_e = NULL;
+                    delim = strchr(toc, ',');
+                    if (delim) {
+                        int i = delim - toc;
+                        toc_b = strndup(toc, i++);
+                        if (toc_b) {
+                            n = atoi(toc_b);
+                            if (n) {
+                                toc_starting = n;
                             }
+                            free(toc_b);
+                        }
 
-                            toc_e = strndup(toc + i, len - i);
-                            if (toc_e) {
-                                n = atoi(toc_e);
-                                if (n) {
-                                    toc_nesting = n;
-                                }
-                                free(toc_e);
-                            }
-                        } else {
-                            n = atoi(toc);
+                        toc_e = strndup(toc + i, len - i);
+                        if (toc_e) {
+                            n = atoi(toc_e);
                             if (n) {
-                                toc_starting = n;
+                                toc_nesting = n;
                             }
+                            free(toc_e);
+                        }
+                    } else {
+                        n = atoi(toc);
+                        if (n) {
+                            toc_starting = n;
                         }
                     }
                 }
+            }
 
-                toc_ob = hoedown_buffer_new(HOEDOWN_OUTPUT_UNIT);
-
-                hoedown_html_toc_renderer(&callbacks, &options, 0);
-
-                options.flags = html;
+            if (params->live) {
+                script = live_script(NULL);
+            }
 
-                options.toc_data.starting_level = toc_starting;
-                options.toc_data.nesting_level = toc_nesting;
-                options.toc_data.header = NULL;
-                options.toc_data.footer = NULL;
+            /* cache */
+            markdown_key(key, sizeof(key), filepath, &statbuf, params,
+                         toc_starting, toc_nesting);
+
+            /* large uncached page, the toc needs the whole document */
+            if (params->stream_min
+                && (size_t)statbuf.st_size >= params->stream_min
+                && !(html & HOEDOWN_HTML_TOC)) {
+                entry = markdown_lookup(params, filepath, &statbuf, key,
+                                        toc_starting, toc_nesting);
+                streaming = (entry == NULL);
+            }
 
-                markdown = hoedown_markdown_new(extensions, 16,
-                                                &callbacks, &options);
+            if (params->compress) {
+                vary = 1;
+                /* streamed page is sent as it is rendered */
+                if (!streaming) {
+                    encoding = compress_negotiate(
+                        MHD_lookup_connection_value(connection,
+                                                    MHD_HEADER_KIND,
+                                                    "Accept-Encoding"));
+                }
+            }
 
-                hoedown_markdown_render(toc_ob, ib->data, ib->size, markdown);
-                hoedown_markdown_free(markdown);
+            /* validators cover the render flags, toc and style file */
+            style = style_get();
+            snprintf(etag, sizeof(etag), "\"%lx-%lx-%lx-%llx-%08x%s%s\"",
+                     (unsigned long)statbuf.st_ino,
+                     (unsigned long)statbuf.st_mtime,
+                     (unsigned long)statbuf.st_mtim.tv_nsec,
+                     (unsigned long long)statbuf.st_size,
+                     cache_hash(key) ^ style->version,
+                     encoding ? "-" : "",
+                     encoding ? compress_name(encoding) : "");
+            last_modified = statbuf.st_mtime;
+            if (style->mtime > last_modified) {
+                last_modified = style->mtime;
             }
+            style_release(style);
 
-            /* contents */
-            ob = hoedown_buffer_new(HOEDOWN_OUTPUT_UNIT);
+            max_age = params->markdown_max_age;
+            if (http_not_modified(connection, etag, last_modified)) {
+                if (entry) {
+                    cache_release(entry);
+                }
+                request_queued(request, MHD_HTTP_NOT_MODIFIED,
+                               content_type, 0);
+                return http_queue_not_modified(connection, etag,
+                                               last_modified, max_age);
+            }
 
-            hoedown_html_renderer(&callbacks, &options, 0, 0);
+            if (streaming) {
+                markdown_stream_t *page;
 
-            //options.flags = HOEDOWN_HTML_USE_XHTML | HOEDOWN_HTML_SKIP_EOL;
-            //options.flags |= HOEDOWN_HTML_TOC;
-            options.flags = html;
-            options.toc_data.starting_level = toc_starting;
-            options.toc_data.nesting_level = toc_nesting;
+                page = (markdown_stream_t *)malloc(sizeof(markdown_stream_t));
+                if (page == NULL) {
+                    return MHD_NO;
+                }
+                page->params = params;
+                page->st = statbuf;
+                page->toc_starting = toc_starting;
+                page->toc_nesting = toc_nesting;
+                snprintf(page->filepath, sizeof(page->filepath), "%s",
+                         filepath);
+                snprintf(page->key, sizeof(page->key), "%s", key);
+
+                response = stream_response(connection, script,
+                                           &markdown_stream, page);
+                if (response == NULL) {
+                    return MHD_NO;
+                }
+                length = 0;
+            } else {
+                if (entry == NULL) {
+                    entry = markdown_entry(params, request, filepath,
+                                           &statbuf, key,
+                                           toc_starting, toc_nesting);
+                }
+                if (entry == NULL) {
+                    return MHD_NO;
+                }
 
-            markdown = hoedown_markdown_new(extensions, 16,
-                                            &callbacks, &options);
+                contents = page_contents(params, request, entry, key,
+                                         script, &encoding);
+                if (contents == NULL) {
+                    return MHD_NO;
+                }
 
-            hoedown_markdown_render(ob, ib->data, ib->size, markdown);
-            hoedown_markdown_free(markdown);
+                length = contents->length;
+                response = contents_response(contents);
+                if (response == NULL) {
+                    return MHD_NO;
+                }
+            }
+        } else {
+            /* static file, sent with sendfile by libmicrohttpd */
+            struct stat *sendbuf = &statbuf, gzbuf;
+            char sendpath[PATH_MAX+4], key[PATH_MAX+256];
+            cache_entry_t *centry;
+            http_range_t ranges[HTTP_RANGE_MAX];
+            const char *range;
+            int fd, nranges = -1;
+
+            range = MHD_lookup_connection_value(connection, MHD_HEADER_KIND,
+                                                "Range");
+
+            if (params->compress && compress_type(content_type)) {
+                vary = 1;
+                /* ranges are served from the identity representation */
+                if (!range) {
+                    encoding = compress_negotiate(
+                        MHD_lookup_connection_value(connection,
+                                                    MHD_HEADER_KIND,
+                                                    "Accept-Encoding"));
+                }
+            }
 
-            if (toc_ob) {
-                content = contents_generate(&content_length,
-                                            ob->data, ob->size,
-                                            toc_ob->data, toc_ob->size,
-                                            params->style_file);
-                hoedown_buffer_free(toc_ob);
+            /* pre-compressed file.ext.gz sibling */
+            snprintf(sendpath, sizeof(sendpath), "%s.gz", filepath);
+            if (encoding == COMPRESS_GZIP
+                && stat(sendpath, &gzbuf) == 0 && S_ISREG(gzbuf.st_mode)
+                && gzbuf.st_mtime >= statbuf.st_mtime) {
+                sendbuf = &gzbuf;
             } else {
-                content = contents_generate(&content_length,
-                                            ob->data, ob->size,
-                                            NULL, 0,
-                                            params->style_file);
+                snprintf(sendpath, sizeof(sendpath), "%s", filepath);
+                if (encoding
+                    && ((size_t)statbuf.st_size < params->compress_min
+                        || statbuf.st_size > COMPRESS_MAX_SIZE)) {
+                    encoding = COMPRESS_IDENTITY;
+                }
             }
 
-            hoedown_buffer_free(ob);
-            hoedown_buffer_free(ib);
+            snprintf(etag, sizeof(etag), "\"%lx-%lx-%lx-%llx%s%s\"",
+                     (unsigned long)sendbuf->st_ino,
+                     (unsigned long)sendbuf->st_mtime,
+                     (unsigned long)sendbuf->st_mtim.tv_nsec,
+                     (unsigned long long)sendbuf->st_size,
+                     encoding ? "-" : "",
+                     encoding ? compress_name(encoding) : "");
+            last_modified = statbuf.st_mtime;
+
+            max_age = params->static_max_age;
+            if (http_not_modified(connection, etag, last_modified)) {
+                request_queued(request, MHD_HTTP_NOT_MODIFIED,
+                               content_type, 0);
+                return http_queue_not_modified(connection, etag,
+                                               last_modified, max_age);
+            }
 
-            if (content == NULL) {
-                return MHD_NO;
+            if (encoding && sendbuf == &statbuf) {
+                /* compressed on the fly and cached */
+                snprintf(key, sizeof(key), "%s|%s|%ld.%09ld|%lu|%lld",
+                         compress_name(encoding), filepath,
+                         (long)statbuf.st_mtim.tv_sec,
+                         (long)statbuf.st_mtim.tv_nsec,
+                         (unsigned long)statbuf.st_ino,
+                         (long long)statbuf.st_size);
+                clock_gettime(CLOCK_MONOTONIC, &phase);
+                centry = compress_file(params->cache, key, filepath,
+                                       statbuf.st_size, encoding);
+                request->phase[METRICS_COMPRESS] = metrics_elapsed(&phase);
+                if (centry) {
+                    length = centry->size;
+                    contents = contents_buffer(centry->data, centry->size,
+                                               centry);
+                    if (contents == NULL) {
+                        return MHD_NO;
+                    }
+
+                    response = contents_response(contents);
+                    if (response == NULL) {
+                        return MHD_NO;
+                    }
+                } else {
+                    encoding = COMPRESS_IDENTITY;
+                    snprintf(etag, sizeof(etag), "\"%lx-%lx-%lx-%llx\"",
+                             (unsigned long)statbuf.st_ino,
+                             (unsigned long)statbuf.st_mtime,
+                             (unsigned long)statbuf.st_mtim.tv_nsec,
+                             (unsigned long long)statbuf.st_size);
+                }
             }
 
-            response = MHD_create_response_from_buffer(content_length, content,
-                                                       MHD_RESPMEM_MUST_FREE);
-            if (response == NULL) {
-                free(content);
-                return MHD_NO;
+            if (range && !encoding
+                && http_if_range(connection, etag, last_modified)) {
+                nranges = http_range_parse(range, statbuf.st_size,
+                                           ranges, HTTP_RANGE_MAX);
+                if (nranges == 0) {
+                    request_queued(request, MHD_HTTP_RANGE_NOT_SATISFIABLE,
+                                   content_type, 0);
+                    return http_queue_range_not_satisfiable(connection,
+                                                            statbuf.st_size);
+                }
             }
-        }
 
-        if (file) {
-            response = MHD_create_response_from_callback(statbuf.st_size,
-                                                         BLOCK_SIZE,
-                                                         &file_output_cb,
-                                                         file,
-                                                         &file_destroy_cb);
-            if (response == NULL) {
-                fclose(file);
-                return MHD_NO;
+            if (!encoding || sendbuf != &statbuf) {
+                clock_gettime(CLOCK_MONOTONIC, &phase);
+                fd = file_open(params->files, sendpath, sendbuf);
+                if (fd == -1) {
+                    return MHD_NO;
+                }
+                request->phase[METRICS_READ] = metrics_elapsed(&phase);
+
+                length = sendbuf->st_size;
+                if (nranges >= 1) {
+                    for (length = 0, i = 0; i < nranges; i++) {
+                        length += ranges[i].length;
+                    }
+                }
+
+                if (nranges == 1) {
+                    response = file_range_response(fd, statbuf.st_size,
+                                                   ranges);
+                    status = MHD_HTTP_PARTIAL_CONTENT;
+                } else if (nranges > 1) {
+                    response = file_ranges_response(fd, statbuf.st_size,
+                                                    ranges, nranges,
+                                                    content_type,
+                                                    &content_type);
+                    status = MHD_HTTP_PARTIAL_CONTENT;
+                } else {
+                    response = MHD_create_response_from_fd(sendbuf->st_size,
+                                                           fd);
+                }
+                if (response == NULL) {
+                    close(fd);
+                    return MHD_NO;
+                }
+                if (!encoding) {
+                    MHD_add_response_header(response, "Accept-Ranges",
+                                            "bytes");
+                }
             }
         }
     }
@@ -432,7 +1365,25 @@ response_cb(void *cls, struct MHD_Connection *connection, const char *url,
     MHD_add_response_header(response, "Content-Type", content_type);
     /* MHD_add_response_header(response, "Content-Length", len); */
 
-    ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
+    if (encoding) {
+        MHD_add_response_header(response, "Content-Encoding",
+                                compress_name(encoding));
+    }
+    if (vary) {
+        MHD_add_response_header(response, "Vary", "Accept-Encoding");
+    }
+
+    if (*etag) {
+        http_validators(response, etag, last_modified, max_age);
+    }
+
+    if (params->server_timing) {
+        request_server_timing(request, response);
+    }
+
+    request_queued(request, status, content_type, length);
+
+    ret = MHD_queue_response(connection, status, response);
     MHD_destroy_response(response);
 
     return ret;
@@ -441,6 +1392,10 @@ response_cb(void *cls, struct MHD_Connection *connection, const char *url,
 static void
 signal_handler(int sig)
 {
+    if (sig == SIGUSR1) {
+        access_log_reopen();
+        return;
+    }
     interrupted = 1;
 }
 
@@ -454,6 +1409,183 @@ signals(void)
     sigemptyset(&sa.sa_mask);
     sigaction(SIGINT, &sa, NULL);
     sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGUSR1, &sa, NULL);
+}
+
+static void
+supervisor_signal_handler(int sig)
+{
+    if (sig == SIGUSR1) {
+        supervisor_reopen = 1;
+        return;
+    }
+    interrupted = 1;
+}
+
+static pid_t
+workers_spawn(int *worker, int i)
+{
+    struct sigaction sa;
+    pid_t pid, supervisor = getpid();
+
+    pid = fork();
+    if (pid != 0) {
+        return pid;
+    }
+
+    sa.sa_handler = SIG_DFL;
+    sa.sa_flags = 0;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    /* a log reopen before the worker is up */
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGUSR1, &sa, NULL);
+
+#ifdef HAVE_SYS_PRCTL_H
+    /* do not outlive a killed supervisor */
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() != supervisor) {
+        _exit(0);
+    }
+#endif
+
+    *worker = i;
+
+    return 0;
+}
+
+/*
+ * forks the workers and restarts the ones that die until SIGTERM,
+ * returns 0 in a worker, 1 in the stopped supervisor and -1 on error.
+ */
+static int
+workers_run(int workers, int *worker)
+{
+    struct sigaction sa;
+    pid_t *pids, pid;
+    time_t *started, *restart, now;
+    int i, status;
+
+    pids = (pid_t *)calloc(workers, sizeof(pid_t));
+    started = (time_t *)calloc(workers, sizeof(time_t));
+    restart = (time_t *)calloc(workers, sizeof(time_t));
+    if (!pids || !started || !restart) {
+        free(pids);
+        free(started);
+        free(restart);
+        return -1;
+    }
+
+    sa.sa_handler = supervisor_signal_handler;
+    sa.sa_flags = 0;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGUSR1, &sa, NULL);
+
+    while (!interrupted) {
+        now = time(NULL);
+        for (i = 0; i < workers; i++) {
+            if (pids[i] > 0 || now < restart[i]) {
+                continue;
+            }
+            pid = workers_spawn(worker, i);
+            if (pid == 0) {
+                free(pids);
+                free(started);
+                free(restart);
+                return 0;
+            } else if (pid < 0) {
+                msg_error("ERROR: Failed to fork worker %d\n", i);
+                restart[i] = now + WORKERS_RESPAWN;
+            } else {
+                msg_verbose("Worker=[%d %d]\n", i, pid);
+                pids[i] = pid;
+                started[i] = now;
+            }
+        }
+
+        if (supervisor_reopen) {
+            supervisor_reopen = 0;
+            for (i = 0; i < workers; i++) {
+                if (pids[i] > 0) {
+                    kill(pids[i], SIGUSR1);
+                }
+            }
+        }
+
+        pid = waitpid(-1, &status, WNOHANG);
+        if (pid <= 0) {
+            sleep(1);
+            continue;
+        }
+
+        for (i = 0; i < workers; i++) {
+            if (pids[i] == pid) {
+                break;
+            }
+        }
+        if (i == workers) {
+            continue;
+        }
+
+        if (WIFSIGNALED(status)) {
+            msg_error("ERROR: Worker %d [%d] killed by signal %d\n",
+                      i, pid, WTERMSIG(status));
+        } else {
+            msg_error("ERROR: Worker %d [%d] exited with status %d\n",
+                      i, pid, WEXITSTATUS(status));
+        }
+        pids[i] = 0;
+
+        /* keep a worker failing at startup from spinning */
+        now = time(NULL);
+        if (now - started[i] < WORKERS_RESPAWN) {
+            restart[i] = now + WORKERS_RESPAWN;
+        }
+    }
+
+    for (i = 0; i < workers; i++) {
+        if (pids[i] > 0) {
+            kill(pids[i], SIGTERM);
+        }
+    }
+    while (waitpid(-1, &status, 0) > 0 || errno == EINTR) {
+        ;
+    }
+
+    free(pids);
+    free(started);
+    free(restart);
+
+    return 1;
+}
+
+static size_t
+parse_size(const char *arg)
+{
+    char *end = NULL;
+    unsigned long long size = strtoull(arg, &end, 10);
+
+    if (end) {
+        switch (*end) {
+            case 'g':
+            case 'G':
+                size *= 1024;
+                /* fall through */
+            case 'm':
+            case 'M':
+                size *= 1024;
+                /* fall through */
+            case 'k':
+            case 'K':
+                size *= 1024;
+                break;
+        }
+    }
+
+    return (size_t)size;
 }
 
 static void
@@ -472,6 +1604,52 @@ usage(char *arg, char *message)
     printf("  -d, --directory=NAME    directory index file name [DEFAULT: %s]\n",
            DEFAULT_DIRECTORY_INDEX);
     printf("  -s, --style=FILE        style file\n");
+    printf("  --mime-types=FILE       additional mime.types file\n");
+    printf("  -m, --cache-size=SIZE   render cache memory size [DEFAULT: %dM]\n",
+           DEFAULT_CACHE_SIZE / (1024 * 1024));
+    printf("  --cache-file=FILE       rendered pages kept across restarts\n");
+    printf("  -o, --open-file-cache=NUM\n"
+           "                          open static file descriptors cache"
+           " [DEFAULT: %d]\n", DEFAULT_OPEN_FILE_CACHE);
+
+    printf("  --path-cache=NUM        resolved url cache, invalidated by inotify"
+           " [DEFAULT: %d]\n", DEFAULT_PATH_CACHE);
+    printf("  --listing               list directories without an index file\n");
+    printf("  --live                  push changed blocks of previewed pages"
+           " on save\n");
+    printf("  --export=DIR            write the rendered site to DIR and exit,"
+           " -z adds .gz\n");
+
+    printf("  -e, --event=TYPE        event backend [select|poll|epoll]"
+           " [DEFAULT: %s]\n", DEFAULT_EVENT);
+    printf("  -t, --threads=NUM       worker thread pool size, 0 is cpu count"
+           " [DEFAULT: %d]\n", DEFAULT_THREADS);
+    printf("  --workers=NUM           worker processes sharing the port"
+           " and render cache\n");
+    printf("  -l, --connection-limit=NUM\n"
+           "                          maximum concurrent connections\n");
+    printf("  -L, --ip-connection-limit=NUM\n"
+           "                          maximum concurrent connections per IP\n");
+    printf("  -T, --timeout=SEC       idle connection timeout\n");
+    printf("  -z, --compress          gzip/deflate compression of text\n");
+    printf("  --compress-min-length=SIZE\n"
+           "                          smallest response to compress"
+           " [DEFAULT: %d]\n", DEFAULT_COMPRESS_MIN);
+    printf("  --static-max-age=SEC    Cache-Control max-age of static files\n");
+    printf("  --markdown-max-age=SEC  Cache-Control max-age of markdown\n");
+    printf("  --prewarm               render all markdown into the cache"
+           " at startup\n");
+    printf("  --metrics               serve prometheus metrics at %s\n",
+           METRICS_URL);
+    printf("  --server-timing         add a Server-Timing response header\n");
+    printf("  --slow-request=MSEC     log requests slower than MSEC\n");
+    printf("  --stream-min=SIZE       stream uncached markdown of SIZE"
+           " or more\n");
+    printf("  --access-log=FILE       access log file, - or %s\n",
+           ACCESS_LOG_SYSLOG);
+    printf("  --access-log-format=FORMAT\n"
+           "                          access log format [common|json]"
+           " [DEFAULT: common]\n");
 
     printf("  -D, --daemonize=COMMAND daemon command [start|stop]\n");
     printf("  -P, --pidfile=FILE      daemon pid file path [DEFAULT: %s]\n",
@@ -499,7 +1677,29 @@ main(int argc, char **argv)
     struct stat statbuf;
 
     response_params_t params = { DEFAULT_ROOTDIR, DEFAULT_DIRECTORY_INDEX,
-                                 NULL, 0, 0 };
+                                 NULL, 0, 0, NULL, NULL, NULL, NULL, NULL,
+                                 NULL, -1, -1, 0, DEFAULT_COMPRESS_MIN, 0, 0,
+                                 0, 0, 0, NULL, NULL };
+    size_t cache_size = DEFAULT_CACHE_SIZE;
+    int open_file_cache = DEFAULT_OPEN_FILE_CACHE;
+    int path_cache = DEFAULT_PATH_CACHE;
+    char *mime_types = NULL;
+    char *access_log = NULL;
+    char *cache_file = NULL;
+    char *export_dir = NULL;
+    int access_log_format = ACCESS_LOG_COMMON;
+
+    char *event = DEFAULT_EVENT;
+    unsigned int flags = MHD_USE_SELECT_INTERNALLY;
+    int threads = DEFAULT_THREADS;
+    int workers = 0, worker = 0;
+    int connection_limit = 0, ip_connection_limit = 0, timeout = 0;
+    struct MHD_OptionItem mhd_opts[8];
+    int mhd_opts_count = 0;
+    int prewarm = 0;
+    int listing = 0;
+    int live = 0;
+    prewarm_t prewarm_ctx;
 
     char *daemonize = NULL;
     char *pidfile = DEFAULT_PIDFILE;
@@ -510,6 +1710,31 @@ main(int argc, char **argv)
         { "rootdir", 1, NULL, 'r' },
         { "directory", 1, NULL, 'd' },
         { "style", 1, NULL, 's' },
+        { "mime-types", 1, NULL, OPT_MIME_TYPES },
+        { "cache-size", 1, NULL, 'm' },
+        { "cache-file", 1, NULL, OPT_CACHE_FILE },
+        { "open-file-cache", 1, NULL, 'o' },
+        { "path-cache", 1, NULL, OPT_PATH_CACHE },
+        { "listing", 0, NULL, OPT_LISTING },
+        { "live", 0, NULL, OPT_LIVE },
+        { "export", 1, NULL, OPT_EXPORT },
+        { "event", 1, NULL, 'e' },
+        { "threads", 1, NULL, 't' },
+        { "workers", 1, NULL, OPT_WORKERS },
+        { "connection-limit", 1, NULL, 'l' },
+        { "ip-connection-limit", 1, NULL, 'L' },
+        { "timeout", 1, NULL, 'T' },
+        { "compress", 0, NULL, 'z' },
+        { "compress-min-length", 1, NULL, OPT_COMPRESS_MIN_LENGTH },
+        { "static-max-age", 1, NULL, OPT_STATIC_MAX_AGE },
+        { "markdown-max-age", 1, NULL, OPT_MARKDOWN_MAX_AGE },
+        { "prewarm", 0, NULL, OPT_PREWARM },
+        { "metrics", 0, NULL, OPT_METRICS },
+        { "server-timing", 0, NULL, OPT_SERVER_TIMING },
+        { "slow-request", 1, NULL, OPT_SLOW_REQUEST },
+        { "stream-min", 1, NULL, OPT_STREAM_MIN },
+        { "access-log", 1, NULL, OPT_ACCESS_LOG },
+        { "access-log-format", 1, NULL, OPT_ACCESS_LOG_FORMAT },
         { "daemonize", 1, NULL, 'D' },
         { "pidfile", 1, NULL, 'P' },
         { "verbose", 1, NULL, 'v' },
@@ -547,7 +1772,7 @@ main(int argc, char **argv)
 
     int i, opts_count = 27;
 
-    while ((opt = getopt_long(argc, argv, "p:r:d:s:D:P:EHvqVh",
+    while ((opt = getopt_long(argc, argv, "p:r:d:s:m:o:e:t:l:L:T:zD:P:EHvqVh",
                               long_options, NULL)) != -1) {
         switch (opt) {
             case 'p':
@@ -562,6 +1787,88 @@ main(int argc, char **argv)
             case 's':
                 params.style_file = optarg;
                 break;
+            case OPT_MIME_TYPES:
+                mime_types = optarg;
+                break;
+            case 'm':
+                cache_size = parse_size(optarg);
+                break;
+            case OPT_CACHE_FILE:
+                cache_file = optarg;
+                break;
+            case 'o':
+                open_file_cache = atoi(optarg);
+                break;
+            case OPT_PATH_CACHE:
+                path_cache = atoi(optarg);
+                break;
+            case OPT_LISTING:
+                listing = 1;
+                break;
+            case OPT_LIVE:
+                live = 1;
+                break;
+            case OPT_EXPORT:
+                export_dir = optarg;
+                break;
+            case 'e':
+                event = optarg;
+                break;
+            case 't':
+                threads = atoi(optarg);
+                break;
+            case OPT_WORKERS:
+                workers = atoi(optarg);
+                break;
+            case 'l':
+                connection_limit = atoi(optarg);
+                break;
+            case 'L':
+                ip_connection_limit = atoi(optarg);
+                break;
+            case 'T':
+                timeout = atoi(optarg);
+                break;
+            case 'z':
+                params.compress = 1;
+                break;
+            case OPT_COMPRESS_MIN_LENGTH:
+                params.compress_min = parse_size(optarg);
+                break;
+            case OPT_STATIC_MAX_AGE:
+                params.static_max_age = atoi(optarg);
+                break;
+            case OPT_MARKDOWN_MAX_AGE:
+                params.markdown_max_age = atoi(optarg);
+                break;
+            case OPT_PREWARM:
+                prewarm = 1;
+                break;
+            case OPT_METRICS:
+                params.metrics = 1;
+                break;
+            case OPT_SERVER_TIMING:
+                params.server_timing = 1;
+                break;
+            case OPT_SLOW_REQUEST:
+                params.slow_request = atof(optarg);
+                break;
+            case OPT_STREAM_MIN:
+                params.stream_min = parse_size(optarg);
+                break;
+            case OPT_ACCESS_LOG:
+                access_log = optarg;
+                break;
+            case OPT_ACCESS_LOG_FORMAT:
+                if (strcasecmp(optarg, "json") == 0) {
+                    access_log_format = ACCESS_LOG_JSON;
+                } else if (strcasecmp(optarg, "common") == 0) {
+                    access_log_format = ACCESS_LOG_COMMON;
+                } else {
+                    usage(argv[0], "unknown access log format");
+                    return -1;
+                }
+                break;
             case 'D':
                 daemonize = optarg;
                 break;
@@ -613,6 +1920,28 @@ main(int argc, char **argv)
         return -1;
     }
 
+    if (strcasecmp(event, "epoll") == 0) {
+#if MHD_VERSION >= 0x00095300
+        flags |= MHD_USE_EPOLL;
+#else
+        flags |= MHD_USE_EPOLL_LINUX_ONLY;
+#endif
+    } else if (strcasecmp(event, "poll") == 0) {
+        flags |= MHD_USE_POLL;
+    } else if (strcasecmp(event, "select") != 0) {
+        usage(argv[0], "unknown event backend");
+        return -1;
+    }
+    msg_verbose_ex(2, "Event=[%s]\n", event);
+
+    if (threads <= 0) {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+        if (threads <= 0) {
+            threads = 1;
+        }
+    }
+    msg_verbose_ex(2, "Threads=[%d]\n", threads);
+
     if (stat(params.root_dir, &statbuf) != 0) {
         msg_error("ERROR: No such document root directory: %s\n",
                   params.root_dir);
@@ -628,6 +1957,29 @@ main(int argc, char **argv)
     }
     msg_verbose_ex(2, "StyleFile=[%s]\n", params.style_file);
 
+    if (style_init(params.style_file) != 0) {
+        msg_error("ERROR: Failed to load style file: %s\n", params.style_file);
+        return -1;
+    }
+
+    if (mime_init(mime_types) != 0) {
+        msg_error("ERROR: Failed to load mime types file: %s\n", mime_types);
+        style_cleanup();
+        return -1;
+    }
+    msg_verbose_ex(2, "MimeTypes=[%s]\n", mime_types);
+
+    /* render once on every cpu, no server */
+    if (export_dir) {
+        int ret;
+
+        msg_verbose_ex(2, "Export=[%s]\n", export_dir);
+        ret = export_tree(&params, export_dir);
+        mime_cleanup();
+        style_cleanup();
+        return ret;
+    }
+
     /* daemonize */
     if (daemonize) {
         if (!pidfile || strlen(pidfile) <= 0) {
@@ -682,14 +2034,204 @@ main(int argc, char **argv)
         }
     }
 
-    mhd = MHD_start_daemon(MHD_USE_SELECT_INTERNALLY, port, NULL, NULL,
-                           &response_cb, &params, MHD_OPTION_END);
+    /* fork before any thread is started */
+    if (workers > 0) {
+#if MHD_VERSION >= 0x00094200
+        int ret;
+
+        if (cache_size > 0) {
+            params.shared = shared_cache_new(cache_size);
+            if (params.shared == NULL) {
+                msg_error("ERROR: Failed to allocate shared render cache\n");
+            }
+        }
+
+        ret = workers_run(workers, &worker);
+        if (ret != 0) {
+            if (ret < 0) {
+                msg_error("ERROR: Failed to start workers\n");
+            }
+            shared_cache_free(params.shared);
+            mime_cleanup();
+            style_cleanup();
+            return ret < 0 ? -1 : 0;
+        }
+
+        mhd_opts[mhd_opts_count++] = (struct MHD_OptionItem){
+            MHD_OPTION_LISTENING_ADDRESS_REUSE, 1, NULL };
+
+        /* one warm-up fills the shared cache */
+        if (worker > 0) {
+            prewarm = 0;
+        }
+#else
+        msg_error("ERROR: Workers require libmicrohttpd 0.9.42 or later\n");
+        workers = 0;
+#endif
+    }
+    msg_verbose_ex(2, "Workers=[%d]\n", workers);
+
+    if (access_log) {
+        if (access_log_open(access_log, access_log_format) != 0) {
+            msg_error("ERROR: Failed to open access log: %s\n", access_log);
+            mime_cleanup();
+            style_cleanup();
+            return -1;
+        }
+        params.access_log = 1;
+    }
+    msg_verbose_ex(2, "AccessLog=[%s]\n", access_log);
+
+    if (cache_file) {
+        char path[PATH_MAX];
+
+        /* a file is written by a single process */
+        if (workers > 0) {
+            snprintf(path, sizeof(path), "%s.%d", cache_file, worker);
+        } else {
+            snprintf(path, sizeof(path), "%s", cache_file);
+        }
+        params.store = store_open(path);
+        if (params.store == NULL) {
+            msg_error("ERROR: Failed to open cache file: %s\n", path);
+        }
+        msg_verbose_ex(2, "CacheFile=[%s]\n", path);
+    }
+
+    if (cache_size > 0) {
+        params.cache = cache_new(cache_size, 0, NULL);
+        if (params.cache == NULL) {
+            msg_error("ERROR: Failed to allocate render cache\n");
+            return -1;
+        }
+    }
+    msg_verbose_ex(2, "CacheSize=[%zu]\n", cache_size);
+
+    if (open_file_cache > 0) {
+        params.files = file_cache_new(open_file_cache);
+        if (params.files == NULL) {
+            msg_error("ERROR: Failed to allocate open file cache\n");
+            cache_free(params.cache);
+            return -1;
+        }
+    }
+    msg_verbose_ex(2, "OpenFileCache=[%d]\n", open_file_cache);
+
+    if (live) {
+        params.live = live_new(params.extensions, params.html);
+        if (params.live == NULL) {
+            msg_error("ERROR: Failed to start live preview\n");
+        }
+    }
+
+    if (path_cache > 0 || params.live) {
+        params.watch = watch_new(params.root_dir,
+                                 params.live ? &live_changed : NULL,
+                                 params.live);
+        if (params.watch == NULL) {
+            msg_error("ERROR: Failed to watch document root: %s\n",
+                      params.root_dir);
+            live_free(params.live);
+            params.live = NULL;
+        } else if (path_cache > 0) {
+            params.paths = path_cache_new(path_cache);
+        }
+    }
+    msg_verbose_ex(2, "PathCache=[%d]\n", params.paths ? path_cache : 0);
+
+    /* pages carry the block marks the preview patches */
+    if (params.live) {
+        render_block_marks(1);
+    }
+    msg_verbose_ex(2, "Live=[%d]\n", params.live ? 1 : 0);
+
+    /* streamed pages are rendered by one thread per cpu */
+    if (params.stream_min > 0) {
+        int stream_threads = sysconf(_SC_NPROCESSORS_ONLN);
+        if (stream_threads <= 0) {
+            stream_threads = 1;
+        }
+        if (stream_init(stream_threads) != 0) {
+            msg_error("ERROR: Failed to start stream threads\n");
+            params.stream_min = 0;
+        }
+    }
+
+    /* idle live and streamed connections are suspended */
+    if (params.live || params.stream_min > 0) {
+#if MHD_VERSION >= 0x00095400
+        flags |= MHD_ALLOW_SUSPEND_RESUME;
+#else
+        flags |= MHD_USE_SUSPEND_RESUME;
+#endif
+    }
+
+    if (listing) {
+        params.listings = listing_cache_new(DEFAULT_LISTING_CACHE);
+        if (params.listings == NULL) {
+            msg_error("ERROR: Failed to allocate listing cache\n");
+        }
+    }
+
+    metrics_cache("render", params.cache);
+    metrics_cache("file", params.files);
+    metrics_cache("path", params.paths);
+    metrics_cache("listing", params.listings);
+
+    mhd_opts[mhd_opts_count++] = (struct MHD_OptionItem){
+        MHD_OPTION_NOTIFY_COMPLETED, (intptr_t)&completed_cb, &params };
+    if (threads > 1) {
+        mhd_opts[mhd_opts_count++] = (struct MHD_OptionItem){
+            MHD_OPTION_THREAD_POOL_SIZE, threads, NULL };
+    }
+    if (connection_limit > 0) {
+        mhd_opts[mhd_opts_count++] = (struct MHD_OptionItem){
+            MHD_OPTION_CONNECTION_LIMIT, connection_limit, NULL };
+    }
+    if (ip_connection_limit > 0) {
+        mhd_opts[mhd_opts_count++] = (struct MHD_OptionItem){
+            MHD_OPTION_PER_IP_CONNECTION_LIMIT, ip_connection_limit, NULL };
+    }
+    if (timeout > 0) {
+        mhd_opts[mhd_opts_count++] = (struct MHD_OptionItem){
+            MHD_OPTION_CONNECTION_TIMEOUT, timeout, NULL };
+    }
+    mhd_opts[mhd_opts_count] = (struct MHD_OptionItem){
+        MHD_OPTION_END, 0, NULL };
+
+    mhd = MHD_start_daemon(flags, port, NULL, NULL,
+                           &response_cb, &params,
+                           MHD_OPTION_ARRAY, mhd_opts, MHD_OPTION_END);
     if (mhd == NULL) {
+        stream_cleanup();
+        access_log_close();
+        watch_free(params.watch);
+        live_free(params.live);
+        cache_free(params.paths);
+        cache_free(params.listings);
+        cache_free(params.files);
+        cache_free(params.cache);
+        shared_cache_free(params.shared);
+        store_close(params.store);
+        mime_cleanup();
+        style_cleanup();
         return -1;
     }
 
     msg_verbose("Starting server [%d] ...\n", port);
 
+    /* warm up in the background, requests are served meanwhile */
+    if (prewarm) {
+        memset(&prewarm_ctx, 0, sizeof(prewarm_ctx));
+        if (params.cache == NULL) {
+            msg_error("ERROR: Prewarm requires the render cache\n");
+            prewarm = 0;
+        } else if (prewarm_start(&prewarm_ctx, &params) != 0) {
+            msg_error("ERROR: Failed to start prewarm\n");
+            prewarm = 0;
+        }
+    }
+
     signals();
     while (!interrupted) {
         sleep(300);
@@ -697,7 +2239,29 @@ main(int argc, char **argv)
 
     msg_verbose("\nFinished\n");
 
+    if (prewarm) {
+        prewarm_stop(&prewarm_ctx);
+    }
+
+    live_stop(params.live);
+    stream_stop();
     MHD_stop_daemon(mhd);
+    stream_cleanup();
+    access_log_close();
+
+    if (notfound) {
+        MHD_destroy_response(notfound);
+    }
+    watch_free(params.watch);
+    live_free(params.live);
+    cache_free(params.paths);
+    cache_free(params.listings);
+    cache_free(params.files);
+    cache_free(params.cache);
+    shared_cache_free(params.shared);
+    store_close(params.store);
+    mime_cleanup();
+    style_cleanup();
 
     return 0;
 }
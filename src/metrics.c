@@ -0,0 +1,280 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "metrics.h"
+
+#define METRICS_TYPES 32
+#define METRICS_TYPE_SIZE 64
+#define METRICS_CACHES 8
+
+#define metrics_add(_var, _n) __atomic_fetch_add(&(_var), _n, __ATOMIC_RELAXED)
+#define metrics_load(_var) __atomic_load_n(&(_var), __ATOMIC_RELAXED)
+
+/* histogram upper bounds in milliseconds, the last bucket is +Inf */
+static const double metrics_buckets[] = {
+    0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 25, 50, 100, 250, 500, 1000, 2500
+};
+#define METRICS_BUCKETS (sizeof(metrics_buckets) / sizeof(double) + 1)
+
+typedef struct metrics_histogram {
+    uint64_t bucket[METRICS_BUCKETS];
+    uint64_t sum; /* usec */
+} metrics_histogram_t;
+
+static const unsigned int metrics_status[] = {
+    200, 206, 304, 404, 416, 500, 0
+};
+#define METRICS_STATUS (sizeof(metrics_status) / sizeof(unsigned int))
+
+/* content types are added on first use and never removed */
+typedef struct metrics_type {
+    int state; /* 0: free, 1: claimed, 2: ready */
+    char name[METRICS_TYPE_SIZE];
+    uint64_t requests[METRICS_STATUS];
+    uint64_t bytes;
+} metrics_type_t;
+
+static metrics_histogram_t metrics_phases[METRICS_PHASE_MAX];
+static metrics_type_t metrics_types[METRICS_TYPES];
+static uint64_t metrics_overflow = 0;
+
+static struct {
+    const char *name;
+    cache_t *cache;
+} metrics_caches[METRICS_CACHES];
+static int metrics_ncaches = 0;
+
+static const char *metrics_phase_names[METRICS_PHASE_MAX] = {
+    "resolve", "read", "render", "assemble", "compress", "send", "total"
+};
+
+double
+metrics_elapsed(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - start->tv_sec) * 1000.0
+        + (now.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+const char *
+metrics_phase_name(int phase)
+{
+    return metrics_phase_names[phase];
+}
+
+void
+metrics_phase(int phase, double msec)
+{
+    metrics_histogram_t *histogram = &metrics_phases[phase];
+    size_t i;
+
+    for (i = 0; i < METRICS_BUCKETS - 1; i++) {
+        if (msec <= metrics_buckets[i]) {
+            break;
+        }
+    }
+
+    metrics_add(histogram->bucket[i], 1);
+    metrics_add(histogram->sum, (uint64_t)(msec * 1000.0));
+}
+
+static metrics_type_t *
+metrics_type(const char *content_type)
+{
+    char name[METRICS_TYPE_SIZE];
+    metrics_type_t *type;
+    size_t len;
+    int i, state;
+
+    /* without parameters: text/html; charset=UTF-8 is text/html */
+    len = strcspn(content_type, ";");
+    while (len > 0 && content_type[len-1] == ' ') {
+        len--;
+    }
+    if (len >= sizeof(name)) {
+        len = sizeof(name) - 1;
+    }
+    memcpy(name, content_type, len);
+    name[len] = '\0';
+
+    for (i = 0; i < METRICS_TYPES; i++) {
+        type = &metrics_types[i];
+
+        state = __atomic_load_n(&type->state, __ATOMIC_ACQUIRE);
+        if (state == 0) {
+            int expected = 0;
+            if (__atomic_compare_exchange_n(&type->state, &expected, 1, 0,
+                                            __ATOMIC_ACQ_REL,
+                                            __ATOMIC_ACQUIRE)) {
+                memcpy(type->name, name, len + 1);
+                __atomic_store_n(&type->state, 2, __ATOMIC_RELEASE);
+                return type;
+            }
+            state = expected;
+        }
+        /* another thread is naming this slot */
+        while (state == 1) {
+            state = __atomic_load_n(&type->state, __ATOMIC_ACQUIRE);
+        }
+        if (strcmp(type->name, name) == 0) {
+            return type;
+        }
+    }
+
+    return NULL;
+}
+
+void
+metrics_request(unsigned int status, const char *content_type,
+                uint64_t bytes)
+{
+    metrics_type_t *type = metrics_type(content_type);
+    size_t i;
+
+    if (!type) {
+        metrics_add(metrics_overflow, 1);
+        return;
+    }
+
+    for (i = 0; i < METRICS_STATUS - 1; i++) {
+        if (metrics_status[i] == status) {
+            break;
+        }
+    }
+
+    metrics_add(type->requests[i], 1);
+    metrics_add(type->bytes, bytes);
+}
+
+/* called at startup, before requests are served */
+void
+metrics_cache(const char *name, cache_t *cache)
+{
+    if (cache && metrics_ncaches < METRICS_CACHES) {
+        metrics_caches[metrics_ncaches].name = name;
+        metrics_caches[metrics_ncaches].cache = cache;
+        metrics_ncaches++;
+    }
+}
+
+/* prometheus text exposition format, the caller frees the result */
+char *
+metrics_generate(size_t *size)
+{
+    cache_stats_t stats[METRICS_CACHES];
+    char *buf = NULL;
+    FILE *fp;
+    size_t i, j;
+    uint64_t n;
+    int k;
+
+    fp = open_memstream(&buf, size);
+    if (!fp) {
+        return NULL;
+    }
+
+    fprintf(fp, "# HELP mmhd_requests_total Responses by status and"
+            " content type.\n"
+            "# TYPE mmhd_requests_total counter\n");
+    for (i = 0; i < METRICS_TYPES; i++) {
+        metrics_type_t *type = &metrics_types[i];
+        if (__atomic_load_n(&type->state, __ATOMIC_ACQUIRE) != 2) {
+            continue;
+        }
+        for (j = 0; j < METRICS_STATUS; j++) {
+            n = metrics_load(type->requests[j]);
+            if (n == 0) {
+                continue;
+            }
+            if (metrics_status[j]) {
+                fprintf(fp, "mmhd_requests_total{status=\"%u\","
+                        "type=\"%s\"} %llu\n", metrics_status[j],
+                        type->name, (unsigned long long)n);
+            } else {
+                fprintf(fp, "mmhd_requests_total{status=\"other\","
+                        "type=\"%s\"} %llu\n",
+                        type->name, (unsigned long long)n);
+            }
+        }
+    }
+    n = metrics_load(metrics_overflow);
+    if (n) {
+        fprintf(fp, "mmhd_requests_total{status=\"other\","
+                "type=\"other\"} %llu\n", (unsigned long long)n);
+    }
+
+    fprintf(fp, "# HELP mmhd_response_bytes_total Response body bytes.\n"
+            "# TYPE mmhd_response_bytes_total counter\n");
+    for (i = 0; i < METRICS_TYPES; i++) {
+        metrics_type_t *type = &metrics_types[i];
+        if (__atomic_load_n(&type->state, __ATOMIC_ACQUIRE) != 2) {
+            continue;
+        }
+        fprintf(fp, "mmhd_response_bytes_total{type=\"%s\"} %llu\n",
+                type->name, (unsigned long long)metrics_load(type->bytes));
+    }
+
+    fprintf(fp, "# HELP mmhd_phase_seconds Request phase latency.\n"
+            "# TYPE mmhd_phase_seconds histogram\n");
+    for (k = 0; k < METRICS_PHASE_MAX; k++) {
+        metrics_histogram_t *histogram = &metrics_phases[k];
+        uint64_t count = 0;
+
+        for (i = 0; i < METRICS_BUCKETS; i++) {
+            count += metrics_load(histogram->bucket[i]);
+            if (i < METRICS_BUCKETS - 1) {
+                fprintf(fp, "mmhd_phase_seconds_bucket{phase=\"%s\","
+                        "le=\"%g\"} %llu\n", metrics_phase_names[k],
+                        metrics_buckets[i] / 1000.0,
+                        (unsigned long long)count);
+            } else {
+                fprintf(fp, "mmhd_phase_seconds_bucket{phase=\"%s\","
+                        "le=\"+Inf\"} %llu\n", metrics_phase_names[k],
+                        (unsigned long long)count);
+            }
+        }
+        fprintf(fp, "mmhd_phase_seconds_sum{phase=\"%s\"} %.6f\n",
+                metrics_phase_names[k],
+                metrics_load(histogram->sum) / 1000000.0);
+        fprintf(fp, "mmhd_phase_seconds_count{phase=\"%s\"} %llu\n",
+                metrics_phase_names[k], (unsigned long long)count);
+    }
+
+    for (k = 0; k < metrics_ncaches; k++) {
+        cache_stats(metrics_caches[k].cache, &stats[k]);
+    }
+
+    fprintf(fp, "# HELP mmhd_cache_lookups_total Cache lookups.\n"
+            "# TYPE mmhd_cache_lookups_total counter\n");
+    for (k = 0; k < metrics_ncaches; k++) {
+        fprintf(fp, "mmhd_cache_lookups_total{cache=\"%s\",result=\"hit\"}"
+                " %lu\n", metrics_caches[k].name, stats[k].hits);
+        fprintf(fp, "mmhd_cache_lookups_total{cache=\"%s\",result=\"miss\"}"
+                " %lu\n", metrics_caches[k].name, stats[k].misses);
+    }
+
+    fprintf(fp, "# HELP mmhd_cache_entries Cached entries.\n"
+            "# TYPE mmhd_cache_entries gauge\n");
+    for (k = 0; k < metrics_ncaches; k++) {
+        fprintf(fp, "mmhd_cache_entries{cache=\"%s\"} %zu\n",
+                metrics_caches[k].name, stats[k].count);
+    }
+
+    fprintf(fp, "# HELP mmhd_cache_bytes Cached bytes.\n"
+            "# TYPE mmhd_cache_bytes gauge\n");
+    for (k = 0; k < metrics_ncaches; k++) {
+        fprintf(fp, "mmhd_cache_bytes{cache=\"%s\"} %zu\n",
+                metrics_caches[k].name, stats[k].size);
+    }
+
+    if (fclose(fp) != 0) {
+        free(buf);
+        return NULL;
+    }
+
+    return buf;
+}
@@ -0,0 +1,33 @@
+#ifndef __MMHD_METRICS_H__
+#define __MMHD_METRICS_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "cache.h"
+
+#define METRICS_URL "/_mmhd/metrics"
+
+enum {
+    METRICS_RESOLVE = 0,
+    METRICS_READ,
+    METRICS_RENDER,
+    METRICS_ASSEMBLE,
+    METRICS_COMPRESS,
+    METRICS_SEND,
+    METRICS_TOTAL,
+    METRICS_PHASE_MAX
+};
+
+double metrics_elapsed(const struct timespec *start);
+
+void metrics_phase(int phase, double msec);
+void metrics_request(unsigned int status, const char *content_type,
+                     uint64_t bytes);
+void metrics_cache(const char *name, cache_t *cache);
+
+const char *metrics_phase_name(int phase);
+char *metrics_generate(size_t *size);
+
+#endif
@@ -0,0 +1,232 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "cache.h"
+#include "mime.h"
+
+#define MIME_EXT_MAX 32
+#define MIME_HTML "text/html; charset=UTF-8"
+
+/* open addressing table, filled at startup and read only afterwards */
+static mime_t *mime_table = NULL;
+static size_t mime_size = 0;
+static size_t mime_count = 0;
+
+/* files without a known extension */
+static const mime_t mime_default = { "", "text/plain", 0 };
+
+static const char *mime_builtin[][2] = {
+    { "md", "text/markdown" },
+    { "markdown", "text/markdown" },
+    { "html", MIME_HTML },
+    { "htm", MIME_HTML },
+    { "png", "image/png" },
+    { "jpg", "image/jpeg" },
+    { "jpeg", "image/jpeg" },
+    { "gif", "image/gif" },
+    { "ico", "image/x-icon" },
+    { "svg", "image/svg+xml" },
+    { "webp", "image/webp" },
+    { "css", "text/css" },
+    { "js", "application/javascript" },
+    { "json", "application/json" },
+    { "xml", "application/xml" },
+    { "txt", "text/plain" },
+    { "pdf", "application/pdf" },
+    { "wasm", "application/wasm" },
+    { "woff", "font/woff" },
+    { "woff2", "font/woff2" },
+    { "ttf", "font/ttf" },
+    { "otf", "font/otf" },
+    { NULL, NULL }
+};
+
+static int
+mime_key(char *key, const char *ext)
+{
+    size_t i;
+
+    for (i = 0; ext[i]; i++) {
+        if (i >= MIME_EXT_MAX - 1) {
+            return -1;
+        }
+        key[i] = tolower((unsigned char)ext[i]);
+    }
+    key[i] = '\0';
+
+    return i ? 0 : -1;
+}
+
+static mime_t *
+mime_slot(mime_t *table, size_t size, const char *key)
+{
+    size_t i = cache_hash(key) & (size - 1);
+
+    while (table[i].ext && strcmp(table[i].ext, key) != 0) {
+        i = (i + 1) & (size - 1);
+    }
+
+    return &table[i];
+}
+
+static int
+mime_grow(void)
+{
+    size_t i, size = mime_size ? mime_size * 2 : 256;
+    mime_t *table, *slot;
+
+    table = (mime_t *)calloc(size, sizeof(mime_t));
+    if (!table) {
+        return -1;
+    }
+
+    for (i = 0; i < mime_size; i++) {
+        if (mime_table[i].ext) {
+            slot = mime_slot(table, size, mime_table[i].ext);
+            *slot = mime_table[i];
+        }
+    }
+
+    free(mime_table);
+    mime_table = table;
+    mime_size = size;
+
+    return 0;
+}
+
+/* later definitions replace earlier ones */
+static int
+mime_add(const char *ext, const char *type)
+{
+    char key[MIME_EXT_MAX];
+    int markdown = 0;
+    mime_t *slot;
+
+    if (mime_key(key, ext) != 0) {
+        return 0;
+    }
+
+    if (strcasecmp(type, "text/markdown") == 0
+        || strcasecmp(type, "text/x-markdown") == 0) {
+        markdown = 1;
+        type = MIME_HTML;
+    }
+
+    if ((mime_count + 1) * 2 > mime_size && mime_grow() != 0) {
+        return -1;
+    }
+
+    slot = mime_slot(mime_table, mime_size, key);
+    if (slot->ext) {
+        free(slot->type);
+    } else {
+        slot->ext = strdup(key);
+        if (!slot->ext) {
+            return -1;
+        }
+        mime_count++;
+    }
+    slot->type = strdup(type);
+    slot->markdown = markdown;
+
+    return slot->type ? 0 : -1;
+}
+
+/* mime.types format: "type ext ext ...", '#' starts a comment */
+static int
+mime_load(const char *file)
+{
+    char *line = NULL, *type, *ext, *save;
+    size_t len = 0;
+    FILE *fp;
+    int ret = 0;
+
+    fp = fopen(file, "r");
+    if (!fp) {
+        return -1;
+    }
+
+    while (ret == 0 && getline(&line, &len, fp) != -1) {
+        char *comment = strchr(line, '#');
+        if (comment) {
+            *comment = '\0';
+        }
+
+        type = strtok_r(line, " \t\r\n", &save);
+        if (!type) {
+            continue;
+        }
+        while ((ext = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+            if (mime_add(ext, type) != 0) {
+                ret = -1;
+                break;
+            }
+        }
+    }
+
+    free(line);
+    fclose(fp);
+
+    return ret;
+}
+
+/*
+ * system mime.types, then the builtin types (html with charset and the
+ * markdown extensions), then the user file.
+ */
+int
+mime_init(const char *file)
+{
+    int i;
+
+    mime_load(MIME_TYPES_FILE);
+
+    for (i = 0; mime_builtin[i][0]; i++) {
+        if (mime_add(mime_builtin[i][0], mime_builtin[i][1]) != 0) {
+            return -1;
+        }
+    }
+
+    if (file && mime_load(file) != 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+void
+mime_cleanup(void)
+{
+    size_t i;
+
+    for (i = 0; i < mime_size; i++) {
+        free(mime_table[i].ext);
+        free(mime_table[i].type);
+    }
+    free(mime_table);
+
+    mime_table = NULL;
+    mime_size = 0;
+    mime_count = 0;
+}
+
+/* ext with the leading dot, NULL for none */
+const mime_t *
+mime_lookup(const char *ext)
+{
+    char key[MIME_EXT_MAX];
+    mime_t *slot;
+
+    if (!ext || !mime_table || mime_key(key, ext + 1) != 0) {
+        return &mime_default;
+    }
+
+    slot = mime_slot(mime_table, mime_size, key);
+    if (!slot->ext) {
+        return &mime_default;
+    }
+
+    return slot;
+}
@@ -0,0 +1,16 @@
+#ifndef __MMHD_MIME_H__
+#define __MMHD_MIME_H__
+
+#define MIME_TYPES_FILE "/etc/mime.types"
+
+typedef struct mime {
+    char *ext; /* lower case, without the dot */
+    char *type;
+    int markdown;
+} mime_t;
+
+int mime_init(const char *file);
+void mime_cleanup(void);
+const mime_t *mime_lookup(const char *ext);
+
+#endif
@@ -0,0 +1,165 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "path.h"
+
+cache_t *
+path_cache_new(size_t max_count)
+{
+    return cache_new(0, max_count, NULL);
+}
+
+static path_t *
+path_lookup(const char *root_dir, const char *directory_index,
+            const char *url, int *watched)
+{
+    char filepath[PATH_MAX+1] = {0,};
+    struct stat st, ist, lst;
+    size_t len;
+    path_t *path;
+    int found = 0, directory = 0;
+
+    snprintf(filepath, PATH_MAX, "%s%s", root_dir, url);
+    if (stat(filepath, &st) == 0) {
+        if (S_ISDIR(st.st_mode)) {
+            snprintf(filepath, PATH_MAX, "%s%s%s",
+                     root_dir, url, directory_index);
+            if (stat(filepath, &ist) == 0) {
+                found = 1;
+                st = ist;
+            } else {
+                /* listed, when enabled, from the directory itself */
+                directory = 1;
+                snprintf(filepath, PATH_MAX, "%s%s", root_dir, url);
+            }
+        } else {
+            found = 1;
+        }
+    }
+
+    /* changes behind a symbolic link are not watched */
+    *watched = !found
+        || (lstat(filepath, &lst) == 0 && !S_ISLNK(lst.st_mode));
+
+    len = strlen(filepath);
+    path = (path_t *)calloc(1, sizeof(path_t) + len + 1);
+    if (!path) {
+        return NULL;
+    }
+    path->found = found;
+    path->directory = directory;
+    if (found || directory) {
+        path->st = st;
+    }
+    memcpy(path->filepath, filepath, len + 1);
+
+    return path;
+}
+
+/*
+ * directory whose files decide how url resolves: the url itself when it
+ * is a directory, else its nearest existing parent. -1 when a component
+ * below root is a symbolic link, changes behind it are not watched.
+ */
+static int
+path_dir(const char *root_dir, const char *url, struct stat *st)
+{
+    char dir[PATH_MAX+1];
+    size_t root_len = strlen(root_dir);
+    struct stat lst;
+    char *p;
+
+    if (snprintf(dir, sizeof(dir), "%s%s", root_dir, url)
+        >= (int)sizeof(dir)) {
+        return -1;
+    }
+
+    while (stat(dir, st) != 0 || !S_ISDIR(st->st_mode)) {
+        p = strrchr(dir + root_len, '/');
+        if (!p) {
+            return -1;
+        }
+        *p = '\0';
+    }
+
+    for (p = dir + root_len; *p; p++) {
+        if (*p == '/' && p > dir + root_len && p[-1] != '/') {
+            *p = '\0';
+            if (lstat(dir, &lst) != 0 || S_ISLNK(lst.st_mode)) {
+                return -1;
+            }
+            *p = '/';
+        }
+    }
+    if (p > dir + root_len && p[-1] != '/'
+        && (lstat(dir, &lst) != 0 || S_ISLNK(lst.st_mode))) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * resolved url (file, directory index, directory or not found) as a
+ * referenced entry. entries are reused until the watch reports a change
+ * to the files of the directory deciding the lookup, or to directories
+ * below the document root. without a watch every lookup calls stat().
+ */
+cache_entry_t *
+path_resolve(cache_t *cache, watch_t *watch,
+             const char *root_dir, const char *directory_index,
+             const char *url)
+{
+    cache_entry_t *entry = NULL;
+    unsigned long generation, dir_generation = 0;
+    struct stat dir;
+    path_t *path;
+    int watched;
+
+    if (watch_generation(watch, &generation) != 0) {
+        cache = NULL;
+    }
+
+    if (cache) {
+        entry = cache_get(cache, url);
+        if (entry) {
+            path = (path_t *)entry->data;
+            if (path->generation == generation
+                && path->dir_generation
+                == watch_dir_generation(watch, path->dir_dev,
+                                        path->dir_ino)) {
+                return entry;
+            }
+            cache_release(entry);
+        }
+    }
+
+    /*
+     * generations are read before stat(), a racing change marks the
+     * entry stale: the directory one after the directory is found.
+     */
+    if (cache && path_dir(root_dir, url, &dir) == 0) {
+        dir_generation = watch_dir_generation(watch, dir.st_dev, dir.st_ino);
+    } else {
+        cache = NULL;
+    }
+
+    path = path_lookup(root_dir, directory_index, url, &watched);
+    if (!path) {
+        return NULL;
+    }
+
+    if (cache && watched) {
+        path->generation = generation;
+        path->dir_dev = dir.st_dev;
+        path->dir_ino = dir.st_ino;
+        path->dir_generation = dir_generation;
+        return cache_set(cache, url, path,
+                         sizeof(path_t) + strlen(path->filepath) + 1);
+    }
+
+    return cache_entry_new(url, path,
+                           sizeof(path_t) + strlen(path->filepath) + 1);
+}
@@ -0,0 +1,27 @@
+#ifndef __MMHD_PATH_H__
+#define __MMHD_PATH_H__
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+#include "watch.h"
+
+typedef struct path {
+    int found;
+    int directory; /* not found: a directory without its index */
+    struct stat st;
+    unsigned long generation;
+    /* the directory deciding the lookup, see path_dir() */
+    dev_t dir_dev;
+    ino_t dir_ino;
+    unsigned long dir_generation;
+    char filepath[];
+} path_t;
+
+cache_t *path_cache_new(size_t max_count);
+cache_entry_t *path_resolve(cache_t *cache, watch_t *watch,
+                            const char *root_dir, const char *directory_index,
+                            const char *url);
+
+#endif
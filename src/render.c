@@ -0,0 +1,573 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "render.h"
+#include "metrics.h"
+
+/* buffers grown over this are released after the document */
+#define RENDER_BUFFER_MAX (4 * 1024 * 1024)
+
+/* files from this size are mapped instead of read */
+#define RENDER_MMAP_MIN (64 * 1024)
+
+/* rendered html handed to the flush callback at once */
+#define RENDER_FLUSH_MIN (16 * 1024)
+
+/* flushed bytes left in ob: the newline and mark checks look back */
+#define RENDER_FLUSH_KEEP (sizeof(RENDER_BLOCK_MARK) - 1)
+
+static pthread_key_t render_key;
+static pthread_once_t render_once = PTHREAD_ONCE_INIT;
+static int render_marks = 0;
+
+/* mapping parsed by this thread, see render_sigbus() */
+static __thread const uint8_t *volatile render_map = NULL;
+static __thread volatile size_t render_map_size = 0;
+static __thread volatile sig_atomic_t render_map_lost = 0;
+static pthread_once_t render_sigbus_once = PTHREAD_ONCE_INIT;
+static struct sigaction render_sigbus_action;
+static size_t render_page_size = 4096;
+
+/* <a ...> or </a> */
+static int
+render_toc_anchor(const uint8_t *tag, size_t size)
+{
+    if (size >= 3 && tag[1] == '/') {
+        tag++;
+        size--;
+    }
+
+    return size >= 3 && (tag[1] == 'a' || tag[1] == 'A')
+        && (tag[2] == '>' || tag[2] == ' ' || tag[2] == '\t'
+            || tag[2] == '\n');
+}
+
+/*
+ * header text is already rendered html. escaped, the default, the text
+ * is kept and tags are dropped. unescaped, the html is kept but links,
+ * which cannot nest in the toc anchor: the toc renderer of hoedown wrote
+ * their text only. mmhd_bench toc compares both with the toc renderer.
+ */
+static void
+render_toc_text(hoedown_buffer *ob, const hoedown_buffer *text,
+                unsigned int flags)
+{
+    const uint8_t *p, *end, *tag;
+    int keep = (flags & HOEDOWN_HTML_SKIP_TOC_ESCAPE) ? 1 : 0;
+
+    if (!text || !text->size) {
+        return;
+    }
+
+    /* memchr() skips the runs a word at a time or more */
+    p = text->data;
+    end = text->data + text->size;
+    while (p < end) {
+        tag = memchr(p, '<', end - p);
+        if (!tag) {
+            tag = end;
+        }
+        if (tag > p) {
+            hoedown_buffer_put(ob, p, tag - p);
+        }
+        if (tag == end) {
+            break;
+        }
+        p = memchr(tag, '>', end - tag);
+        if (!p) {
+            if (keep) {
+                hoedown_buffer_put(ob, tag, end - tag);
+            }
+            break;
+        }
+        p++;
+        if (keep && !render_toc_anchor(tag, p - tag)) {
+            hoedown_buffer_put(ob, tag, p - tag);
+        }
+    }
+}
+
+static void
+render_mark(hoedown_buffer *ob)
+{
+    size_t len = sizeof(RENDER_BLOCK_MARK) - 1;
+
+    /* the document starts with one, no empty block before the first */
+    if (ob->size >= len
+        && memcmp(ob->data + ob->size - len, RENDER_BLOCK_MARK, len) == 0) {
+        return;
+    }
+    hoedown_buffer_put(ob, RENDER_BLOCK_MARK, len);
+}
+
+/* ob is the document buffer only for top level blocks */
+static void
+render_flush(render_t *render, hoedown_buffer *ob)
+{
+    size_t keep;
+
+    if (ob != render->ob) {
+        return;
+    }
+    /*
+     * the flushed html is dropped but for its tail: the html renderer
+     * writes the newline between blocks only after some output, and a
+     * mark is not repeated.
+     */
+    if (render->flush && ob->size - render->kept >= RENDER_FLUSH_MIN) {
+        render->flush(ob->data + render->kept, ob->size - render->kept,
+                      render->flush_opaque);
+        render->flushed += ob->size - render->kept;
+
+        keep = ob->size < RENDER_FLUSH_KEEP ? ob->size : RENDER_FLUSH_KEEP;
+        memmove(ob->data, ob->data + ob->size - keep, keep);
+        ob->size = keep;
+        render->kept = keep;
+    }
+    if (render_marks) {
+        render_mark(ob);
+    }
+}
+
+static void
+render_paragraph(hoedown_buffer *ob, const hoedown_buffer *text,
+                 void *opaque)
+{
+    render_t *render = opaque;
+
+    render_flush(render, ob);
+    render->paragraph(ob, text, opaque);
+}
+
+static void
+render_blockcode(hoedown_buffer *ob, const hoedown_buffer *text,
+                 const hoedown_buffer *lang, void *opaque)
+{
+    render_t *render = opaque;
+
+    render_flush(render, ob);
+    render->blockcode(ob, text, lang, opaque);
+}
+
+static void
+render_blockquote(hoedown_buffer *ob, const hoedown_buffer *text,
+                  void *opaque)
+{
+    render_t *render = opaque;
+
+    render_flush(render, ob);
+    render->blockquote(ob, text, opaque);
+}
+
+static void
+render_blockhtml(hoedown_buffer *ob, const hoedown_buffer *text,
+                 void *opaque)
+{
+    render_t *render = opaque;
+
+    render_flush(render, ob);
+    render->blockhtml(ob, text, opaque);
+}
+
+static void
+render_hrule(hoedown_buffer *ob, void *opaque)
+{
+    render_t *render = opaque;
+
+    render_flush(render, ob);
+    render->hrule(ob, opaque);
+}
+
+static void
+render_list(hoedown_buffer *ob, const hoedown_buffer *text,
+            unsigned int flags, void *opaque)
+{
+    render_t *render = opaque;
+
+    render_flush(render, ob);
+    render->list(ob, text, flags, opaque);
+}
+
+static void
+render_table(hoedown_buffer *ob, const hoedown_buffer *header,
+             const hoedown_buffer *body, void *opaque)
+{
+    render_t *render = opaque;
+
+    render_flush(render, ob);
+    render->table(ob, header, body, opaque);
+}
+
+static void
+render_toc_header(hoedown_buffer *ob, const hoedown_buffer *text,
+                  int level, void *opaque)
+{
+    render_t *render = opaque;
+    hoedown_buffer *toc = render->toc;
+    int id = render->options.toc_data.header_count;
+
+    render_flush(render, ob);
+    render->header(ob, text, level, opaque);
+
+    if (!render->toc_enabled) {
+        return;
+    }
+
+    /* only headers the html renderer gave an anchor to */
+    if (render->options.toc_data.header_count == id
+        || level < render->toc_starting || level > render->toc_nesting) {
+        return;
+    }
+
+    if (render->toc_level == 0) {
+        render->toc_offset = level - 1;
+    }
+    level -= render->toc_offset;
+
+    if (level > render->toc_level) {
+        while (level > render->toc_level) {
+            if (render->toc_level == 0) {
+                hoedown_buffer_puts(toc, "<ul class=\"toc\">\n<li>\n");
+            } else {
+                hoedown_buffer_puts(toc, "<ul>\n<li>\n");
+            }
+            render->toc_level++;
+        }
+    } else if (level < render->toc_level) {
+        hoedown_buffer_puts(toc, "</li>\n");
+        while (level < render->toc_level && render->toc_level > 1) {
+            hoedown_buffer_puts(toc, "</ul>\n</li>\n");
+            render->toc_level--;
+        }
+        hoedown_buffer_puts(toc, "<li>\n");
+    } else {
+        hoedown_buffer_puts(toc, "</li>\n<li>\n");
+    }
+
+    hoedown_buffer_printf(toc, "<a href=\"#toc_%d\">", id);
+    render_toc_text(toc, text, render->options.flags);
+    hoedown_buffer_puts(toc, "</a>\n");
+}
+
+static void
+render_toc_finalize(render_t *render)
+{
+    while (render->toc_level > 0) {
+        hoedown_buffer_puts(render->toc, "</li>\n</ul>\n");
+        render->toc_level--;
+    }
+}
+
+static void
+render_free(void *data)
+{
+    render_t *render = data;
+
+    if (render) {
+        if (render->markdown) {
+            hoedown_markdown_free(render->markdown);
+        }
+        hoedown_buffer_free(render->ib);
+        hoedown_buffer_free(render->ob);
+        hoedown_buffer_free(render->toc);
+        free(render);
+    }
+}
+
+static void
+render_key_init(void)
+{
+    pthread_key_create(&render_key, &render_free);
+}
+
+static hoedown_buffer *
+render_buffer(hoedown_buffer *buf, size_t unit)
+{
+    if (buf && buf->asize > RENDER_BUFFER_MAX) {
+        hoedown_buffer_free(buf);
+        buf = NULL;
+    }
+
+    if (!buf) {
+        return hoedown_buffer_new(unit);
+    }
+
+    buf->size = 0;
+
+    return buf;
+}
+
+void
+render_block_marks(int enabled)
+{
+    render_marks = enabled;
+}
+
+render_t *
+render_get(unsigned int extensions)
+{
+    render_t *render;
+    hoedown_callbacks callbacks;
+
+    pthread_once(&render_once, &render_key_init);
+
+    render = (render_t *)pthread_getspecific(render_key);
+    if (render && render->extensions == extensions) {
+        render->ib = render_buffer(render->ib, HOEDOWN_READ_UNIT);
+        render->ob = render_buffer(render->ob, HOEDOWN_OUTPUT_UNIT);
+        render->toc = render_buffer(render->toc, HOEDOWN_OUTPUT_UNIT);
+        render->flush = NULL;
+        render->flush_opaque = NULL;
+        if (render->ib && render->ob && render->toc) {
+            return render;
+        }
+    }
+
+    render_free(render);
+    pthread_setspecific(render_key, NULL);
+
+    render = (render_t *)calloc(1, sizeof(render_t));
+    if (!render) {
+        return NULL;
+    }
+
+    hoedown_html_renderer(&callbacks, &render->options, 0, 0);
+
+    render->header = callbacks.header;
+    render->paragraph = callbacks.paragraph;
+    render->blockcode = callbacks.blockcode;
+    render->blockquote = callbacks.blockquote;
+    render->blockhtml = callbacks.blockhtml;
+    render->hrule = callbacks.hrule;
+    render->list = callbacks.list;
+    render->table = callbacks.table;
+    callbacks.header = &render_toc_header;
+    if (callbacks.paragraph) {
+        callbacks.paragraph = &render_paragraph;
+    }
+    if (callbacks.blockcode) {
+        callbacks.blockcode = &render_blockcode;
+    }
+    if (callbacks.blockquote) {
+        callbacks.blockquote = &render_blockquote;
+    }
+    if (callbacks.blockhtml) {
+        callbacks.blockhtml = &render_blockhtml;
+    }
+    if (callbacks.hrule) {
+        callbacks.hrule = &render_hrule;
+    }
+    if (callbacks.list) {
+        callbacks.list = &render_list;
+    }
+    if (callbacks.table) {
+        callbacks.table = &render_table;
+    }
+
+    render->extensions = extensions;
+    render->markdown = hoedown_markdown_new(extensions, 16,
+                                            &callbacks, render);
+    render->ib = hoedown_buffer_new(HOEDOWN_READ_UNIT);
+    render->ob = hoedown_buffer_new(HOEDOWN_OUTPUT_UNIT);
+    render->toc = hoedown_buffer_new(HOEDOWN_OUTPUT_UNIT);
+    if (!render->markdown || !render->ib || !render->ob || !render->toc) {
+        render_free(render);
+        return NULL;
+    }
+
+    pthread_setspecific(render_key, render);
+
+    return render;
+}
+
+void
+render_markdown(render_t *render, const uint8_t *data, size_t size,
+                unsigned int html, int toc_starting, int toc_nesting)
+{
+    /* the html is usually about the size of the markdown and a half */
+    hoedown_buffer_grow(render->ob, size + size / 2);
+    render->flushed = 0;
+    render->kept = 0;
+
+    memset(&render->options.toc_data, 0, sizeof(render->options.toc_data));
+    render->options.flags = html;
+    render->options.toc_data.starting_level = toc_starting;
+    render->options.toc_data.nesting_level = toc_nesting;
+    render->options.toc_data.header = NULL;
+    render->options.toc_data.footer = NULL;
+
+    render->toc_enabled = (html & HOEDOWN_HTML_TOC) ? 1 : 0;
+    render->toc_starting = toc_starting;
+    render->toc_nesting = toc_nesting;
+    render->toc_level = 0;
+    render->toc_offset = 0;
+
+    if (render_marks) {
+        render_mark(render->ob);
+    }
+
+    hoedown_markdown_render(render->ob, data, size, render->markdown);
+
+    if (render->toc_enabled) {
+        render_toc_finalize(render);
+    }
+}
+
+/*
+ * a mapped file cut short while it is parsed (an editor saving in place,
+ * a checkout, a file edited under --live) raises SIGBUS on the pages
+ * past its new end. the pages are replaced by zero pages so the parse
+ * runs to its end with consistent hoedown state, and render_file()
+ * reads and renders the file again. mmap() is a plain system call, safe
+ * for a fault of the thread itself. other faults get the previous
+ * action back and happen again.
+ */
+static void
+render_sigbus(int sig, siginfo_t *info, void *context)
+{
+    uintptr_t addr = (uintptr_t)info->si_addr;
+    uintptr_t start = (uintptr_t)render_map;
+    uintptr_t page = addr & ~((uintptr_t)render_page_size - 1);
+
+    if (render_map && addr >= start && addr < start + render_map_size
+        && mmap((void *)page, render_page_size, PROT_READ,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0)
+        != MAP_FAILED) {
+        render_map_lost = 1;
+        return;
+    }
+
+    sigaction(SIGBUS, &render_sigbus_action, NULL);
+}
+
+static void
+render_sigbus_init(void)
+{
+    struct sigaction action;
+    long size = sysconf(_SC_PAGESIZE);
+
+    if (size > 0) {
+        render_page_size = size;
+    }
+
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = &render_sigbus;
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGBUS, &action, &render_sigbus_action);
+}
+
+static int
+render_read(render_t *render, int fd, size_t size)
+{
+    ssize_t len;
+
+    hoedown_buffer_grow(render->ib, size + 1);
+    while ((len = read(fd, render->ib->data + render->ib->size,
+                       render->ib->asize - render->ib->size)) != 0) {
+        if (len < 0) {
+            return -1;
+        }
+        render->ib->size += len;
+        hoedown_buffer_grow(render->ib, render->ib->size + HOEDOWN_READ_UNIT);
+    }
+
+    return 0;
+}
+
+int
+render_file(render_t *render, const char *path,
+            unsigned int html, int toc_starting, int toc_nesting)
+{
+    struct stat statbuf;
+    struct timespec start;
+    void *map = MAP_FAILED;
+    int fd;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    render->read_time = 0;
+    render->render_time = 0;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+
+    if (fstat(fd, &statbuf) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    /*
+     * a file modified within the last second is likely still written,
+     * it is read rather than rendered twice after a truncation.
+     */
+    if (statbuf.st_size >= RENDER_MMAP_MIN
+        && statbuf.st_mtime < time(NULL) - 1) {
+        pthread_once(&render_sigbus_once, &render_sigbus_init);
+        map = mmap(NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, statbuf.st_size, MADV_SEQUENTIAL);
+        }
+    }
+
+    if (map != MAP_FAILED) {
+        /* pages are faulted in by the parse, counted as render */
+        render->read_time = metrics_elapsed(&start);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        render_map_lost = 0;
+        render_map = (const uint8_t *)map;
+        render_map_size = (statbuf.st_size + render_page_size - 1)
+            & ~(render_page_size - 1);
+
+        render_markdown(render, (const uint8_t *)map, statbuf.st_size,
+                        html, toc_starting, toc_nesting);
+
+        render_map = NULL;
+        munmap(map, statbuf.st_size);
+
+        if (!render_map_lost) {
+            close(fd);
+            render->render_time = metrics_elapsed(&start);
+            return 0;
+        }
+
+        /* blocks of the broken render were handed out already */
+        if (render->flushed) {
+            close(fd);
+            return -1;
+        }
+
+        /* truncated under the parse, read what is left of it */
+        render->ob->size = 0;
+        render->toc->size = 0;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+    }
+
+    if (render_read(render, fd, statbuf.st_size) != 0) {
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    render->read_time += metrics_elapsed(&start);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    render_markdown(render, render->ib->data, render->ib->size,
+                    html, toc_starting, toc_nesting);
+
+    render->render_time = metrics_elapsed(&start);
+
+    return 0;
+}
@@ -0,0 +1,85 @@
+#ifndef __MMHD_RENDER_H__
+#define __MMHD_RENDER_H__
+
+#include "hoedown/src/markdown.h"
+#include "hoedown/src/html.h"
+#include "hoedown/src/buffer.h"
+
+#define HOEDOWN_READ_UNIT   1024
+#define HOEDOWN_OUTPUT_UNIT 64
+
+#define HOWDOWN_TOC_STARING 2
+#define HOWDOWN_TOC_NESTING 6
+
+/* html of the top level blocks rendered since the last call */
+typedef void (*render_flush_t)(const uint8_t *data, size_t size,
+                               void *opaque);
+
+typedef struct render {
+    /* first member: the html callbacks take it as their opaque */
+    hoedown_html_renderopt options;
+    void (*header)(hoedown_buffer *ob, const hoedown_buffer *text,
+                   int level, void *opaque);
+    void (*paragraph)(hoedown_buffer *ob, const hoedown_buffer *text,
+                      void *opaque);
+    void (*blockcode)(hoedown_buffer *ob, const hoedown_buffer *text,
+                      const hoedown_buffer *lang, void *opaque);
+    void (*blockquote)(hoedown_buffer *ob, const hoedown_buffer *text,
+                       void *opaque);
+    void (*blockhtml)(hoedown_buffer *ob, const hoedown_buffer *text,
+                      void *opaque);
+    void (*hrule)(hoedown_buffer *ob, void *opaque);
+    void (*list)(hoedown_buffer *ob, const hoedown_buffer *text,
+                 unsigned int flags, void *opaque);
+    void (*table)(hoedown_buffer *ob, const hoedown_buffer *header,
+                  const hoedown_buffer *body, void *opaque);
+    /* called between top level blocks to hand out the rendered html */
+    render_flush_t flush;
+    void *flush_opaque;
+    size_t flushed; /* bytes handed out */
+    size_t kept; /* leading bytes of ob handed out already */
+    struct hoedown_markdown *markdown;
+    unsigned int extensions;
+    hoedown_buffer *ib;
+    hoedown_buffer *ob;
+    hoedown_buffer *toc;
+    int toc_enabled;
+    int toc_starting;
+    int toc_nesting;
+    int toc_level;
+    int toc_offset;
+    double read_time; /* msec, of the last render_file() */
+    double render_time;
+} render_t;
+
+/*
+ * with marks on, the body starts with a mark and each top level block
+ * follows one: the live preview splits pages into blocks on them. set
+ * before any render.
+ */
+#define RENDER_BLOCK_MARK "<!--mmhd-->"
+void render_block_marks(int enabled);
+
+/*
+ * per thread render context, the parser and the buffers are kept
+ * between documents and reset by render_markdown().
+ */
+render_t *render_get(unsigned int extensions);
+
+/*
+ * render the body into render->ob and, when the toc flag is on, the
+ * table of contents into render->toc from the same parse. with a flush
+ * callback the html is handed out between top level blocks and dropped
+ * from render->ob: what is left to hand out starts at render->kept.
+ */
+void render_markdown(render_t *render, const uint8_t *data, size_t size,
+                     unsigned int html, int toc_starting, int toc_nesting);
+
+/*
+ * render a markdown file, large files are mapped read-only and given
+ * to hoedown directly, small, empty or still changing files are read.
+ */
+int render_file(render_t *render, const char *path,
+                unsigned int html, int toc_starting, int toc_nesting);
+
+#endif
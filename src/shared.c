@@ -0,0 +1,232 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "cache.h"
+#include "shared.h"
+
+#define SHARED_SLOT_SIZE 4096 /* one index slot per average page */
+#define SHARED_SLOTS_MIN 64
+#define SHARED_ALIGN 8
+
+/*
+ * entries are appended to a circular data area at an ever growing log
+ * position, an entry is intact while it is within the last capacity
+ * bytes written. the index is a hash table of two slots per key.
+ */
+typedef struct shared_slot {
+    unsigned int hash;
+    unsigned int size; /* 0: empty */
+    uint64_t offset;
+} shared_slot_t;
+
+typedef struct shared_record {
+    unsigned int key_size;
+    unsigned int data_size;
+    char data[]; /* key then data */
+} shared_record_t;
+
+struct shared_cache {
+    pthread_mutex_t lock; /* robust, process shared */
+    size_t mapped;
+    size_t nslots;
+    size_t capacity;
+    uint64_t head;
+    shared_slot_t *slots;
+    char *data;
+};
+
+#define shared_cache_align(_n) \
+    (((_n) + SHARED_ALIGN - 1) & ~((size_t)SHARED_ALIGN - 1))
+
+static int
+shared_cache_lock(shared_cache_t *cache)
+{
+    int ret = pthread_mutex_lock(&cache->lock);
+
+    if (ret == EOWNERDEAD) {
+        /* a worker died holding the lock, drop what it may have torn */
+        pthread_mutex_consistent(&cache->lock);
+        memset(cache->slots, 0, cache->nslots * sizeof(shared_slot_t));
+        return 0;
+    }
+
+    return ret == 0 ? 0 : -1;
+}
+
+shared_cache_t *
+shared_cache_new(size_t size)
+{
+    pthread_mutexattr_t attr;
+    shared_cache_t *cache;
+    size_t nslots, header, mapped;
+    void *addr;
+
+    size &= ~((size_t)SHARED_ALIGN - 1);
+    if (size == 0) {
+        return NULL;
+    }
+
+    nslots = size / SHARED_SLOT_SIZE;
+    if (nslots < SHARED_SLOTS_MIN) {
+        nslots = SHARED_SLOTS_MIN;
+    }
+    nslots &= ~(size_t)1;
+    header = shared_cache_align(sizeof(shared_cache_t))
+        + nslots * sizeof(shared_slot_t);
+    mapped = header + size;
+
+    addr = mmap(NULL, mapped, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) {
+        return NULL;
+    }
+
+    cache = (shared_cache_t *)addr;
+    cache->mapped = mapped;
+    cache->nslots = nslots;
+    cache->capacity = size;
+    cache->slots = (shared_slot_t *)((char *)addr
+                                     + shared_cache_align(sizeof(*cache)));
+    cache->data = (char *)addr + header;
+
+    if (pthread_mutexattr_init(&attr) != 0) {
+        munmap(addr, mapped);
+        return NULL;
+    }
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    if (pthread_mutex_init(&cache->lock, &attr) != 0) {
+        pthread_mutexattr_destroy(&attr);
+        munmap(addr, mapped);
+        return NULL;
+    }
+    pthread_mutexattr_destroy(&attr);
+
+    return cache;
+}
+
+void
+shared_cache_free(shared_cache_t *cache)
+{
+    if (!cache) {
+        return;
+    }
+
+    munmap(cache, cache->mapped);
+}
+
+static int
+shared_cache_live(shared_cache_t *cache, shared_slot_t *slot)
+{
+    return slot->size && slot->offset + cache->capacity >= cache->head;
+}
+
+static shared_record_t *
+shared_cache_record(shared_cache_t *cache, shared_slot_t *slot,
+                    unsigned int hash, const char *key, size_t key_size)
+{
+    shared_record_t *record;
+
+    if (!shared_cache_live(cache, slot) || slot->hash != hash) {
+        return NULL;
+    }
+
+    record = (shared_record_t *)(cache->data
+                                 + slot->offset % cache->capacity);
+    if (record->key_size != key_size
+        || memcmp(record->data, key, key_size) != 0) {
+        return NULL;
+    }
+
+    return record;
+}
+
+void *
+shared_cache_get(shared_cache_t *cache, const char *key, size_t *size)
+{
+    unsigned int hash = cache_hash(key);
+    size_t key_size = strlen(key);
+    shared_record_t *record;
+    shared_slot_t *slot;
+    void *data = NULL;
+
+    if (!cache || shared_cache_lock(cache) != 0) {
+        return NULL;
+    }
+
+    slot = &cache->slots[(hash % cache->nslots) & ~(size_t)1];
+    record = shared_cache_record(cache, slot, hash, key, key_size);
+    if (!record) {
+        record = shared_cache_record(cache, slot + 1, hash, key, key_size);
+    }
+
+    if (record) {
+        /* copied out, the area is reused once the log wraps */
+        data = malloc(record->data_size);
+        if (data) {
+            memcpy(data, record->data + key_size, record->data_size);
+            *size = record->data_size;
+        }
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+
+    return data;
+}
+
+int
+shared_cache_set(shared_cache_t *cache, const char *key,
+                 const void *data, size_t size)
+{
+    unsigned int hash = cache_hash(key);
+    size_t key_size = strlen(key), total, wrap;
+    shared_record_t *record;
+    shared_slot_t *slot;
+    uint64_t offset;
+
+    if (!cache) {
+        return -1;
+    }
+
+    total = shared_cache_align(sizeof(shared_record_t) + key_size + size);
+    if (total > cache->capacity / 4) {
+        /* would evict too much at once */
+        return -1;
+    }
+
+    if (shared_cache_lock(cache) != 0) {
+        return -1;
+    }
+
+    /* records are contiguous, skip the end of the area */
+    offset = cache->head;
+    wrap = cache->capacity - offset % cache->capacity;
+    if (wrap < total) {
+        offset += wrap;
+    }
+    cache->head = offset + total;
+
+    record = (shared_record_t *)(cache->data + offset % cache->capacity);
+    record->key_size = key_size;
+    record->data_size = size;
+    memcpy(record->data, key, key_size);
+    memcpy(record->data + key_size, data, size);
+
+    /* the same key, an empty or overwritten slot, else the older one */
+    slot = &cache->slots[(hash % cache->nslots) & ~(size_t)1];
+    if (shared_cache_live(cache, slot) && slot->hash != hash
+        && (slot[1].hash == hash || !shared_cache_live(cache, &slot[1])
+            || slot[1].offset < slot->offset)) {
+        slot++;
+    }
+    slot->hash = hash;
+    slot->size = size;
+    slot->offset = offset;
+
+    pthread_mutex_unlock(&cache->lock);
+
+    return 0;
+}
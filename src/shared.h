@@ -0,0 +1,18 @@
+#ifndef __MMHD_SHARED_H__
+#define __MMHD_SHARED_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct shared_cache shared_cache_t;
+
+/* anonymous shared memory, inherited by forked workers */
+shared_cache_t *shared_cache_new(size_t size);
+void shared_cache_free(shared_cache_t *cache);
+
+/* malloc'ed copy of the data or NULL */
+void *shared_cache_get(shared_cache_t *cache, const char *key, size_t *size);
+int shared_cache_set(shared_cache_t *cache, const char *key,
+                     const void *data, size_t size);
+
+#endif
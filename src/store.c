@@ -0,0 +1,751 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#include "store.h"
+
+#define STORE_MAGIC "MMHDSTOR"
+#define STORE_VERSION 2
+#define STORE_RECORD_MAGIC 0x4d4d5244U
+#define STORE_BUCKETS 65536
+#define STORE_ALIGN 8
+#define STORE_COMPACT_MIN (16 * 1024 * 1024) /* garbage bytes */
+#define STORE_COMPACT_RETRY 60 /* sec */
+
+#define store_align(_n) \
+    (((_n) + STORE_ALIGN - 1) & ~((uint64_t)STORE_ALIGN - 1))
+
+typedef struct store_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+} store_header_t;
+
+/*
+ * records are appended after the header: this header, the name, the
+ * data and padding. check covers the fields that follow it, sum the
+ * name and data, it is verified on the first read.
+ */
+typedef struct store_record {
+    uint32_t magic;
+    uint32_t check;
+    uint32_t name_size;
+    uint32_t flags;
+    uint64_t data_size;
+    int64_t mtime;
+    int64_t fsize;
+    uint64_t ino;
+    uint32_t sum;
+    uint32_t mtime_nsec;
+} store_record_t;
+
+typedef struct store_entry {
+    struct store_entry *next;
+    unsigned int hash;
+    unsigned int flags;
+    int verified;
+    uint32_t sum;
+    int64_t mtime;
+    long mtime_nsec;
+    int64_t fsize;
+    uint64_t ino;
+    uint64_t offset; /* of the record */
+    uint64_t length; /* of the record with padding */
+    uint64_t data_size;
+    char name[];
+} store_entry_t;
+
+struct store {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    char *path;
+    int fd;
+    char *map;
+    size_t mapped;
+    uint64_t end; /* append offset */
+    uint64_t live; /* bytes of indexed records */
+    store_entry_t **buckets;
+    int stop;
+    pthread_t thread;
+};
+
+static uint32_t
+store_sum(uint32_t sum, const void *data, size_t size)
+{
+    const unsigned char *p = (const unsigned char *)data;
+
+    while (size--) {
+        sum ^= *p++;
+        sum *= 16777619U;
+    }
+
+    return sum;
+}
+
+static uint32_t
+store_check(const store_record_t *record)
+{
+    return store_sum(2166136261U, &record->name_size,
+                     sizeof(store_record_t)
+                     - offsetof(store_record_t, name_size));
+}
+
+static unsigned int
+store_hash(const char *name, unsigned int flags)
+{
+    return store_sum(2166136261U, name, strlen(name)) ^ flags;
+}
+
+static int
+store_read(store_t *store, uint64_t offset, void *buf, size_t size)
+{
+    ssize_t n;
+
+    if (offset + size <= store->mapped) {
+        memcpy(buf, store->map + offset, size);
+        return 0;
+    }
+
+    while (size > 0) {
+        n = pread(store->fd, buf, size, offset);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf = (char *)buf + n;
+        offset += n;
+        size -= n;
+    }
+
+    return 0;
+}
+
+static int
+store_write(int fd, struct iovec *iov, int iovcnt, uint64_t offset)
+{
+    ssize_t n;
+
+    while (iovcnt > 0) {
+        n = pwritev(fd, iov, iovcnt, offset);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        offset += n;
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    return 0;
+}
+
+static store_entry_t **
+store_find(store_t *store, const char *name, unsigned int flags,
+           unsigned int hash)
+{
+    store_entry_t **entry = &store->buckets[hash % STORE_BUCKETS];
+
+    while (*entry) {
+        if ((*entry)->hash == hash && (*entry)->flags == flags
+            && strcmp((*entry)->name, name) == 0) {
+            break;
+        }
+        entry = &(*entry)->next;
+    }
+
+    return entry;
+}
+
+static void
+store_remove(store_t *store, store_entry_t **entry)
+{
+    store_entry_t *next = (*entry)->next;
+
+    store->live -= (*entry)->length;
+    free(*entry);
+    *entry = next;
+}
+
+static int
+store_garbage(store_t *store)
+{
+    uint64_t garbage = store->end - sizeof(store_header_t) - store->live;
+
+    return garbage > STORE_COMPACT_MIN && garbage > store->live;
+}
+
+/* the newer record of a name replaces the older */
+static int
+store_index(store_t *store, const store_record_t *record, const char *name,
+            uint64_t offset, uint64_t length, int verified)
+{
+    store_entry_t **slot, *entry;
+    unsigned int hash;
+
+    entry = (store_entry_t *)malloc(sizeof(store_entry_t)
+                                    + record->name_size + 1);
+    if (!entry) {
+        return -1;
+    }
+    memcpy(entry->name, name, record->name_size);
+    entry->name[record->name_size] = '\0';
+
+    /* name is not terminated in a mapped record */
+    hash = store_hash(entry->name, record->flags);
+    entry->hash = hash;
+    entry->flags = record->flags;
+    entry->verified = verified;
+    entry->sum = record->sum;
+    entry->mtime = record->mtime;
+    entry->mtime_nsec = record->mtime_nsec;
+    entry->fsize = record->fsize;
+    entry->ino = record->ino;
+    entry->offset = offset;
+    entry->length = length;
+    entry->data_size = record->data_size;
+
+    slot = store_find(store, entry->name, entry->flags, hash);
+    if (*slot) {
+        store_remove(store, slot);
+    }
+    entry->next = store->buckets[hash % STORE_BUCKETS];
+    store->buckets[hash % STORE_BUCKETS] = entry;
+    store->live += length;
+
+    return 0;
+}
+
+static int
+store_map(store_t *store, uint64_t size)
+{
+    if (store->map) {
+        munmap(store->map, store->mapped);
+        store->map = NULL;
+        store->mapped = 0;
+    }
+
+    store->map = mmap(NULL, size, PROT_READ, MAP_SHARED, store->fd, 0);
+    if (store->map == MAP_FAILED) {
+        store->map = NULL;
+        return -1;
+    }
+    store->mapped = size;
+
+    return 0;
+}
+
+/* indexes the records up to the first torn one, the tail is cut off */
+static int
+store_scan(store_t *store, uint64_t size)
+{
+    const store_record_t *record;
+    uint64_t offset = sizeof(store_header_t), length;
+
+    if (store_map(store, size) != 0) {
+        return -1;
+    }
+
+    while (offset + sizeof(store_record_t) <= size) {
+        record = (const store_record_t *)(store->map + offset);
+        if (record->magic != STORE_RECORD_MAGIC
+            || record->check != store_check(record)
+            || record->name_size == 0 || record->name_size > PATH_MAX
+            || record->data_size > size) {
+            break;
+        }
+        length = store_align(sizeof(store_record_t) + record->name_size
+                             + record->data_size);
+        if (offset + length > size) {
+            break;
+        }
+        if (store_index(store, record, (const char *)(record + 1),
+                        offset, length, 0) != 0) {
+            return -1;
+        }
+        offset += length;
+    }
+
+    store->end = offset;
+    if (offset < size) {
+        if (ftruncate(store->fd, offset) != 0) {
+            return -1;
+        }
+        return store_map(store, offset);
+    }
+
+    return 0;
+}
+
+static int
+store_init(int fd)
+{
+    store_header_t header;
+    struct iovec iov = { &header, sizeof(header) };
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, STORE_MAGIC, sizeof(header.magic));
+    header.version = STORE_VERSION;
+
+    if (ftruncate(fd, 0) != 0) {
+        return -1;
+    }
+
+    return store_write(fd, &iov, 1, 0);
+}
+
+typedef struct store_move {
+    uint64_t offset;
+    uint64_t length;
+    uint64_t moved;
+} store_move_t;
+
+static int
+store_move_compare(const void *a, const void *b)
+{
+    const store_move_t *x = a, *y = b;
+
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+static int
+store_copy(store_t *store, int fd, store_move_t *move, uint64_t *end,
+           char **buf, size_t *alloc)
+{
+    struct iovec iov;
+
+    if (move->length > *alloc) {
+        char *p = realloc(*buf, move->length);
+        if (!p) {
+            return -1;
+        }
+        *buf = p;
+        *alloc = move->length;
+    }
+
+    if (store_read(store, move->offset, *buf, move->length) != 0) {
+        return -1;
+    }
+    iov.iov_base = *buf;
+    iov.iov_len = move->length;
+    if (store_write(fd, &iov, 1, *end) != 0) {
+        return -1;
+    }
+    move->moved = *end;
+    *end += move->length;
+
+    return 0;
+}
+
+/*
+ * live records are copied into a new file without the lock, records
+ * are never modified once written. the ones appended meanwhile are
+ * copied under the lock, then the new file replaces the old.
+ */
+static int
+store_compact(store_t *store)
+{
+    store_move_t *moves = NULL, *move, key;
+    store_entry_t *entry;
+    size_t count = 0, late, n, i, alloc = 0;
+    uint64_t end = sizeof(store_header_t), snapshot, *moved = NULL;
+    char tmp[PATH_MAX], *buf = NULL;
+    int fd, ret = -1;
+
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", store->path)
+        >= (int)sizeof(tmp)) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&store->lock);
+    for (i = 0; i < STORE_BUCKETS; i++) {
+        for (entry = store->buckets[i]; entry; entry = entry->next) {
+            count++;
+        }
+    }
+    moves = (store_move_t *)malloc((count + 1) * sizeof(store_move_t));
+    if (moves) {
+        for (n = 0, i = 0; i < STORE_BUCKETS; i++) {
+            for (entry = store->buckets[i]; entry; entry = entry->next) {
+                moves[n].offset = entry->offset;
+                moves[n].length = entry->length;
+                n++;
+            }
+        }
+    }
+    snapshot = store->end;
+    pthread_mutex_unlock(&store->lock);
+
+    if (!moves) {
+        return -1;
+    }
+    qsort(moves, count, sizeof(store_move_t), &store_move_compare);
+
+    fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        free(moves);
+        return -1;
+    }
+    if (store_init(fd) != 0) {
+        goto out;
+    }
+
+    for (i = 0; i < count; i++) {
+        if (store_copy(store, fd, &moves[i], &end, &buf, &alloc) != 0) {
+            goto out;
+        }
+    }
+
+    pthread_mutex_lock(&store->lock);
+
+    /* appended since the snapshot, entries are relocated once all fit */
+    for (late = 0, i = 0; i < STORE_BUCKETS; i++) {
+        for (entry = store->buckets[i]; entry; entry = entry->next) {
+            late += (entry->offset >= snapshot);
+        }
+    }
+    moved = (uint64_t *)malloc((late + 1) * sizeof(uint64_t));
+    if (!moved) {
+        pthread_mutex_unlock(&store->lock);
+        goto out;
+    }
+    for (n = 0, i = 0; i < STORE_BUCKETS; i++) {
+        for (entry = store->buckets[i]; entry; entry = entry->next) {
+            if (entry->offset < snapshot) {
+                continue;
+            }
+            key.offset = entry->offset;
+            key.length = entry->length;
+            if (store_copy(store, fd, &key, &end, &buf, &alloc) != 0) {
+                pthread_mutex_unlock(&store->lock);
+                goto out;
+            }
+            moved[n++] = key.moved;
+        }
+    }
+
+    if (fsync(fd) != 0 || flock(fd, LOCK_EX | LOCK_NB) != 0
+        || rename(tmp, store->path) != 0) {
+        pthread_mutex_unlock(&store->lock);
+        goto out;
+    }
+
+    for (n = 0, i = 0; i < STORE_BUCKETS; i++) {
+        for (entry = store->buckets[i]; entry; entry = entry->next) {
+            if (entry->offset >= snapshot) {
+                entry->offset = moved[n++];
+                continue;
+            }
+            key.offset = entry->offset;
+            move = bsearch(&key, moves, count, sizeof(store_move_t),
+                           &store_move_compare);
+            if (move) {
+                entry->offset = move->moved;
+            }
+        }
+    }
+
+    close(store->fd);
+    store->fd = fd;
+    fd = -1;
+    store->end = end;
+    store_map(store, end);
+    ret = 0;
+
+    pthread_mutex_unlock(&store->lock);
+
+  out:
+    if (fd >= 0) {
+        close(fd);
+        unlink(tmp);
+    }
+    free(buf);
+    free(moved);
+    free(moves);
+
+    return ret;
+}
+
+static void *
+store_run(void *arg)
+{
+    store_t *store = (store_t *)arg;
+    struct timespec retry;
+    int ret;
+
+    pthread_mutex_lock(&store->lock);
+    for (;;) {
+        while (!store->stop && !store_garbage(store)) {
+            pthread_cond_wait(&store->cond, &store->lock);
+        }
+        if (store->stop) {
+            break;
+        }
+        pthread_mutex_unlock(&store->lock);
+
+        ret = store_compact(store);
+
+        pthread_mutex_lock(&store->lock);
+        if (ret != 0 && !store->stop) {
+            /* disk full and the like, retried later */
+            clock_gettime(CLOCK_REALTIME, &retry);
+            retry.tv_sec += STORE_COMPACT_RETRY;
+            pthread_cond_timedwait(&store->cond, &store->lock, &retry);
+        }
+    }
+    pthread_mutex_unlock(&store->lock);
+
+    return NULL;
+}
+
+store_t *
+store_open(const char *path)
+{
+    store_header_t header;
+    store_t *store;
+    struct stat st;
+
+    store = (store_t *)calloc(1, sizeof(store_t));
+    if (!store) {
+        return NULL;
+    }
+    store->fd = -1;
+
+    store->buckets = (store_entry_t **)calloc(STORE_BUCKETS,
+                                              sizeof(store_entry_t *));
+    store->path = strdup(path);
+    if (!store->buckets || !store->path) {
+        goto error;
+    }
+
+    store->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (store->fd < 0) {
+        goto error;
+    }
+    /* a single writer */
+    if (flock(store->fd, LOCK_EX | LOCK_NB) != 0 || fstat(store->fd, &st)) {
+        goto error;
+    }
+
+    if ((size_t)st.st_size < sizeof(header)
+        || pread(store->fd, &header, sizeof(header), 0) != sizeof(header)
+        || memcmp(header.magic, STORE_MAGIC, sizeof(header.magic)) != 0
+        || header.version != STORE_VERSION) {
+        /* new, or written by another version */
+        if (store_init(store->fd) != 0) {
+            goto error;
+        }
+        st.st_size = sizeof(header);
+    }
+
+    if (store_scan(store, st.st_size) != 0) {
+        goto error;
+    }
+
+    pthread_mutex_init(&store->lock, NULL);
+    pthread_cond_init(&store->cond, NULL);
+
+    if (pthread_create(&store->thread, NULL, &store_run, store) != 0) {
+        pthread_mutex_destroy(&store->lock);
+        pthread_cond_destroy(&store->cond);
+        goto error;
+    }
+
+    return store;
+
+  error:
+    if (store->buckets) {
+        size_t i;
+        for (i = 0; i < STORE_BUCKETS; i++) {
+            while (store->buckets[i]) {
+                store_remove(store, &store->buckets[i]);
+            }
+        }
+    }
+    if (store->map) {
+        munmap(store->map, store->mapped);
+    }
+    if (store->fd >= 0) {
+        close(store->fd);
+    }
+    free(store->buckets);
+    free(store->path);
+    free(store);
+
+    return NULL;
+}
+
+void
+store_close(store_t *store)
+{
+    size_t i;
+
+    if (!store) {
+        return;
+    }
+
+    pthread_mutex_lock(&store->lock);
+    store->stop = 1;
+    pthread_cond_signal(&store->cond);
+    pthread_mutex_unlock(&store->lock);
+    pthread_join(store->thread, NULL);
+
+    for (i = 0; i < STORE_BUCKETS; i++) {
+        while (store->buckets[i]) {
+            store_remove(store, &store->buckets[i]);
+        }
+    }
+
+    if (store->map) {
+        munmap(store->map, store->mapped);
+    }
+    fsync(store->fd);
+    close(store->fd);
+
+    pthread_mutex_destroy(&store->lock);
+    pthread_cond_destroy(&store->cond);
+    free(store->buckets);
+    free(store->path);
+    free(store);
+}
+
+void *
+store_get(store_t *store, const char *name, unsigned int flags,
+          const struct stat *st, size_t *size)
+{
+    unsigned int hash = store_hash(name, flags);
+    store_entry_t **slot, *entry;
+    size_t name_size = strlen(name);
+    char *data = NULL;
+
+    if (!store) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&store->lock);
+
+    slot = store_find(store, name, flags, hash);
+    entry = *slot;
+    if (!entry) {
+        pthread_mutex_unlock(&store->lock);
+        return NULL;
+    }
+
+    /* changed since it was rendered */
+    if (entry->mtime != (int64_t)st->st_mtime
+        || entry->mtime_nsec != (long)st->st_mtim.tv_nsec
+        || entry->fsize != (int64_t)st->st_size
+        || entry->ino != (uint64_t)st->st_ino) {
+        goto invalid;
+    }
+
+    data = (char *)malloc(entry->data_size ? entry->data_size : 1);
+    if (!data) {
+        pthread_mutex_unlock(&store->lock);
+        return NULL;
+    }
+    if (store_read(store, entry->offset + sizeof(store_record_t)
+                   + name_size, data, entry->data_size) != 0) {
+        goto invalid;
+    }
+    if (!entry->verified) {
+        if (store_sum(store_sum(2166136261U, name, name_size),
+                      data, entry->data_size) != entry->sum) {
+            goto invalid;
+        }
+        entry->verified = 1;
+    }
+    *size = entry->data_size;
+
+    pthread_mutex_unlock(&store->lock);
+
+    return data;
+
+  invalid:
+    store_remove(store, slot);
+    if (store_garbage(store)) {
+        pthread_cond_signal(&store->cond);
+    }
+    pthread_mutex_unlock(&store->lock);
+    free(data);
+
+    return NULL;
+}
+
+int
+store_put(store_t *store, const char *name, unsigned int flags,
+          const struct stat *st, const void *data, size_t size)
+{
+    static const char padding[STORE_ALIGN] = { 0, };
+    store_record_t record;
+    struct iovec iov[4];
+    uint64_t length, offset;
+    size_t name_size = strlen(name);
+    int ret;
+
+    if (!store || name_size == 0 || name_size > PATH_MAX) {
+        return -1;
+    }
+
+    memset(&record, 0, sizeof(record));
+    record.magic = STORE_RECORD_MAGIC;
+    record.name_size = name_size;
+    record.flags = flags;
+    record.data_size = size;
+    record.mtime = st->st_mtime;
+    record.mtime_nsec = st->st_mtim.tv_nsec;
+    record.fsize = st->st_size;
+    record.ino = st->st_ino;
+    record.sum = store_sum(store_sum(2166136261U, name, name_size),
+                           data, size);
+    record.check = store_check(&record);
+
+    length = store_align(sizeof(record) + name_size + size);
+
+    iov[0].iov_base = &record;
+    iov[0].iov_len = sizeof(record);
+    iov[1].iov_base = (void *)name;
+    iov[1].iov_len = name_size;
+    iov[2].iov_base = (void *)data;
+    iov[2].iov_len = size;
+    iov[3].iov_base = (void *)padding;
+    iov[3].iov_len = length - sizeof(record) - name_size - size;
+
+    pthread_mutex_lock(&store->lock);
+
+    offset = store->end;
+    ret = store_write(store->fd, iov, 4, offset);
+    if (ret == 0) {
+        store->end += length;
+        ret = store_index(store, &record, name, offset, length, 1);
+        if (store_garbage(store)) {
+            pthread_cond_signal(&store->cond);
+        }
+    } else if (ftruncate(store->fd, offset) != 0) {
+        /* a partial record is cut off on the next open */
+        ret = -1;
+    }
+
+    pthread_mutex_unlock(&store->lock);
+
+    return ret;
+}
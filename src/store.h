@@ -0,0 +1,24 @@
+#ifndef __MMHD_STORE_H__
+#define __MMHD_STORE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+typedef struct store store_t;
+
+/* reopened after a crash up to the last complete record */
+store_t *store_open(const char *path);
+void store_close(store_t *store);
+
+/*
+ * record of name rendered with flags, checked against the current stat
+ * of the file on access. returns a malloc'ed copy or NULL.
+ */
+void *store_get(store_t *store, const char *name, unsigned int flags,
+                const struct stat *st, size_t *size);
+int store_put(store_t *store, const char *name, unsigned int flags,
+              const struct stat *st, const void *data, size_t size);
+
+#endif
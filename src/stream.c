@@ -0,0 +1,454 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "stream.h"
+#include "contents.h"
+
+#define BLOCK_SIZE 32768  /* 32k page size */
+#define STREAM_BUFFER_SIZE (256 * 1024)
+
+enum {
+    STREAM_HEAD = 0,
+    STREAM_BODY,
+    STREAM_SCRIPT,
+    STREAM_TAIL
+};
+
+typedef struct stream {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int refcount;
+    int done;
+    int error;
+    int closed;
+    /* connection side */
+    struct MHD_Connection *connection;
+    int suspended;
+    style_t *style;
+    const char *script;
+    int stage;
+    size_t offset;
+    /* render side */
+    stream_render_t render;
+    void *arg;
+    size_t pushed;
+    /* html not sent yet, of STREAM_BUFFER_SIZE */
+    char *data;
+    size_t size;
+    size_t sent;
+    struct stream *queue;
+    struct stream *prev;
+    struct stream *next;
+} stream_t;
+
+/* workers rendering queued streams, and the streams with a connection */
+typedef struct stream_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    stream_t *head;
+    stream_t *tail;
+    stream_t *streams;
+    pthread_t *threads;
+    int nthreads;
+    int stop;
+} stream_pool_t;
+
+static stream_pool_t stream_pool = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+    NULL, NULL, NULL, NULL, 0, 0
+};
+
+static void
+stream_release(stream_t *stream)
+{
+    if (__sync_sub_and_fetch(&stream->refcount, 1) != 0) {
+        return;
+    }
+
+    pthread_mutex_destroy(&stream->lock);
+    pthread_cond_destroy(&stream->cond);
+    style_release(stream->style);
+    free(stream->arg);
+    free(stream->data);
+    free(stream);
+}
+
+/* the connection waits for html: resumed, stream->lock held */
+static void
+stream_resume(stream_t *stream)
+{
+    if (stream->suspended && stream->connection) {
+        stream->suspended = 0;
+        MHD_resume_connection(stream->connection);
+    }
+}
+
+/*
+ * queued for the connection, the render waits while the buffer is full:
+ * a slow client holds at most STREAM_BUFFER_SIZE of its page.
+ */
+static void
+stream_push(stream_t *stream, const uint8_t *data, size_t size)
+{
+    size_t len;
+
+    pthread_mutex_lock(&stream->lock);
+
+    while (size > 0 && !stream->closed) {
+        while (stream->size == STREAM_BUFFER_SIZE && stream->sent == 0
+               && !stream->closed) {
+            pthread_cond_wait(&stream->cond, &stream->lock);
+        }
+        if (stream->closed) {
+            break;
+        }
+
+        if (stream->sent) {
+            memmove(stream->data, stream->data + stream->sent,
+                    stream->size - stream->sent);
+            stream->size -= stream->sent;
+            stream->sent = 0;
+        }
+
+        len = STREAM_BUFFER_SIZE - stream->size;
+        if (len > size) {
+            len = size;
+        }
+        memcpy(stream->data + stream->size, data, len);
+        stream->size += len;
+        data += len;
+        size -= len;
+
+        stream_resume(stream);
+    }
+
+    pthread_mutex_unlock(&stream->lock);
+}
+
+static void
+stream_flush(const uint8_t *data, size_t size, void *opaque)
+{
+    stream_t *stream = opaque;
+
+    stream_push(stream, data, size);
+    stream->pushed += size;
+}
+
+/*
+ * the page is rendered and cached by the render callback, blocks are
+ * pushed as they are flushed and the rest once it returns.
+ */
+static void
+stream_run(stream_t *stream)
+{
+    cache_entry_t *entry;
+    fragment_t *fragment;
+
+    entry = stream->render(stream->arg, &stream_flush, stream);
+    free(stream->arg);
+    stream->arg = NULL;
+
+    if (entry) {
+        fragment = (fragment_t *)entry->data;
+        if (stream->pushed < fragment->body_size) {
+            stream_push(stream, (const uint8_t *)fragment->data
+                        + fragment->toc_size + stream->pushed,
+                        fragment->body_size - stream->pushed);
+        }
+        cache_release(entry);
+    }
+
+    pthread_mutex_lock(&stream->lock);
+    stream->done = 1;
+    if (entry == NULL) {
+        stream->error = 1;
+    }
+    stream_resume(stream);
+    pthread_mutex_unlock(&stream->lock);
+}
+
+static void *
+stream_worker(void *arg)
+{
+    stream_t *stream;
+
+    pthread_mutex_lock(&stream_pool.lock);
+
+    while (1) {
+        while (!stream_pool.head && !stream_pool.stop) {
+            pthread_cond_wait(&stream_pool.cond, &stream_pool.lock);
+        }
+        if (stream_pool.stop) {
+            break;
+        }
+
+        stream = stream_pool.head;
+        stream_pool.head = stream->queue;
+        if (!stream_pool.head) {
+            stream_pool.tail = NULL;
+        }
+
+        pthread_mutex_unlock(&stream_pool.lock);
+
+        stream_run(stream);
+        stream_release(stream);
+
+        pthread_mutex_lock(&stream_pool.lock);
+    }
+
+    pthread_mutex_unlock(&stream_pool.lock);
+
+    return NULL;
+}
+
+static ssize_t
+stream_segment(stream_t *stream, const char *data, size_t size,
+               char *buf, size_t max)
+{
+    size_t len = size - stream->offset;
+
+    if (len > max) {
+        len = max;
+    }
+    memcpy(buf, data + stream->offset, len);
+    stream->offset += len;
+
+    return len;
+}
+
+static ssize_t
+stream_output_cb(void *cls, uint64_t pos, char *buf, size_t max)
+{
+    stream_t *stream = cls;
+    style_t *style = stream->style;
+    size_t len;
+    int error;
+
+    if (stream->stage == STREAM_HEAD) {
+        if (stream->offset < style->head) {
+            return stream_segment(stream, style->data, style->head,
+                                  buf, max);
+        }
+        stream->stage = STREAM_BODY;
+        stream->offset = 0;
+    }
+
+    if (stream->stage == STREAM_BODY) {
+        pthread_mutex_lock(&stream->lock);
+
+        if (stream->sent < stream->size) {
+            len = stream->size - stream->sent;
+            if (len > max) {
+                len = max;
+            }
+            memcpy(buf, stream->data + stream->sent, len);
+            stream->sent += len;
+            if (stream->sent == stream->size) {
+                stream->sent = 0;
+                stream->size = 0;
+            }
+            pthread_cond_signal(&stream->cond);
+            pthread_mutex_unlock(&stream->lock);
+            return len;
+        }
+
+        /* off the event loop until the render pushes more */
+        if (!stream->done && !stream->closed) {
+            stream->suspended = 1;
+            MHD_suspend_connection(stream->connection);
+            pthread_mutex_unlock(&stream->lock);
+            return 0;
+        }
+
+        error = stream->error || !stream->done;
+
+        pthread_mutex_unlock(&stream->lock);
+
+        if (error) {
+            return MHD_CONTENT_READER_END_WITH_ERROR;
+        }
+
+        stream->stage = STREAM_SCRIPT;
+        stream->offset = 0;
+    }
+
+    if (stream->stage == STREAM_SCRIPT) {
+        len = stream->script ? strlen(stream->script) : 0;
+        if (stream->offset < len) {
+            return stream_segment(stream, stream->script, len, buf, max);
+        }
+        stream->stage = STREAM_TAIL;
+        stream->offset = 0;
+    }
+
+    if (stream->offset < style->size - style->head) {
+        return stream_segment(stream, style->data + style->head,
+                              style->size - style->head, buf, max);
+    }
+
+    return MHD_CONTENT_READER_END_OF_STREAM;
+}
+
+static void
+stream_free_cb(void *cls)
+{
+    stream_t *stream = cls;
+
+    pthread_mutex_lock(&stream_pool.lock);
+    if (stream->prev) {
+        stream->prev->next = stream->next;
+    } else {
+        stream_pool.streams = stream->next;
+    }
+    if (stream->next) {
+        stream->next->prev = stream->prev;
+    }
+    pthread_mutex_unlock(&stream_pool.lock);
+
+    pthread_mutex_lock(&stream->lock);
+    stream->closed = 1;
+    stream->connection = NULL;
+    pthread_cond_broadcast(&stream->cond);
+    pthread_mutex_unlock(&stream->lock);
+
+    stream_release(stream);
+}
+
+int
+stream_init(int threads)
+{
+    int i;
+
+    stream_pool.threads = (pthread_t *)calloc(threads, sizeof(pthread_t));
+    if (!stream_pool.threads) {
+        return -1;
+    }
+
+    for (i = 0; i < threads; i++) {
+        if (pthread_create(&stream_pool.threads[i], NULL,
+                           &stream_worker, NULL) != 0) {
+            break;
+        }
+    }
+    stream_pool.nthreads = i;
+
+    if (i == 0) {
+        free(stream_pool.threads);
+        stream_pool.threads = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * page of unknown length sent chunked: the style head goes out at once,
+ * the body as a stream worker renders it, then script, if any, and the
+ * style tail. while no html is ready the connection is suspended.
+ */
+struct MHD_Response *
+stream_response(struct MHD_Connection *connection, const char *script,
+                stream_render_t render, void *arg)
+{
+    struct MHD_Response *response;
+    stream_t *stream;
+
+    if (stream_pool.nthreads == 0) {
+        free(arg);
+        return NULL;
+    }
+
+    stream = (stream_t *)calloc(1, sizeof(stream_t));
+    if (!stream) {
+        free(arg);
+        return NULL;
+    }
+
+    stream->data = (char *)malloc(STREAM_BUFFER_SIZE);
+    if (!stream->data) {
+        free(stream);
+        free(arg);
+        return NULL;
+    }
+
+    pthread_mutex_init(&stream->lock, NULL);
+    pthread_cond_init(&stream->cond, NULL);
+    stream->refcount = 1;
+    stream->connection = connection;
+    stream->style = style_get();
+    stream->script = script;
+    stream->render = render;
+    stream->arg = arg;
+
+    response = MHD_create_response_from_callback(MHD_SIZE_UNKNOWN, BLOCK_SIZE,
+                                                 &stream_output_cb, stream,
+                                                 &stream_free_cb);
+    if (response == NULL) {
+        stream_release(stream);
+        return NULL;
+    }
+
+    /* reference of the queue, dropped by the worker */
+    __sync_add_and_fetch(&stream->refcount, 1);
+
+    pthread_mutex_lock(&stream_pool.lock);
+    stream->next = stream_pool.streams;
+    if (stream->next) {
+        stream->next->prev = stream;
+    }
+    stream_pool.streams = stream;
+    if (stream_pool.tail) {
+        stream_pool.tail->queue = stream;
+    } else {
+        stream_pool.head = stream;
+    }
+    stream_pool.tail = stream;
+    pthread_cond_signal(&stream_pool.cond);
+    pthread_mutex_unlock(&stream_pool.lock);
+
+    return response;
+}
+
+void
+stream_stop(void)
+{
+    stream_t *stream;
+
+    pthread_mutex_lock(&stream_pool.lock);
+    for (stream = stream_pool.streams; stream; stream = stream->next) {
+        pthread_mutex_lock(&stream->lock);
+        stream->closed = 1;
+        stream_resume(stream);
+        pthread_cond_broadcast(&stream->cond);
+        pthread_mutex_unlock(&stream->lock);
+    }
+    pthread_mutex_unlock(&stream_pool.lock);
+}
+
+void
+stream_cleanup(void)
+{
+    stream_t *stream;
+    int i;
+
+    pthread_mutex_lock(&stream_pool.lock);
+    stream_pool.stop = 1;
+    pthread_cond_broadcast(&stream_pool.cond);
+    pthread_mutex_unlock(&stream_pool.lock);
+
+    for (i = 0; i < stream_pool.nthreads; i++) {
+        pthread_join(stream_pool.threads[i], NULL);
+    }
+    free(stream_pool.threads);
+    stream_pool.threads = NULL;
+    stream_pool.nthreads = 0;
+
+    /* never rendered, their connections are gone */
+    while ((stream = stream_pool.head) != NULL) {
+        stream_pool.head = stream->queue;
+        stream_release(stream);
+    }
+    stream_pool.tail = NULL;
+}
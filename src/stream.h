@@ -0,0 +1,36 @@
+#ifndef __MMHD_STREAM_H__
+#define __MMHD_STREAM_H__
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <microhttpd.h>
+
+#include "cache.h"
+#include "render.h"
+
+/*
+ * rendered fragment of the page as a referenced entry, from a cache or
+ * rendered with flush given to the render context. called on a stream
+ * worker, arg is freed with free() after it.
+ */
+typedef cache_entry_t *(*stream_render_t)(void *arg, render_flush_t flush,
+                                          void *opaque);
+
+/* threads rendering streamed pages, the connections need suspend/resume */
+int stream_init(int threads);
+
+/* takes arg, also on failure */
+struct MHD_Response *stream_response(struct MHD_Connection *connection,
+                                     const char *script,
+                                     stream_render_t render, void *arg);
+
+/* ends the streams still waiting, before the daemon is stopped */
+void stream_stop(void);
+/* after the daemon is stopped, render threads still use the caches */
+void stream_cleanup(void);
+
+#endif
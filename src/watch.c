@@ -0,0 +1,295 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "config.h"
+
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
+
+#include "watch.h"
+
+#define WATCH_POLL_TIMEOUT 500 /* msec */
+
+/* per directory generations, shared by directories of the same bucket */
+#define WATCH_BUCKETS 4096
+
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE \
+                    | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO          \
+                    | IN_DELETE_SELF | IN_MOVE_SELF                     \
+                    | IN_ONLYDIR | IN_DONT_FOLLOW)
+
+struct watch {
+    int fd;
+    char *root;
+    char **dirs; /* indexed by watch descriptor */
+    size_t *buckets;
+    int ndirs;
+    unsigned long generation;
+    unsigned long dir_generation[WATCH_BUCKETS];
+    void (*file_cb)(const char *path, void *arg);
+    void *file_arg;
+    int failed;
+    int stop;
+    pthread_t thread;
+};
+
+static size_t
+watch_bucket(dev_t dev, ino_t ino)
+{
+    uint64_t key = ((uint64_t)dev << 32) ^ (uint64_t)ino;
+
+    key *= 0x9e3779b97f4a7c15ULL;
+
+    return (size_t)(key >> 32) % WATCH_BUCKETS;
+}
+
+#ifdef HAVE_SYS_INOTIFY_H
+static int
+watch_add(watch_t *watch, const char *dir)
+{
+    char path[PATH_MAX+1];
+    struct dirent *dent;
+    struct stat st;
+    DIR *dp;
+    int wd;
+
+    wd = inotify_add_watch(watch->fd, dir, WATCH_MASK);
+    if (wd < 0) {
+        return -1;
+    }
+
+    if (wd >= watch->ndirs) {
+        int i, ndirs = wd * 2 + 16;
+        char **dirs = realloc(watch->dirs, ndirs * sizeof(char *));
+        size_t *buckets;
+        if (!dirs) {
+            return -1;
+        }
+        watch->dirs = dirs;
+        buckets = realloc(watch->buckets, ndirs * sizeof(size_t));
+        if (!buckets) {
+            return -1;
+        }
+        watch->buckets = buckets;
+        for (i = watch->ndirs; i < ndirs; i++) {
+            dirs[i] = NULL;
+            buckets[i] = 0;
+        }
+        watch->ndirs = ndirs;
+    }
+    free(watch->dirs[wd]);
+    watch->dirs[wd] = strdup(dir);
+    if (!watch->dirs[wd]) {
+        return -1;
+    }
+    if (stat(dir, &st) == 0) {
+        watch->buckets[wd] = watch_bucket(st.st_dev, st.st_ino);
+    }
+
+    dp = opendir(dir);
+    if (!dp) {
+        return 0;
+    }
+
+    while ((dent = readdir(dp)) != NULL) {
+        if (strcmp(dent->d_name, ".") == 0
+            || strcmp(dent->d_name, "..") == 0) {
+            continue;
+        }
+        if (snprintf(path, sizeof(path), "%s/%s", dir, dent->d_name)
+            >= (int)sizeof(path)) {
+            continue;
+        }
+        if (lstat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+            if (watch_add(watch, path) != 0) {
+                closedir(dp);
+                return -1;
+            }
+        }
+    }
+
+    closedir(dp);
+
+    return 0;
+}
+
+static void
+watch_event(watch_t *watch, const struct inotify_event *event)
+{
+    char path[PATH_MAX+1];
+
+    if (event->mask & IN_Q_OVERFLOW) {
+        /* events were lost: pick up directories created meanwhile */
+        if (watch_add(watch, watch->root) != 0) {
+            watch->failed = 1;
+        }
+    } else if (event->mask & IN_IGNORED) {
+        if (event->wd >= 0 && event->wd < watch->ndirs) {
+            free(watch->dirs[event->wd]);
+            watch->dirs[event->wd] = NULL;
+        }
+    } else if ((event->mask & IN_ISDIR)
+               && (event->mask & (IN_CREATE | IN_MOVED_TO))
+               && event->len > 0
+               && event->wd >= 0 && event->wd < watch->ndirs
+               && watch->dirs[event->wd]) {
+        snprintf(path, sizeof(path), "%s/%s",
+                 watch->dirs[event->wd], event->name);
+        if (watch_add(watch, path) != 0) {
+            watch->failed = 1;
+        }
+    }
+
+    /*
+     * a file changed: only lookups in its directory are stale. anything
+     * else (directories created, moved or removed, lost events) may
+     * change how any path resolves.
+     */
+    if (!(event->mask & (IN_ISDIR | IN_Q_OVERFLOW | IN_IGNORED))
+        && event->len > 0
+        && event->wd >= 0 && event->wd < watch->ndirs
+        && watch->dirs[event->wd]) {
+        __sync_add_and_fetch(
+            &watch->dir_generation[watch->buckets[event->wd]], 1);
+    } else {
+        __sync_add_and_fetch(&watch->generation, 1);
+    }
+
+    /* after the generation, the listener may look the file up at once */
+    if (watch->file_cb && !(event->mask & IN_ISDIR)
+        && (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+        && event->len > 0
+        && event->wd >= 0 && event->wd < watch->ndirs
+        && watch->dirs[event->wd]) {
+        snprintf(path, sizeof(path), "%s/%s",
+                 watch->dirs[event->wd], event->name);
+        watch->file_cb(path, watch->file_arg);
+    }
+}
+
+static void *
+watch_run(void *arg)
+{
+    watch_t *watch = (watch_t *)arg;
+    char buf[4096]
+        __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *event;
+    struct pollfd pfd;
+    ssize_t len;
+    char *p;
+
+    pfd.fd = watch->fd;
+    pfd.events = POLLIN;
+
+    while (!watch->stop && !watch->failed) {
+        if (poll(&pfd, 1, WATCH_POLL_TIMEOUT) <= 0) {
+            continue;
+        }
+
+        len = read(watch->fd, buf, sizeof(buf));
+        if (len <= 0) {
+            continue;
+        }
+
+        for (p = buf; p < buf + len;
+             p += sizeof(struct inotify_event) + event->len) {
+            event = (const struct inotify_event *)p;
+            watch_event(watch, event);
+        }
+    }
+
+    return NULL;
+}
+#endif
+
+/*
+ * watches every directory below root and counts the changes, cached
+ * lookups compare the generations instead of calling stat() again.
+ */
+watch_t *
+watch_new(const char *root,
+          void (*file_cb)(const char *path, void *arg), void *arg)
+{
+#ifdef HAVE_SYS_INOTIFY_H
+    watch_t *watch = (watch_t *)calloc(1, sizeof(watch_t));
+    if (!watch) {
+        return NULL;
+    }
+
+    watch->root = strdup(root);
+    watch->file_cb = file_cb;
+    watch->file_arg = arg;
+    watch->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (!watch->root || watch->fd < 0) {
+        free(watch->root);
+        free(watch);
+        return NULL;
+    }
+
+    if (watch_add(watch, root) != 0
+        || pthread_create(&watch->thread, NULL, &watch_run, watch) != 0) {
+        watch->stop = 1;
+        watch_free(watch);
+        return NULL;
+    }
+
+    return watch;
+#else
+    return NULL;
+#endif
+}
+
+void
+watch_free(watch_t *watch)
+{
+    int i;
+
+    if (!watch) {
+        return;
+    }
+
+    if (!watch->stop) {
+        watch->stop = 1;
+        pthread_join(watch->thread, NULL);
+    }
+
+    close(watch->fd);
+    for (i = 0; i < watch->ndirs; i++) {
+        free(watch->dirs[i]);
+    }
+    free(watch->dirs);
+    free(watch->buckets);
+    free(watch->root);
+    free(watch);
+}
+
+/* -1 when the watch is no longer reliable and lookups must stat() */
+int
+watch_generation(watch_t *watch, unsigned long *generation)
+{
+    if (!watch || watch->failed) {
+        return -1;
+    }
+
+    *generation = __sync_add_and_fetch(&watch->generation, 0);
+
+    return 0;
+}
+
+/* changes to the files of the directory dev/ino, see watch_generation() */
+unsigned long
+watch_dir_generation(watch_t *watch, dev_t dev, ino_t ino)
+{
+    return __sync_add_and_fetch(
+        &watch->dir_generation[watch_bucket(dev, ino)], 0);
+}
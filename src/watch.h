@@ -0,0 +1,21 @@
+#ifndef __MMHD_WATCH_H__
+#define __MMHD_WATCH_H__
+
+#include <sys/types.h>
+
+typedef struct watch watch_t;
+
+/* file_cb is called on the watch thread for each file written or moved in */
+watch_t *watch_new(const char *root,
+                   void (*file_cb)(const char *path, void *arg), void *arg);
+void watch_free(watch_t *watch);
+
+/*
+ * changes below root that may move any path: directories created, moved
+ * or removed. -1 when the watch is no longer reliable.
+ */
+int watch_generation(watch_t *watch, unsigned long *generation);
+/* changes to the files of a watched directory */
+unsigned long watch_dir_generation(watch_t *watch, dev_t dev, ino_t ino);
+
+#endif